@@ -0,0 +1,288 @@
+/** @file
+
+  Accept-Encoding scanning and normalization
+
+  @section license License
+
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+  @section description
+    The parts of normalize_ae that do not use the TS API, kept apart so that
+  they can be unit tested. remap_echo picks its precompressed variants with
+  the same scanner, so both plugins read a header alike.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include <array>
+#include <string_view>
+#include <vector>
+
+enum Coding : uint8_t { CODING_BR, CODING_GZIP, CODING_ZSTD, CODING_IDENTITY, N_CODINGS };
+
+inline constexpr std::string_view CODING_NAMES[N_CODINGS] = {"br", "gzip", "zstd", "identity"};
+
+// Longest normalized value: every coding once, separated by ", ".
+inline constexpr size_t MAX_NORMALIZED = 2 + 2 + 4 + 2 + 4 + 2 + 8;
+
+// Character classes for the scanner, looked up once per byte instead of
+// testing each delimiter in turn.
+enum : uint8_t {
+  CC_OWS   = 1 << 0,
+  CC_COMMA = 1 << 1,
+  CC_SEMI  = 1 << 2,
+};
+
+inline constexpr std::array<uint8_t, 256> CHAR_CLASS = [] {
+  std::array<uint8_t, 256> table{};
+  table[' ']  = CC_OWS;
+  table['\t'] = CC_OWS;
+  table[',']  = CC_COMMA;
+  table[';']  = CC_SEMI;
+  return table;
+}();
+
+inline uint8_t
+CharClass(char c)
+{
+  return CHAR_CLASS[static_cast<unsigned char>(c)];
+}
+
+// The qualities, in thousandths, that an Accept-Encoding value gives to each
+// coding we know about. -1 means the value does not mention the coding.
+struct AcceptedCodings {
+  std::array<int16_t, N_CODINGS> quality;
+  int16_t wildcard = -1;
+
+  AcceptedCodings() { quality.fill(-1); }
+
+  int
+  qualityOf(Coding coding) const
+  {
+    if (quality[coding] >= 0) {
+      return quality[coding];
+    }
+    if (wildcard >= 0) {
+      return wildcard;
+    }
+    // identity is acceptable unless excluded explicitly (RFC 9110 12.5.3).
+    return coding == CODING_IDENTITY ? 1000 : 0;
+  }
+};
+
+// Compares token, of the same length as lower, against the lower-case
+// literal lower. Setting bit 0x20 folds ASCII letters to lower case and
+// leaves the digits and '-' that coding names contain unchanged.
+inline bool
+EqualsLower(const char *token, const char *lower, size_t len)
+{
+  uint8_t diff = 0;
+  for (size_t i = 0; i < len; ++i) {
+    diff |= static_cast<uint8_t>((token[i] | 0x20) ^ lower[i]);
+  }
+  return diff == 0;
+}
+
+inline constexpr int CODING_WILDCARD = N_CODINGS;
+inline constexpr int CODING_UNKNOWN  = -1;
+
+// Classifies a content-coding token by its length first, so most tokens are
+// compared against at most two names.
+inline int
+MatchCoding(const char *token, size_t len)
+{
+  switch (len) {
+  case 1:
+    return token[0] == '*' ? CODING_WILDCARD : CODING_UNKNOWN;
+  case 2:
+    return EqualsLower(token, "br", 2) ? CODING_BR : CODING_UNKNOWN;
+  case 4:
+    if (EqualsLower(token, "gzip", 4)) {
+      return CODING_GZIP;
+    }
+    return EqualsLower(token, "zstd", 4) ? CODING_ZSTD : CODING_UNKNOWN;
+  case 6:
+    // x-gzip is an alias of gzip (RFC 9110 8.4.1.3).
+    return EqualsLower(token, "x-gzip", 6) ? CODING_GZIP : CODING_UNKNOWN;
+  case 8:
+    return EqualsLower(token, "identity", 8) ? CODING_IDENTITY : CODING_UNKNOWN;
+  default:
+    return CODING_UNKNOWN;
+  }
+}
+
+// Parses the weight out of the parameters of one Accept-Encoding element,
+// [p, end) being what follows its first ';'. Returns the quality in
+// thousandths; 1000 when there is no q parameter and 0 when it is malformed.
+inline int
+ParseQuality(const char *p, const char *end)
+{
+  while (p < end) {
+    while (p < end && (CharClass(*p) & (CC_OWS | CC_SEMI))) {
+      ++p;
+    }
+    const char *param_end = static_cast<const char *>(memchr(p, ';', end - p));
+    if (!param_end) {
+      param_end = end;
+    }
+    if (param_end - p >= 2 && (p[0] | 0x20) == 'q' && p[1] == '=') {
+      p += 2;
+      while (param_end > p && (CharClass(param_end[-1]) & CC_OWS)) {
+        --param_end;
+      }
+      size_t len = param_end - p;
+      if (len == 0 || len > 5 || (p[0] != '0' && p[0] != '1') || (len > 1 && p[1] != '.')) {
+        return 0;
+      }
+      int quality = (p[0] - '0') * 1000;
+      int scale   = 100;
+      for (size_t i = 2; i < len; ++i) {
+        int digit = p[i] - '0';
+        if (digit < 0 || digit > 9) {
+          return 0;
+        }
+        quality += digit * scale;
+        scale   /= 10;
+      }
+      return quality > 1000 ? 0 : quality;
+    }
+    p = param_end;
+  }
+  return 1000;
+}
+
+// Records the codings in one Accept-Encoding value. The scanner finds each
+// element's end with memchr, which the C library vectorizes, and classifies
+// bytes through CHAR_CLASS, so it does not step through the value once per
+// delimiter it is looking for.
+inline void
+ScanAcceptEncoding(const char *p, const char *end, AcceptedCodings &accepted)
+{
+  while (p < end) {
+    while (p < end && (CharClass(*p) & (CC_OWS | CC_COMMA))) {
+      ++p;
+    }
+    if (p == end) {
+      break;
+    }
+
+    const char *element_end = static_cast<const char *>(memchr(p, ',', end - p));
+    if (!element_end) {
+      element_end = end;
+    }
+
+    const char *token_end = p;
+    while (token_end < element_end && !(CharClass(*token_end) & (CC_OWS | CC_SEMI))) {
+      ++token_end;
+    }
+
+    int coding = MatchCoding(p, token_end - p);
+    if (coding != CODING_UNKNOWN) {
+      const char *semi = static_cast<const char *>(memchr(token_end, ';', element_end - token_end));
+      int quality      = semi ? ParseQuality(semi + 1, element_end) : 1000;
+      if (coding == CODING_WILDCARD) {
+        accepted.wildcard = quality;
+      } else {
+        accepted.quality[coding] = quality;
+      }
+    }
+    p = element_end;
+  }
+}
+
+struct NormalizePolicy {
+  // The preferred codings, most preferred first. Each may appear only once,
+  // which is what keeps a normalized value within MAX_NORMALIZED.
+  std::vector<Coding> codings{CODING_BR, CODING_GZIP};
+  bool combine = false;
+
+  // Writes the normalized value for accepted into out, which must hold
+  // MAX_NORMALIZED bytes, and returns it. An empty result means the header
+  // should be removed.
+  std::string_view
+  normalize(const AcceptedCodings &accepted, char *out) const
+  {
+    char *p = out;
+    for (Coding coding : codings) {
+      if (accepted.qualityOf(coding) <= 0) {
+        continue;
+      }
+      if (p != out) {
+        *p++ = ',';
+        *p++ = ' ';
+      }
+      std::string_view name = CODING_NAMES[coding];
+      memcpy(p, name.data(), name.size());
+      p += name.size();
+      if (!combine) {
+        break;
+      }
+    }
+    return {out, static_cast<size_t>(p - out)};
+  }
+};
+
+// Parses the comma-separated value of --codings into codings. Fails on an
+// empty list, on a name other than br, gzip, zstd or identity, and on a
+// coding listed twice.
+inline bool
+ParseCodings(std::string_view list, std::vector<Coding> &codings)
+{
+  codings.clear();
+  std::array<bool, N_CODINGS> seen{};
+  while (!list.empty()) {
+    size_t comma          = list.find(',');
+    std::string_view name = list.substr(0, comma);
+    list.remove_prefix(comma == std::string_view::npos ? list.size() : comma + 1);
+
+    int coding = MatchCoding(name.data(), name.size());
+    // x-gzip is only accepted from clients; the normalized value says gzip.
+    if (coding == CODING_UNKNOWN || coding == CODING_WILDCARD || name.size() != CODING_NAMES[coding].size() ||
+        seen[coding]) {
+      return false;
+    }
+    seen[coding] = true;
+    codings.push_back(static_cast<Coding>(coding));
+  }
+  return !codings.empty();
+}
+
+// Sets policy to the preset --ats-mode=mode. Returns false for an unknown mode.
+inline bool
+ApplyAtsMode(int mode, NormalizePolicy &policy)
+{
+  switch (mode) {
+  case 1:
+    policy.codings = {CODING_GZIP};
+    break;
+  case 2:
+  case 3:
+    policy.codings = {CODING_BR, CODING_GZIP};
+    break;
+  case 4:
+  case 5:
+    policy.codings = {CODING_ZSTD, CODING_BR, CODING_GZIP};
+    break;
+  default:
+    return false;
+  }
+  policy.combine = mode == 3 || mode == 5;
+  return true;
+}
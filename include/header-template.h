@@ -0,0 +1,218 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "ts/ts.h"
+
+// The transaction a HeaderTemplate is rendered for. url_loc may be left as
+// TS_NULL_MLOC, in which case it is looked up from hdr_loc only if a
+// template needs the path.
+struct TemplateRequest {
+  TSHttpTxn txn;
+  TSMBuffer bufp;
+  TSMLoc hdr_loc;
+  TSMLoc url_loc = TS_NULL_MLOC;
+};
+
+// A header value with %{name} variables, compiled once at load into literal
+// and variable segments. Rendering writes the segments into a caller-supplied
+// buffer without allocating, and evaluates only the variables the value
+// contains. A value without variables renders to itself without a copy.
+//
+// Variables:
+//   %{client-ip}  the client address, as text
+//   %{now-epoch}  the current time in seconds since the epoch
+//   %{req-id}     the transaction id
+//   %{path-hash}  the 64-bit FNV-1a hash of the request path, in hex
+//   %{remap-tag}  the tag given to compile(); fixed when the value is compiled
+//   %{%}          a literal '%'; write %{%}{ for a literal "%{"
+class HeaderTemplate
+{
+public:
+  // The largest value render() may write into its buffer. Values with
+  // variables that could grow beyond it are rejected by compile(), so callers
+  // can render into a stack buffer. Values without variables are rendered
+  // from the template itself and may be of any length.
+  static constexpr size_t MAX_SIZE = 4096;
+
+  // Compiles spec. Returns an empty string on success, or a description of
+  // what is wrong with spec.
+  std::string
+  compile(std::string_view spec, std::string_view remap_tag = {})
+  {
+    text_.clear();
+    segments_.clear();
+    max_size_ = 0;
+
+    while (!spec.empty()) {
+      auto open = spec.find("%{");
+      if (open == std::string_view::npos) {
+        addLiteral(spec);
+        break;
+      }
+      addLiteral(spec.substr(0, open));
+      auto close = spec.find('}', open);
+      if (close == std::string_view::npos) {
+        return "unterminated variable";
+      }
+      std::string_view name = spec.substr(open + 2, close - open - 2);
+      spec.remove_prefix(close + 1);
+
+      if (name == "%") {
+        addLiteral("%");
+      } else if (name == "remap-tag") {
+        if (remap_tag.empty()) {
+          return "remap-tag is only available in remap rules";
+        }
+        addLiteral(remap_tag);
+      } else if (name == "client-ip") {
+        addVariable(Segment::ClientIp, INET6_ADDRSTRLEN);
+      } else if (name == "now-epoch") {
+        addVariable(Segment::NowEpoch, UINT64_DIGITS);
+      } else if (name == "req-id") {
+        addVariable(Segment::ReqId, UINT64_DIGITS);
+      } else if (name == "path-hash") {
+        addVariable(Segment::PathHash, 16);
+      } else {
+        return "unknown variable %{" + std::string{name} + "}";
+      }
+    }
+
+    if (!isLiteral() && max_size_ > MAX_SIZE) {
+      return "value may expand beyond " + std::to_string(MAX_SIZE) + " bytes";
+    }
+    return {};
+  }
+
+  bool
+  isLiteral() const
+  {
+    return segments_.size() == 1 && segments_.front().kind == Segment::Literal;
+  }
+
+  // Renders the value for rq into buf, which must hold MAX_SIZE bytes. A value
+  // without variables is returned as is, without touching buf.
+  std::string_view
+  render(const TemplateRequest &rq, char *buf) const
+  {
+    if (segments_.empty()) {
+      return {};
+    }
+    if (isLiteral()) {
+      return text_;
+    }
+
+    char *p = buf;
+    for (const Segment &seg : segments_) {
+      switch (seg.kind) {
+      case Segment::Literal:
+        p = std::copy_n(text_.data() + seg.offset, seg.length, p);
+        break;
+      case Segment::ClientIp:
+        p = writeClientIp(rq, p);
+        break;
+      case Segment::NowEpoch:
+        p = std::to_chars(p, buf + MAX_SIZE, static_cast<uint64_t>(time(nullptr))).ptr;
+        break;
+      case Segment::ReqId:
+        p = std::to_chars(p, buf + MAX_SIZE, TSHttpTxnIdGet(rq.txn)).ptr;
+        break;
+      case Segment::PathHash:
+        p = writePathHash(rq, p);
+        break;
+      }
+    }
+    return {buf, static_cast<size_t>(p - buf)};
+  }
+
+private:
+  static constexpr size_t UINT64_DIGITS = 20;
+
+  struct Segment {
+    enum Kind { Literal, ClientIp, NowEpoch, ReqId, PathHash };
+
+    Kind kind;
+    size_t offset = 0; // into text_, for Literal
+    size_t length = 0;
+  };
+
+  void
+  addLiteral(std::string_view literal)
+  {
+    if (literal.empty()) {
+      return;
+    }
+    if (!segments_.empty() && segments_.back().kind == Segment::Literal) {
+      segments_.back().length += literal.size();
+    } else {
+      segments_.push_back({Segment::Literal, text_.size(), literal.size()});
+    }
+    text_.append(literal);
+    max_size_ += literal.size();
+  }
+
+  void
+  addVariable(Segment::Kind kind, size_t max_size)
+  {
+    segments_.push_back({kind});
+    max_size_ += max_size;
+  }
+
+  static char *
+  writeClientIp(const TemplateRequest &rq, char *p)
+  {
+    const sockaddr *addr = TSHttpTxnClientAddrGet(rq.txn);
+    const void *in_addr  = nullptr;
+    if (addr && addr->sa_family == AF_INET) {
+      in_addr = &reinterpret_cast<const sockaddr_in *>(addr)->sin_addr;
+    } else if (addr && addr->sa_family == AF_INET6) {
+      in_addr = &reinterpret_cast<const sockaddr_in6 *>(addr)->sin6_addr;
+    }
+    if (!in_addr || !inet_ntop(addr->sa_family, in_addr, p, INET6_ADDRSTRLEN)) {
+      return p;
+    }
+    return p + strlen(p);
+  }
+
+  static char *
+  writePathHash(const TemplateRequest &rq, char *p)
+  {
+    TSMLoc url_loc = rq.url_loc;
+    if (url_loc == TS_NULL_MLOC && TSHttpHdrUrlGet(rq.bufp, rq.hdr_loc, &url_loc) != TS_SUCCESS) {
+      return p;
+    }
+
+    int len          = 0;
+    const char *path = TSUrlPathGet(rq.bufp, url_loc, &len);
+    uint64_t hash    = 0xcbf29ce484222325;
+    for (int i = 0; path && i < len; ++i) {
+      hash ^= static_cast<unsigned char>(path[i]);
+      hash *= 0x100000001b3;
+    }
+    if (url_loc != rq.url_loc) {
+      TSHandleMLocRelease(rq.bufp, rq.hdr_loc, url_loc);
+    }
+
+    static constexpr char HEX[] = "0123456789abcdef";
+    for (int shift = 60; shift >= 0; shift -= 4) {
+      *p++ = HEX[(hash >> shift) & 0xf];
+    }
+    return p;
+  }
+
+  std::string text_;
+  std::vector<Segment> segments_;
+  size_t max_size_ = 0;
+};
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// The live instances of a remap plugin, for code that needs to reach all of
+// them, such as stats collection or config fan-out from hook threads.
+//
+// Readers take a snapshot: an immutable list that holds a reference to each
+// instance it contains. An instance stays valid for as long as any snapshot
+// containing it is held. Taking a snapshot never waits on the writers'
+// mutex, so a reader is not held up while a writer copies the list. It is
+// not lock-free, though: libstdc++ implements std::atomic<std::shared_ptr>
+// with a short internal spin lock around each load and store, so a reader
+// may briefly wait for another reader or for the writer's final store.
+// add() and remove() run only from TSRemapNewInstance and
+// TSRemapDeleteInstance. They serialize among themselves and publish a new
+// list, so an instance removed on a config reload is destroyed once the last
+// reader is done with it rather than while it is being iterated.
+template <typename T> class InstanceRegistry
+{
+public:
+  using Snapshot = std::vector<std::shared_ptr<T>>;
+
+  // Registers instance and returns it as a raw pointer, suitable for the
+  // instance handle of TSRemapNewInstance.
+  T *
+  add(std::shared_ptr<T> instance)
+  {
+    std::lock_guard lock{writer_mutex_};
+    auto next = std::make_shared<Snapshot>(*snapshot_.load());
+    next->push_back(instance);
+    snapshot_.store(std::move(next));
+    return instance.get();
+  }
+
+  // Unregisters instance. It is destroyed when no snapshot refers to it.
+  void
+  remove(const T *instance)
+  {
+    std::lock_guard lock{writer_mutex_};
+    auto current = snapshot_.load();
+    auto next    = std::make_shared<Snapshot>();
+    next->reserve(current->size());
+    std::copy_if(current->begin(), current->end(), std::back_inserter(*next),
+                 [instance](const std::shared_ptr<T> &p) { return p.get() != instance; });
+    snapshot_.store(std::move(next));
+  }
+
+  // Returns the current list. Hold it only as long as needed: the instances
+  // it refers to, including removed ones, live until it is released.
+  std::shared_ptr<const Snapshot>
+  snapshot() const
+  {
+    return snapshot_.load();
+  }
+
+  // Calls f(instance) for every instance of the current list.
+  template <typename F>
+  void
+  forEach(F &&f) const
+  {
+    auto current = snapshot();
+    for (const auto &instance : *current) {
+      f(*instance);
+    }
+  }
+
+  size_t
+  size() const
+  {
+    return snapshot()->size();
+  }
+
+private:
+  std::mutex writer_mutex_;
+  std::atomic<std::shared_ptr<const Snapshot>> snapshot_{std::make_shared<const Snapshot>()};
+};
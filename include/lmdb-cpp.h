@@ -4,16 +4,31 @@ extern "C" {
 #include <lmdb.h>
 }
 
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <concepts>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <new>
 #include <span>
+#include <stdexcept>
+#include <string>
 #include <string_view>
 #include <system_error>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 
 namespace LMDB
 {
 
 class Env;
 class Txn;
+class Cursor;
 
 class RuntimeError : public std::runtime_error
 {
@@ -75,6 +90,7 @@ private:
 
   MDB_val val_;
   friend class Txn;
+  friend class Cursor;
 };
 
 template <typename T>
@@ -83,6 +99,233 @@ concept IsConvertibleToByteSpanOrStringView = (std::is_convertible_v<T, ByteSpan
 template <typename T>
 concept IsConvertibleFromByteSpanOrStringView = (std::is_convertible_v<ByteSpan, T> || std::is_convertible_v<std::string_view, T>);
 
+class CodecError : public std::runtime_error
+{
+public:
+  using std::runtime_error::runtime_error;
+};
+
+// A codec maps a value_type to the bytes stored in LMDB and back without
+// allocating. encode() returns something viewable as a ByteSpan that must be
+// kept alive until the bytes are passed to LMDB; decode() throws CodecError
+// when the stored bytes do not have the expected size. Codecs with a
+// compile-time constant size also define fixed_size.
+template <typename C>
+concept Codec = requires(const typename C::value_type &value, ByteSpan bytes) {
+  { C::encode(value) } -> std::convertible_to<ByteSpan>;
+  { C::decode(bytes) } -> std::convertible_to<typename C::value_type>;
+};
+
+template <typename C>
+concept FixedSizeCodec = Codec<C> && requires {
+  { C::fixed_size } -> std::convertible_to<size_t>;
+};
+
+namespace detail
+{
+  constexpr void
+  check_size(ByteSpan bytes, size_t size)
+  {
+    if (bytes.size() != size) {
+      throw CodecError{"LMDB codec: stored value has " + std::to_string(bytes.size()) + " bytes, expected " +
+                       std::to_string(size)};
+    }
+  }
+} // namespace detail
+
+// Integers stored most significant byte first, so that LMDB's default memcmp
+// key order matches numeric order. Signed values have their sign bit flipped
+// so that negative numbers sort before positive ones.
+template <std::integral T> struct BigEndian {
+  using value_type                    = T;
+  static constexpr size_t fixed_size  = sizeof(T);
+  using encoded_type                  = std::array<std::byte, fixed_size>;
+  using unsigned_type                 = std::make_unsigned_t<T>;
+  static constexpr unsigned_type BIAS = std::is_signed_v<T> ? unsigned_type{1} << (8 * sizeof(T) - 1) : 0;
+
+  static constexpr encoded_type
+  encode(T value)
+  {
+    unsigned_type u = static_cast<unsigned_type>(value) ^ BIAS;
+    encoded_type out{};
+    for (size_t i = fixed_size; i-- > 0; u >>= 8) {
+      out[i] = static_cast<std::byte>(u & 0xff);
+    }
+    return out;
+  }
+
+  static constexpr T
+  decode(ByteSpan bytes)
+  {
+    detail::check_size(bytes, fixed_size);
+    unsigned_type u = 0;
+    for (size_t i = 0; i < fixed_size; ++i) {
+      u = static_cast<unsigned_type>((u << 8) | std::to_integer<unsigned_type>(bytes[i]));
+    }
+    return static_cast<T>(u ^ BIAS);
+  }
+};
+
+// Plain bytes, for string keys or values used alongside the typed codecs. The
+// decoded view points into the map and is only valid during the transaction.
+struct String {
+  using value_type = std::string_view;
+
+  static ByteSpan
+  encode(std::string_view value)
+  {
+    return std::as_bytes(std::span{value.data(), value.size()});
+  }
+
+  static std::string_view
+  decode(ByteSpan bytes)
+  {
+    return std::string_view{reinterpret_cast<const char *>(bytes.data()), bytes.size()};
+  }
+};
+
+// A trivially-copyable struct stored as its object representation. Padding
+// bytes are stored as they are, so prefer structs without padding, and never
+// use one with padding as a key. encode() views the value in place; decode()
+// copies it out, because LMDB only guarantees 2-byte alignment for data.
+// view() avoids the copy when the stored bytes happen to be suitably aligned.
+template <typename T>
+  requires std::is_trivially_copyable_v<T>
+struct Trivial {
+  using value_type                   = T;
+  static constexpr size_t fixed_size = sizeof(T);
+
+  static ByteSpan
+  encode(const T &value)
+  {
+    return std::as_bytes(std::span{&value, 1});
+  }
+
+  static T
+  decode(ByteSpan bytes)
+  {
+    detail::check_size(bytes, fixed_size);
+    T value;
+    std::memcpy(&value, bytes.data(), fixed_size);
+    return value;
+  }
+
+  // Returns the stored value in place, or nullptr if it is not aligned for T.
+  static const T *
+  view(ByteSpan bytes)
+  {
+    detail::check_size(bytes, fixed_size);
+    if (reinterpret_cast<std::uintptr_t>(bytes.data()) % alignof(T) != 0) {
+      return nullptr;
+    }
+    return std::launder(reinterpret_cast<const T *>(bytes.data()));
+  }
+};
+
+// A composite key made of fixed-size codecs, encoded back to back so that keys
+// sort by the first element, then the second, and so on.
+template <FixedSizeCodec... Cs> struct Tuple {
+  using value_type                   = std::tuple<typename Cs::value_type...>;
+  static constexpr size_t fixed_size = (Cs::fixed_size + ...);
+  using encoded_type                 = std::array<std::byte, fixed_size>;
+
+  static constexpr encoded_type
+  encode(const value_type &value)
+  {
+    encoded_type out{};
+    encode_each(value, out, std::index_sequence_for<Cs...>{});
+    return out;
+  }
+
+  static constexpr value_type
+  decode(ByteSpan bytes)
+  {
+    detail::check_size(bytes, fixed_size);
+    return decode_each(bytes, std::index_sequence_for<Cs...>{});
+  }
+
+private:
+  template <size_t I>
+  static constexpr size_t
+  offset()
+  {
+    constexpr size_t sizes[] = {Cs::fixed_size...};
+    size_t offset            = 0;
+    for (size_t i = 0; i < I; ++i) {
+      offset += sizes[i];
+    }
+    return offset;
+  }
+
+  template <size_t... I>
+  static constexpr void
+  encode_each(const value_type &value, encoded_type &out, std::index_sequence<I...>)
+  {
+    (
+      [&] {
+        auto encoded  = Cs::encode(std::get<I>(value));
+        ByteSpan part = encoded;
+        std::copy(part.begin(), part.end(), out.begin() + offset<I>());
+      }(),
+      ...);
+  }
+
+  template <size_t... I>
+  static constexpr value_type
+  decode_each(ByteSpan bytes, std::index_sequence<I...>)
+  {
+    return value_type{Cs::decode(bytes.subspan(offset<I>(), Cs::fixed_size))...};
+  }
+};
+
+// A Cursor must be destroyed before the Txn it was opened in is committed or
+// aborted.
+class Cursor
+{
+public:
+  ~Cursor() noexcept
+  {
+    if (cursor_) {
+      mdb_cursor_close(cursor_);
+    }
+  }
+  Cursor(const Cursor &)            = delete;
+  Cursor &operator=(const Cursor &) = delete;
+  Cursor(Cursor &&other) noexcept : cursor_{std::exchange(other.cursor_, nullptr)} {}
+  Cursor &operator=(Cursor &&) = delete;
+
+  // Positions the cursor with op (MDB_FIRST, MDB_NEXT, ...) and returns the
+  // key and data there. The views point into the map and are only valid until
+  // the next write in this transaction.
+  template <typename K, typename V>
+    requires(IsConvertibleFromByteSpanOrStringView<K> && IsConvertibleFromByteSpanOrStringView<V>)
+  [[nodiscard]] bool
+  may_get(K &key, V &data, MDB_cursor_op op)
+  {
+    Val key_val;
+    Val data_val;
+    int err = mdb_cursor_get(cursor_, &key_val.val_, &data_val.val_, op);
+    if (err == MDB_NOTFOUND) {
+      return false;
+    }
+    may_throw(err);
+    key  = static_cast<K>(key_val);
+    data = static_cast<V>(data_val);
+    return true;
+  }
+
+  void
+  del(unsigned int flags = 0)
+  {
+    may_throw(mdb_cursor_del(cursor_, flags));
+  }
+
+private:
+  Cursor() : cursor_{nullptr} {}
+  MDB_cursor *cursor_;
+  friend class Txn;
+};
+
 class Txn
 {
 public:
@@ -145,6 +388,73 @@ public:
     may_throw(mdb_put(txn_, dbi.dbi_, &key_val.val_, &data_val.val_, flags));
   }
 
+  // Typed counterparts of may_get/get/put/del/may_del, encoding the key and
+  // data with the given codecs, e.g. put<BigEndian<uint32_t>, Trivial<Stats>>().
+  template <Codec KC, Codec VC>
+  [[nodiscard]] bool
+  may_get(Dbi dbi, const typename KC::value_type &key, typename VC::value_type &data)
+  {
+    auto encoded_key = KC::encode(key);
+    ByteSpan bytes;
+    if (!may_get<ByteSpan, ByteSpan>(dbi, encoded_key, bytes)) {
+      return false;
+    }
+    data = VC::decode(bytes);
+    return true;
+  }
+
+  template <Codec KC, Codec VC>
+  typename VC::value_type
+  get(Dbi dbi, const typename KC::value_type &key)
+  {
+    auto encoded_key = KC::encode(key);
+    Val key_val{ByteSpan{encoded_key}};
+    Val data_val;
+    may_throw(mdb_get(txn_, dbi.dbi_, &key_val.val_, &data_val.val_));
+    return VC::decode(data_val);
+  }
+
+  template <Codec KC, Codec VC>
+  void
+  put(Dbi dbi, const typename KC::value_type &key, const typename VC::value_type &data, unsigned int flags = 0)
+  {
+    auto encoded_key  = KC::encode(key);
+    auto encoded_data = VC::encode(data);
+    put<ByteSpan, ByteSpan>(dbi, encoded_key, encoded_data, flags);
+  }
+
+  template <Codec KC>
+  void
+  del(Dbi dbi, const typename KC::value_type &key)
+  {
+    auto encoded_key = KC::encode(key);
+    del<ByteSpan>(dbi, encoded_key);
+  }
+
+  template <Codec KC>
+  [[nodiscard]] bool
+  may_del(Dbi dbi, const typename KC::value_type &key)
+  {
+    auto encoded_key = KC::encode(key);
+    return may_del<ByteSpan>(dbi, encoded_key);
+  }
+
+  // Reserves size bytes for the data of key and returns the space, which the
+  // caller must fill in before the next update in this transaction. This lets
+  // a record be serialized straight into the page instead of being built in a
+  // separate buffer and copied by put().
+  template <typename K>
+    requires IsConvertibleToByteSpanOrStringView<K>
+  std::span<std::byte>
+  reserve(Dbi dbi, K key, size_t size, unsigned int flags = 0)
+  {
+    Val key_val{key};
+    Val data_val;
+    data_val.val_.mv_size = size;
+    may_throw(mdb_put(txn_, dbi.dbi_, &key_val.val_, &data_val.val_, flags | MDB_RESERVE));
+    return std::span<std::byte>{static_cast<std::byte *>(data_val.val_.mv_data), data_val.val_.mv_size};
+  }
+
   template <typename K>
     requires IsConvertibleToByteSpanOrStringView<K>
   void
@@ -168,6 +478,22 @@ public:
     return true;
   }
 
+  Cursor
+  open_cursor(Dbi dbi)
+  {
+    Cursor cursor;
+    may_throw(mdb_cursor_open(txn_, dbi.dbi_, &cursor.cursor_));
+    return cursor;
+  }
+
+  MDB_stat
+  stat(Dbi dbi)
+  {
+    MDB_stat stat;
+    may_throw(mdb_stat(txn_, dbi.dbi_, &stat));
+    return stat;
+  }
+
   void
   commit()
   {
@@ -205,6 +531,10 @@ private:
 class Env
 {
 public:
+  const static unsigned int RDONLY    = MDB_RDONLY;
+  const static unsigned int NOTLS     = MDB_NOTLS;
+  const static unsigned int NORDAHEAD = MDB_NORDAHEAD;
+
   Env() noexcept : env_{nullptr} {}
   ~Env() noexcept { mdb_env_close(env_); }
   Env(const Env &)            = delete;
@@ -237,9 +567,105 @@ public:
   }
 
   void
-  open(const char *dir_name, unsigned int flags = 0, mdb_mode_t mode = 0600)
+  open(const char *dir_name, unsigned int flags = NOTLS, mdb_mode_t mode = 0600)
+  {
+    may_throw(mdb_env_open(env_, dir_name, flags, mode));
+  }
+
+  MDB_envinfo
+  info()
+  {
+    MDB_envinfo info;
+    may_throw(mdb_env_info(env_, &info));
+    return info;
+  }
+
+  MDB_stat
+  stat()
+  {
+    MDB_stat stat;
+    may_throw(mdb_env_stat(env_, &stat));
+    return stat;
+  }
+
+  // Clears reader slots left behind by dead processes and returns how many
+  // were cleared.
+  int
+  reader_check()
+  {
+    int dead = 0;
+    may_throw(mdb_reader_check(env_, &dead));
+    return dead;
+  }
+
+  // Returns how many reader slots are held by live transactions now. Unlike
+  // MDB_envinfo::me_numreaders, which only grows, this drops again when
+  // readers finish. mdb_reader_list reports one line per held slot, after a
+  // header line; only the slot lines start with a process id.
+  int
+  reader_count()
+  {
+    int count = 0;
+    may_throw(mdb_reader_list(
+      env_,
+      [](const char *msg, void *ctx) -> int {
+        msg += strspn(msg, " ");
+        if (*msg >= '0' && *msg <= '9') {
+          ++*static_cast<int *>(ctx);
+        }
+        return 0;
+      },
+      &count));
+    return count;
+  }
+
+  // Returns the part of the memory map holding the pages written so far, which
+  // is usually much smaller than the configured map size.
+  ByteSpan
+  used_map()
+  {
+    MDB_envinfo env_info = info();
+    size_t used          = (env_info.me_last_pgno + 1) * stat().ms_psize;
+    return ByteSpan{static_cast<const std::byte *>(env_info.me_mapaddr), std::min(used, env_info.me_mapsize)};
+  }
+
+  // Asks the kernel to start reading the used part of the map into the page
+  // cache. This only schedules I/O and returns immediately.
+  void
+  advise_willneed()
   {
-    may_throw(mdb_env_open(env_, dir_name, flags | MDB_NOTLS, mode));
+    ByteSpan map = used_map();
+    if (madvise(const_cast<std::byte *>(map.data()), map.size(), MADV_WILLNEED) != 0) {
+      throw std::system_error{errno, std::generic_category(), "madvise"};
+    }
+  }
+
+  // Faults in and locks the used part of the map into memory. Pages written
+  // after this call are not locked. Fails unless RLIMIT_MEMLOCK allows it.
+  void
+  lock_map()
+  {
+    ByteSpan map = used_map();
+    if (mlock(map.data(), map.size()) != 0) {
+      throw std::system_error{errno, std::generic_category(), "mlock"};
+    }
+  }
+
+  // Reads one byte from every page of the used part of the map so that the
+  // page tables of this process are populated before the first lookups.
+  // Returns the number of pages touched.
+  size_t
+  touch_pages()
+  {
+    ByteSpan map       = used_map();
+    size_t page_size   = stat().ms_psize;
+    size_t pages       = 0;
+    std::byte checksum = std::byte{0};
+    for (size_t offset = 0; offset < map.size(); offset += page_size, ++pages) {
+      checksum ^= *static_cast<const volatile std::byte *>(&map[offset]);
+    }
+    static_cast<void>(checksum);
+    return pages;
   }
 
   Txn
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+// The bucket layout of a log-linear histogram, the layout HdrHistogram uses:
+// every power of two is split into 2^SUB_BITS buckets of equal width, so a
+// value is known to SUB_BITS significant bits and the relative error is at
+// most 2^-SUB_BITS. Values below 2^SUB_BITS get a bucket each, and the last
+// bucket takes everything from 2^(MAX_MAGNITUDE + 1) up.
+//
+// Layouts with the same MAX_MAGNITUDE nest: a bucket of a finer layout falls
+// entirely within one bucket of a coarser one, so counts recorded finely can
+// be summed into coarse buckets without losing their place.
+template <int SUB_BITS, int MAX_MAGNITUDE> struct LogLinearBuckets {
+  static_assert(SUB_BITS > 0 && SUB_BITS <= MAX_MAGNITUDE && MAX_MAGNITUDE < 63);
+
+  static constexpr int SUB_BUCKETS  = 1 << SUB_BITS;
+  static constexpr size_t N_BUCKETS = (MAX_MAGNITUDE - SUB_BITS + 2) * SUB_BUCKETS + 1;
+  static constexpr size_t LAST      = N_BUCKETS - 1;
+
+  static constexpr size_t
+  bucketOf(uint64_t value)
+  {
+    if (value < SUB_BUCKETS) {
+      return value;
+    }
+    int magnitude = std::bit_width(value) - 1;
+    if (magnitude > MAX_MAGNITUDE) {
+      return LAST;
+    }
+    size_t sub = (value >> (magnitude - SUB_BITS)) & (SUB_BUCKETS - 1);
+    return (magnitude - SUB_BITS + 1) * SUB_BUCKETS + sub;
+  }
+
+  // The largest value that falls into bucket. The last bucket has no upper
+  // bound; UINT64_MAX is returned for it.
+  static constexpr uint64_t
+  upperOf(size_t bucket)
+  {
+    if (bucket < SUB_BUCKETS) {
+      return bucket;
+    }
+    if (bucket >= LAST) {
+      return UINT64_MAX;
+    }
+    int magnitude  = bucket / SUB_BUCKETS + SUB_BITS - 1;
+    uint64_t width = uint64_t{1} << (magnitude - SUB_BITS);
+    return (SUB_BUCKETS + bucket % SUB_BUCKETS + 1) * width - 1;
+  }
+
+  // Returns the upper bound of the bucket that holds the sample of rank
+  // ceil(total * per_mille / 1000), counting from 1, in counts[N_BUCKETS], or
+  // 0 when total is 0. total must be the sum of counts.
+  static uint64_t
+  percentile(const uint64_t *counts, uint64_t total, unsigned per_mille)
+  {
+    if (total == 0) {
+      return 0;
+    }
+    uint64_t rank = (total * per_mille + 999) / 1000;
+    rank          = rank == 0 ? 1 : rank;
+    uint64_t seen = 0;
+    for (size_t b = 0; b < N_BUCKETS; ++b) {
+      seen += counts[b];
+      if (seen >= rank) {
+        return upperOf(b);
+      }
+    }
+    return upperOf(LAST);
+  }
+};
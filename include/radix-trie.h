@@ -0,0 +1,124 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// A byte-wise radix trie mapping string keys to values. Each edge carries a
+// run of bytes, so a lookup reads every byte of the key at most once however
+// many keys are stored, and visits one node per branching point.
+template <typename V> class RadixTrie
+{
+public:
+  // Returns the value stored under key, creating a default one if needed.
+  V &
+  operator[](std::string_view key)
+  {
+    Node *node = &root_;
+    while (true) {
+      if (key.empty()) {
+        if (!node->value) {
+          node->value.emplace();
+        }
+        return *node->value;
+      }
+
+      auto it = node->findChild(key.front());
+      if (it == node->children.end() || (*it)->label.front() != key.front()) {
+        auto leaf   = std::make_unique<Node>();
+        leaf->label = key;
+        leaf->value.emplace();
+        V &value = *leaf->value;
+        node->children.insert(it, std::move(leaf));
+        return value;
+      }
+
+      Node *child   = it->get();
+      size_t common = std::mismatch(child->label.begin(), child->label.end(), key.begin(), key.end()).first - child->label.begin();
+      if (common < child->label.size()) {
+        // Split the edge: the shared bytes become a new node above child.
+        auto upper   = std::make_unique<Node>();
+        upper->label = child->label.substr(0, common);
+        child->label.erase(0, common);
+        upper->children.push_back(std::move(*it));
+        *it   = std::move(upper);
+        child = it->get();
+      }
+      key.remove_prefix(common);
+      node = child;
+    }
+  }
+
+  // Calls visit(length, value) for each stored key that is a prefix of key,
+  // shortest first. Stops early when visit returns false.
+  template <typename F>
+  void
+  forEachPrefix(std::string_view key, F &&visit) const
+  {
+    const Node *node = &root_;
+    size_t depth     = 0;
+    while (true) {
+      if (node->value && !visit(depth, *node->value)) {
+        return;
+      }
+      if (depth == key.size()) {
+        return;
+      }
+      auto it = node->findChild(key[depth]);
+      if (it == node->children.end() || (*it)->label.front() != key[depth] ||
+          key.substr(depth, (*it)->label.size()) != (*it)->label) {
+        return;
+      }
+      depth += (*it)->label.size();
+      node   = it->get();
+    }
+  }
+
+  // Returns the value of the longest stored key that is a prefix of key, and
+  // that key's length in matched, or nullptr when there is none.
+  const V *
+  longestPrefix(std::string_view key, size_t &matched) const
+  {
+    const V *found = nullptr;
+    forEachPrefix(key, [&](size_t length, const V &value) {
+      found   = &value;
+      matched = length;
+      return true;
+    });
+    return found;
+  }
+
+  bool
+  empty() const
+  {
+    return !root_.value && root_.children.empty();
+  }
+
+private:
+  struct Node {
+    std::string label;
+    std::optional<V> value;
+    std::vector<std::unique_ptr<Node>> children; // sorted by the first byte of their label
+
+    auto
+    findChild(char c) const
+    {
+      return std::lower_bound(children.begin(), children.end(), c,
+                              [](const std::unique_ptr<Node> &child, char k) { return child->label.front() < k; });
+    }
+
+    auto
+    findChild(char c)
+    {
+      return std::lower_bound(children.begin(), children.end(), c,
+                              [](const std::unique_ptr<Node> &child, char k) { return child->label.front() < k; });
+    }
+  };
+
+  Node root_;
+};
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <cstddef>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <string_view>
+
+#include "radix-trie.h"
+
+// Host and path-prefix rewrite rules, compiled into radix tries so that the
+// cost of matching a request depends on the length of its URL and not on
+// how many rules there are.
+//
+// Rules are read from a file, one per line:
+//   host path-prefix new-host new-path-prefix
+// host is either a name or "*." and a name to match all of its subdomains.
+// new-host is "-" to keep the request's host. path-prefix matches whole path
+// segments: "/img" matches "/img" and "/img/a.png" but not "/images/a.png".
+// The matched path prefix is replaced with new-path-prefix and the rest of
+// the path is kept. Leading and trailing '/' of both prefixes do not matter:
+// "/img/" and "/img" are the same rule, and the rewritten path has exactly
+// one '/' where the new prefix meets the rest.
+//
+// Request paths are taken and returned without their leading '/', as
+// TSUrlPathGet() and TSUrlPathSet() use them.
+class rewrite_engine
+{
+public:
+  struct target {
+    std::string host;        // empty to keep the request's host
+    std::string path_prefix; // without a leading or trailing '/'
+  };
+
+  void
+  add_rule(std::string_view host, std::string_view path, std::string_view new_host, std::string_view new_path)
+  {
+    bool wildcard = host.starts_with("*.");
+    if (wildcard) {
+      host.remove_prefix(2);
+    }
+    char key[MAX_HOST_KEY];
+    size_t key_len = host_key(host, key);
+
+    host_rules &rules = hosts[{key, key_len}];
+    target &t         = (wildcard ? rules.wildcard : rules.exact)[trim_slashes(path)];
+    t.host            = new_host == "-" ? std::string_view{} : new_host;
+    t.path_prefix     = trim_slashes(new_path);
+    n_rules++;
+  }
+
+  // Adds the rules of the file at path. Returns false with a description in
+  // error if it cannot be read or a line is malformed; the rules before that
+  // line are kept.
+  bool
+  load(const std::string &path, std::string &error)
+  {
+    std::ifstream file(path);
+    if (!file) {
+      error = "cannot open " + path;
+      return false;
+    }
+
+    std::string line;
+    for (int line_no = 1; std::getline(file, line); line_no++) {
+      std::istringstream fields(line);
+      std::string host, prefix, new_host, new_prefix, extra;
+      if (!(fields >> host) || host.front() == '#') {
+        continue;
+      }
+      if (!(fields >> prefix >> new_host >> new_prefix) || (fields >> extra) || host.size() >= MAX_HOST_KEY) {
+        error = path + ":" + std::to_string(line_no) + ": expected host path-prefix new-host new-path-prefix";
+        return false;
+      }
+      add_rule(host, prefix, new_host, new_prefix);
+    }
+    return true;
+  }
+
+  // Returns the rule for host and path, and the length of the path prefix it
+  // matched. A rule for the host itself wins over wildcard rules, and a
+  // wildcard rule for a longer domain wins over one for a shorter domain.
+  const target *
+  match(std::string_view host, std::string_view path, size_t &matched) const
+  {
+    char key[MAX_HOST_KEY];
+    size_t key_len = host_key(host, key);
+    if (key_len == 0) {
+      return nullptr;
+    }
+
+    // Every stored key is empty (the "*." rule) or ends in a '.', so there is
+    // at most one matching domain per byte of the key, plus the root. Empty
+    // labels make keys with several '.' in a row, so there may be more than
+    // one per label.
+    const host_rules *domains[MAX_HOST_KEY + 1];
+    size_t n_domains = 0;
+    bool exact       = false;
+    hosts.forEachPrefix({key, key_len}, [&](size_t length, const host_rules &rules) {
+      domains[n_domains++] = &rules;
+      exact                = length == key_len;
+      return true;
+    });
+
+    for (size_t i = n_domains; i-- > 0;) {
+      const RadixTrie<target> &paths = (exact && i == n_domains - 1) ? domains[i]->exact : domains[i]->wildcard;
+      if (const target *t = longest_segment_prefix(paths, path, matched)) {
+        return t;
+      }
+    }
+    return nullptr;
+  }
+
+  // Writes path rewritten by t, whose prefix matched the first matched bytes
+  // of it, into out.
+  static void
+  rewrite_path(const target &t, std::string_view path, size_t matched, std::string &out)
+  {
+    // What follows a non-empty matched prefix starts with its own '/'.
+    std::string_view rest = path.substr(matched);
+    if (rest.starts_with('/')) {
+      rest.remove_prefix(1);
+    }
+    out.assign(t.path_prefix);
+    if (!out.empty() && path.size() > matched) {
+      out.push_back('/');
+    }
+    out.append(rest);
+  }
+
+  size_t
+  size() const
+  {
+    return n_rules;
+  }
+
+private:
+  // Hosts are keyed by their labels in reverse order, each followed by a
+  // '.', so that a domain is a prefix of all of its subdomains.
+  static constexpr size_t MAX_HOST_KEY = 256;
+
+  static size_t
+  host_key(std::string_view host, char *key)
+  {
+    if (host.size() >= MAX_HOST_KEY) {
+      return 0;
+    }
+    char *p = key;
+    while (!host.empty()) {
+      size_t dot             = host.rfind('.');
+      std::string_view label = dot == std::string_view::npos ? host : host.substr(dot + 1);
+      for (char c : label) {
+        *p++ = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+      }
+      *p++ = '.';
+      host.remove_suffix(dot == std::string_view::npos ? host.size() : label.size() + 1);
+    }
+    return p - key;
+  }
+
+  static std::string_view
+  trim_slashes(std::string_view prefix)
+  {
+    while (prefix.starts_with('/')) {
+      prefix.remove_prefix(1);
+    }
+    while (prefix.ends_with('/')) {
+      prefix.remove_suffix(1);
+    }
+    return prefix;
+  }
+
+  // Returns the rule of the longest path prefix in paths that ends on a
+  // segment boundary of path, and the length of that prefix in matched.
+  static const target *
+  longest_segment_prefix(const RadixTrie<target> &paths, std::string_view path, size_t &matched)
+  {
+    const target *found = nullptr;
+    paths.forEachPrefix(path, [&](size_t length, const target &t) {
+      if (length == 0 || length == path.size() || path[length] == '/') {
+        found   = &t;
+        matched = length;
+      }
+      return true;
+    });
+    return found;
+  }
+
+  struct host_rules {
+    RadixTrie<target> exact;    // paths of the host itself
+    RadixTrie<target> wildcard; // paths of its subdomains
+  };
+
+  RadixTrie<host_rules> hosts;
+  size_t n_rules = 0; // rules added, counting a rule added again once per add
+};
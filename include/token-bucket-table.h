@@ -0,0 +1,146 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+
+// Token buckets keyed by string, shared by every thread of the process and
+// updated without locks.
+//
+// Each bucket is kept in the form of the generic cell rate algorithm: one
+// "theoretical arrival time" per key, which is the time at which the bucket
+// would be full again. Taking a token is a single compare-and-swap on it, and
+// the rate and burst are passed in by the caller on every take, so limits
+// changed in the caller's configuration apply from the next request on.
+//
+// The table is split into shards picked by the key's hash. A key claims a slot
+// by hash with a compare-and-swap, probing linearly within its shard, and then
+// keeps it for the life of the process; slots are never freed. Keys are told
+// apart by their 64-bit hash alone. Every slot has a cache line of its own, so
+// busy keys do not slow each other down. The slot that a key claims keeps a
+// heap copy of the whole key, made once, so that forEach can name it.
+class TokenBucketTable
+{
+public:
+  static constexpr size_t N_SHARDS        = 16;
+  static constexpr size_t SLOTS_PER_SHARD = 128;
+  static constexpr size_t N_SLOTS         = N_SHARDS * SLOTS_PER_SHARD;
+
+  enum class Result { Allowed, Limited, TableFull };
+
+  // Takes one token from the bucket of key, which refills at rate tokens a
+  // second up to burst tokens. now_ns is a monotonic time in nanoseconds. When
+  // the bucket is empty, returns Limited and sets retry_after_ns to the time
+  // until a token is available. When every slot of the key's shard is taken by
+  // other keys, returns TableFull without limiting.
+  Result
+  take(std::string_view key, uint32_t rate, uint32_t burst, int64_t now_ns, int64_t &retry_after_ns)
+  {
+    Slot *slot = find(key);
+    if (!slot) {
+      return Result::TableFull;
+    }
+
+    int64_t interval = NS_PER_SEC / std::max<uint32_t>(rate, 1);
+    int64_t limit    = interval * std::max<uint32_t>(burst, 1);
+    if (slot->interval_ns.load(std::memory_order_relaxed) != interval) {
+      slot->interval_ns.store(interval, std::memory_order_relaxed);
+    }
+    if (slot->limit_ns.load(std::memory_order_relaxed) != limit) {
+      slot->limit_ns.store(limit, std::memory_order_relaxed);
+    }
+
+    int64_t tat = slot->tat.load(std::memory_order_relaxed);
+    while (true) {
+      int64_t next = std::max(tat, now_ns) + interval;
+      if (next - now_ns > limit) {
+        retry_after_ns = next - now_ns - limit;
+        return Result::Limited;
+      }
+      if (slot->tat.compare_exchange_weak(tat, next, std::memory_order_relaxed)) {
+        return Result::Allowed;
+      }
+    }
+  }
+
+  // Calls f(index, name, tokens, burst) for every key seen so far, where index
+  // is the key's slot in [0, N_SLOTS) and tokens is the bucket's fill level at
+  // now_ns.
+  template <typename F>
+  void
+  forEach(int64_t now_ns, F &&f) const
+  {
+    for (size_t i = 0; i < N_SLOTS; ++i) {
+      const Slot &slot = slots_[i];
+      if (!slot.named.load(std::memory_order_acquire)) {
+        continue;
+      }
+      int64_t interval = slot.interval_ns.load(std::memory_order_relaxed);
+      int64_t limit    = slot.limit_ns.load(std::memory_order_relaxed);
+      int64_t backlog  = std::max(slot.tat.load(std::memory_order_relaxed), now_ns) - now_ns;
+      int64_t tokens   = interval > 0 ? std::max<int64_t>(limit - backlog, 0) / interval : 0;
+      int64_t burst    = interval > 0 ? limit / interval : 0;
+      f(i, std::string_view{slot.name.get(), slot.name_len}, tokens, burst);
+    }
+  }
+
+private:
+  static constexpr int64_t NS_PER_SEC = 1000000000;
+
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> hash{0}; // 0 while the slot is free
+    std::atomic<int64_t> tat{0};
+    std::atomic<int64_t> interval_ns{0};
+    std::atomic<int64_t> limit_ns{0};
+    std::atomic<bool> named{false}; // set once name is written
+    uint32_t name_len = 0;
+    std::unique_ptr<char[]> name;
+  };
+  static_assert(sizeof(Slot) == 64);
+
+  static uint64_t
+  hashOf(std::string_view key)
+  {
+    // FNV-1a, with 0 moved aside since it marks a free slot.
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (unsigned char c : key) {
+      h = (h ^ c) * 0x100000001b3ULL;
+    }
+    return h ? h : 1;
+  }
+
+  Slot *
+  find(std::string_view key)
+  {
+    uint64_t h  = hashOf(key);
+    Slot *shard = &slots_[(h % N_SHARDS) * SLOTS_PER_SHARD];
+    size_t i    = (h / N_SHARDS) % SLOTS_PER_SHARD;
+
+    for (size_t probes = 0; probes < SLOTS_PER_SHARD; ++probes, i = (i + 1) % SLOTS_PER_SHARD) {
+      Slot &slot     = shard[i];
+      uint64_t found = slot.hash.load(std::memory_order_acquire);
+      if (found == h) {
+        return &slot;
+      }
+      if (found == 0) {
+        if (slot.hash.compare_exchange_strong(found, h, std::memory_order_acq_rel)) {
+          slot.name.reset(new char[key.size()]);
+          slot.name_len = static_cast<uint32_t>(key.size());
+          std::memcpy(slot.name.get(), key.data(), key.size());
+          slot.named.store(true, std::memory_order_release);
+          return &slot;
+        }
+        if (found == h) {
+          return &slot;
+        }
+      }
+    }
+    return nullptr;
+  }
+
+  std::unique_ptr<Slot[]> slots_{new Slot[N_SLOTS]};
+};
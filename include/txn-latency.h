@@ -0,0 +1,370 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ts/ts.h"
+#include "log-linear-buckets.h"
+
+// Per-transaction latency instrumentation for remap plugins.
+//
+// A plugin calls TxnLatency::init() from TSRemapInit and
+// TxnLatency::start() from TSRemapDoRemap. The transaction is then
+// stamped with a monotonic clock at remap, at every send of the origin
+// request header (where obj_store_auth signs), at the origin response header
+// and at close. The intervals between the stamps go into per-thread
+// log-linear histograms, laid out like HdrHistogram's but without the
+// library. Each histogram has a single writer, so recording needs no lock or
+// read-modify-write. A task thread sums the histograms once a second into TS
+// stats named
+//   <prefix>.latency.<interval>.p50_us    percentiles of the samples of the
+//   <prefix>.latency.<interval>.p90_us    last second, to within 1%; kept
+//   <prefix>.latency.<interval>.p99_us    from the previous second when
+//   <prefix>.latency.<interval>.p999_us   there were no samples; -1 when
+//                                         above the last bucket
+//   <prefix>.latency.<interval>.le_<us>   samples of at most <us> microseconds
+//                                         (and above the previous bucket)
+//   <prefix>.latency.<interval>.le_inf    samples slower than the last bucket
+//   <prefix>.latency.<interval>.count
+//   <prefix>.latency.<interval>.sum_us
+// for the intervals remap_to_send, send_to_response, response_to_close and
+// total. An interval whose stamps were not both taken, such as
+// send_to_response on a cache hit, is not recorded.
+//
+// Samples are recorded with 7 significant bits, for a relative error below
+// 1%, and the percentiles are read from that. Every exported bucket is a TS
+// stat of its own, though, and that precision takes over 2000 buckets per
+// interval; so the le_ buckets are summed from it at 2 significant bits, four
+// buckets per power of two and up to 25% apart, which is enough to plot a
+// distribution or to count samples over an SLO.
+//
+// Everything here has internal linkage, so that each plugin including this
+// header gets its own transaction slot, stats and thread histograms. Inline
+// variables and the thread_locals of inline functions would be exported as
+// unique symbols instead, which the dynamic linker binds to a single copy
+// for every plugin: the second plugin to call init() would find the first
+// one's state and never follow its own transactions. Include it from one
+// source file per plugin.
+namespace
+{
+namespace TxnLatency
+{
+  enum Stamp { REMAP, SEND_REQUEST_HDR, READ_RESPONSE_HDR, TXN_CLOSE, N_STAMPS };
+
+  namespace detail
+  {
+    struct Interval {
+      const char *name;
+      Stamp from;
+      Stamp to;
+    };
+
+    inline constexpr Interval INTERVALS[] = {
+      {"remap_to_send",     REMAP,             SEND_REQUEST_HDR },
+      {"send_to_response",  SEND_REQUEST_HDR,  READ_RESPONSE_HDR},
+      {"response_to_close", READ_RESPONSE_HDR, TXN_CLOSE        },
+      {"total",             REMAP,             TXN_CLOSE        },
+    };
+    inline constexpr size_t N_INTERVALS = std::size(INTERVALS);
+
+    // Both layouts end at about 8s: the last bucket takes everything from
+    // 2^23us up.
+    inline constexpr int MAX_MAGNITUDE = 22;
+    using Recorded                     = LogLinearBuckets<7, MAX_MAGNITUDE>;
+    using Exported                     = LogLinearBuckets<2, MAX_MAGNITUDE>;
+
+    struct Percentile {
+      const char *name;
+      unsigned per_mille;
+    };
+
+    inline constexpr Percentile PERCENTILES[] = {
+      {"p50",  500},
+      {"p90",  900},
+      {"p99",  990},
+      {"p999", 999},
+    };
+    inline constexpr size_t N_PERCENTILES = std::size(PERCENTILES);
+
+    inline int64_t
+    nowUs()
+    {
+      return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    struct Histograms {
+      std::atomic<uint64_t> counts[N_INTERVALS][Recorded::N_BUCKETS] = {};
+      std::atomic<uint64_t> sum_us[N_INTERVALS]                      = {};
+    };
+
+    struct StatIds {
+      int percentiles[N_PERCENTILES];
+      int buckets[Exported::N_BUCKETS];
+      int count;
+      int sum_us;
+    };
+
+    // The stamps of one transaction; 0 means not taken.
+    struct Stamps {
+      std::array<int64_t, N_STAMPS> at;
+    };
+
+    inline constexpr size_t MAX_FREE_STAMPS = 256;
+
+    struct State {
+      int arg_index = -1;
+      TSCont hook   = nullptr;
+      TSCont flush  = nullptr;
+      StatIds stats[N_INTERVALS];
+
+      // Every thread's histograms. Threads register once, on their first
+      // sample, and the histograms live as long as the process.
+      std::mutex threads_mutex;
+      std::vector<std::unique_ptr<Histograms>> threads;
+
+      // The flush's totals, of this flush and of the one before; only the
+      // flush continuation touches them.
+      uint64_t totals[N_INTERVALS][Recorded::N_BUCKETS]   = {};
+      uint64_t previous[N_INTERVALS][Recorded::N_BUCKETS] = {};
+    };
+
+    State state;
+
+    inline Histograms &
+    threadHistograms()
+    {
+      thread_local Histograms *histograms = [] {
+        auto h   = std::make_unique<Histograms>();
+        auto raw = h.get();
+        std::lock_guard lock{state.threads_mutex};
+        state.threads.push_back(std::move(h));
+        return raw;
+      }();
+      return *histograms;
+    }
+
+    // Adds one to a counter that only the calling thread writes.
+    inline void
+    bump(std::atomic<uint64_t> &counter, uint64_t by)
+    {
+      counter.store(counter.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+    }
+
+    inline std::vector<Stamps *> &
+    freeStamps()
+    {
+      thread_local std::vector<Stamps *> free_list;
+      return free_list;
+    }
+
+    inline Stamps *
+    acquireStamps()
+    {
+      auto &free_list = freeStamps();
+      Stamps *stamps;
+      if (free_list.empty()) {
+        stamps = new Stamps;
+      } else {
+        stamps = free_list.back();
+        free_list.pop_back();
+      }
+      stamps->at.fill(0);
+      return stamps;
+    }
+
+    inline void
+    releaseStamps(Stamps *stamps)
+    {
+      auto &free_list = freeStamps();
+      if (free_list.size() < MAX_FREE_STAMPS) {
+        free_list.push_back(stamps);
+      } else {
+        delete stamps;
+      }
+    }
+
+    inline void
+    record(const Stamps &stamps)
+    {
+      Histograms &h = threadHistograms();
+      for (size_t i = 0; i < N_INTERVALS; ++i) {
+        int64_t from = stamps.at[INTERVALS[i].from];
+        int64_t to   = stamps.at[INTERVALS[i].to];
+        if (from == 0 || to == 0 || to < from) {
+          continue;
+        }
+        uint64_t us = to - from;
+        bump(h.counts[i][Recorded::bucketOf(us)], 1);
+        bump(h.sum_us[i], us);
+      }
+    }
+
+    inline int
+    hookHandler(TSCont /* contp ATS_UNUSED */, TSEvent event, void *edata)
+    {
+      TSHttpTxn txn  = static_cast<TSHttpTxn>(edata);
+      Stamps *stamps = static_cast<Stamps *>(TSUserArgGet(txn, state.arg_index));
+
+      if (stamps) {
+        switch (event) {
+        case TS_EVENT_HTTP_SEND_REQUEST_HDR:
+          // Retries stamp again, so the interval covers the attempt that
+          // got the response.
+          stamps->at[SEND_REQUEST_HDR] = nowUs();
+          break;
+        case TS_EVENT_HTTP_READ_RESPONSE_HDR:
+          stamps->at[READ_RESPONSE_HDR] = nowUs();
+          break;
+        case TS_EVENT_HTTP_TXN_CLOSE:
+          stamps->at[TXN_CLOSE] = nowUs();
+          record(*stamps);
+          TSUserArgSet(txn, state.arg_index, nullptr);
+          releaseStamps(stamps);
+          break;
+        default:
+          break;
+        }
+      }
+      TSHttpTxnReenable(txn, TS_EVENT_HTTP_CONTINUE);
+      return 0;
+    }
+
+    inline int
+    flushHandler(TSCont /* contp ATS_UNUSED */, TSEvent /* event ATS_UNUSED */, void * /* edata ATS_UNUSED */)
+    {
+      auto &totals                 = state.totals;
+      auto &previous               = state.previous;
+      uint64_t sum_us[N_INTERVALS] = {};
+
+      std::swap(totals, previous);
+      std::fill(&totals[0][0], &totals[0][0] + std::size(totals) * std::size(totals[0]), 0);
+      {
+        std::lock_guard lock{state.threads_mutex};
+        for (const auto &h : state.threads) {
+          for (size_t i = 0; i < N_INTERVALS; ++i) {
+            for (size_t b = 0; b < Recorded::N_BUCKETS; ++b) {
+              totals[i][b] += h->counts[i][b].load(std::memory_order_relaxed);
+            }
+            sum_us[i] += h->sum_us[i].load(std::memory_order_relaxed);
+          }
+        }
+      }
+
+      for (size_t i = 0; i < N_INTERVALS; ++i) {
+        uint64_t count                         = 0;
+        uint64_t window[Recorded::N_BUCKETS]   = {};
+        uint64_t exported[Exported::N_BUCKETS] = {};
+        for (size_t b = 0; b < Recorded::N_BUCKETS; ++b) {
+          window[b] = totals[i][b] - previous[i][b];
+          exported[Exported::bucketOf(Recorded::upperOf(b))] += totals[i][b];
+          count += totals[i][b];
+        }
+        for (size_t b = 0; b < Exported::N_BUCKETS; ++b) {
+          TSStatIntSet(state.stats[i].buckets[b], exported[b]);
+        }
+        TSStatIntSet(state.stats[i].count, count);
+        TSStatIntSet(state.stats[i].sum_us, sum_us[i]);
+
+        uint64_t window_count = 0;
+        for (uint64_t c : window) {
+          window_count += c;
+        }
+        if (window_count > 0) {
+          for (size_t p = 0; p < N_PERCENTILES; ++p) {
+            uint64_t us = Recorded::percentile(window, window_count, PERCENTILES[p].per_mille);
+            TSStatIntSet(state.stats[i].percentiles[p], us == UINT64_MAX ? -1 : static_cast<TSMgmtInt>(us));
+          }
+        }
+      }
+      return 0;
+    }
+
+    inline int
+    createStat(const std::string &name, TSRecordDataType type = TS_RECORDDATATYPE_COUNTER)
+    {
+      int id;
+      if (TSStatFindName(name.c_str(), &id) == TS_ERROR) {
+        id = TSStatCreate(name.c_str(), type, TS_STAT_NON_PERSISTENT, TS_STAT_SYNC_SUM);
+      }
+      return id;
+    }
+  } // namespace detail
+
+  // Reserves the transaction slot, creates the stats under prefix and starts
+  // the once-a-second flush. Call once, from TSRemapInit.
+  inline TSReturnCode
+  init(const char *prefix)
+  {
+    using namespace detail;
+
+    if (state.hook) {
+      return TS_SUCCESS;
+    }
+    if (TSUserArgIndexReserve(TS_USER_ARGS_TXN, prefix, "transaction latency stamps", &state.arg_index) != TS_SUCCESS) {
+      TSError("[%s] Unable to reserve a transaction slot for latency stamps", prefix);
+      return TS_ERROR;
+    }
+
+    for (size_t i = 0; i < N_INTERVALS; ++i) {
+      std::string base = std::string(prefix) + ".latency." + INTERVALS[i].name + ".";
+      for (size_t p = 0; p < N_PERCENTILES; ++p) {
+        state.stats[i].percentiles[p] = createStat(base + PERCENTILES[p].name + "_us", TS_RECORDDATATYPE_INT);
+      }
+      for (size_t b = 0; b < Exported::N_BUCKETS; ++b) {
+        std::string bound         = b < Exported::LAST ? std::to_string(Exported::upperOf(b)) : "inf";
+        state.stats[i].buckets[b] = createStat(base + "le_" + bound);
+      }
+      state.stats[i].count  = createStat(base + "count");
+      state.stats[i].sum_us = createStat(base + "sum_us");
+    }
+
+    state.hook  = TSContCreate(hookHandler, nullptr);
+    state.flush = TSContCreate(flushHandler, TSMutexCreate());
+    TSContScheduleEveryOnPool(state.flush, 1000, TS_THREAD_POOL_TASK);
+    return TS_SUCCESS;
+  }
+
+  // Stamps txn as remapped and follows it until it closes. Call from
+  // TSRemapDoRemap.
+  inline void
+  start(TSHttpTxn txn)
+  {
+    using namespace detail;
+
+    if (!state.hook || TSUserArgGet(txn, state.arg_index)) {
+      return;
+    }
+    Stamps *stamps    = acquireStamps();
+    stamps->at[REMAP] = nowUs();
+    TSUserArgSet(txn, state.arg_index, stamps);
+
+    TSHttpTxnHookAdd(txn, TS_HTTP_SEND_REQUEST_HDR_HOOK, state.hook);
+    TSHttpTxnHookAdd(txn, TS_HTTP_READ_RESPONSE_HDR_HOOK, state.hook);
+    TSHttpTxnHookAdd(txn, TS_HTTP_TXN_CLOSE_HOOK, state.hook);
+  }
+
+  // Returns the microseconds since txn was remapped, or -1 if it is not being
+  // followed.
+  inline int64_t
+  sinceRemapUs(TSHttpTxn txn)
+  {
+    using namespace detail;
+
+    if (!state.hook) {
+      return -1;
+    }
+    auto stamps = static_cast<const Stamps *>(TSUserArgGet(txn, state.arg_index));
+    return stamps ? nowUs() - stamps->at[REMAP] : -1;
+  }
+} // namespace TxnLatency
+} // namespace
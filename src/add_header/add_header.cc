@@ -29,75 +29,41 @@
  *     add-header.so "name1: value1" "name2: value2" ...
  *
  *          namei and valuei are the name and value of the
- *          ith MIME header to be added to the client request
+ *          ith MIME header to be added to the client request.
+ *          valuei may contain the variables listed in
+ *          header-template.h, e.g. "X-Client: %{client-ip}"
  */
 
 #include <cctype>
 #include <cstdio>
 #include <cstring>
+#include <string>
 
 #include "ts/ts.h"
+#include "header-block.h"
 
 #define PLUGIN_NAME "add_header"
 
-static TSMBuffer hdr_bufp;
-static TSMLoc hdr_loc;
+/* The fields to add. They are filled in by TSPluginInit and only read
+   afterwards, so the hook may use them from any thread without a lock. */
+static HeaderBlock header_block;
 
 static void
 add_header(TSHttpTxn txnp, [[maybe_unused]] TSCont contp)
 {
   TSMBuffer req_bufp;
   TSMLoc req_loc;
-  TSMLoc field_loc;
-  TSMLoc next_field_loc;
-  TSMLoc new_field_loc;
-  int retval;
 
   if (TSHttpTxnClientReqGet(txnp, &req_bufp, &req_loc) != TS_SUCCESS) {
     TSError("[%s] Unable to retrieve client request header", PLUGIN_NAME);
     goto done;
   }
 
-  field_loc = TSMimeHdrFieldGet(hdr_bufp, hdr_loc, 0);
-  if (field_loc == TS_NULL_MLOC) {
-    TSError("[%s] Unable to get field", PLUGIN_NAME);
-    goto error;
+  /* Append every field of the block to the client request */
+  if (header_block.appendTo({txnp, req_bufp, req_loc}) != TS_SUCCESS) {
+    TSError("[%s] Unable to append new field", PLUGIN_NAME);
   }
 
-  /* Loop on our header containing fields to add */
-  while (field_loc) {
-    /* First create a new field in the client request header */
-    if (TSMimeHdrFieldCreate(req_bufp, req_loc, &new_field_loc) != TS_SUCCESS) {
-      TSError("[%s] Unable to create new field", PLUGIN_NAME);
-      TSHandleMLocRelease(hdr_bufp, hdr_loc, field_loc);
-      break;
-    }
-
-    /* Then copy our new field at this new location */
-    retval = TSMimeHdrFieldCopy(req_bufp, req_loc, new_field_loc, hdr_bufp, hdr_loc, field_loc);
-    if (retval == TS_ERROR) {
-      TSError("[%s] Unable to copy new field", PLUGIN_NAME);
-      TSHandleMLocRelease(hdr_bufp, hdr_loc, field_loc);
-      break;
-    }
-
-    /* Add this field to the Http client request header */
-    retval = TSMimeHdrFieldAppend(req_bufp, req_loc, new_field_loc);
-    if (retval != TS_SUCCESS) {
-      TSError("[%s] Unable to append new field", PLUGIN_NAME);
-      TSHandleMLocRelease(hdr_bufp, hdr_loc, field_loc);
-      break;
-    }
-
-    /* We can now release this handle */
-    TSHandleMLocRelease(req_bufp, req_loc, new_field_loc);
-
-    next_field_loc = TSMimeHdrFieldNext(hdr_bufp, hdr_loc, field_loc);
-    TSHandleMLocRelease(hdr_bufp, hdr_loc, field_loc);
-    field_loc = next_field_loc;
-  }
-
-error:
   TSHandleMLocRelease(req_bufp, TS_NULL_MLOC, req_loc);
 
 done:
@@ -122,9 +88,10 @@ add_header_plugin(TSCont contp, TSEvent event, void *edata)
 void
 TSPluginInit(int argc, const char *argv[])
 {
-  TSMLoc field_loc;
   const char *p;
-  int i, retval;
+  size_t name_len;
+  std::string reason;
+  int i;
   TSPluginRegistrationInfo info;
 
   info.plugin_name   = PLUGIN_NAME;
@@ -141,55 +108,28 @@ TSPluginInit(int argc, const char *argv[])
     goto error;
   }
 
-  hdr_bufp = TSMBufferCreate();
-  if (TSMimeHdrCreate(hdr_bufp, &hdr_loc) != TS_SUCCESS) {
-    TSError("[%s] Can not create mime header", PLUGIN_NAME);
-    goto error;
-  }
-
   for (i = 1; i < argc; i++) {
-    if (TSMimeHdrFieldCreate(hdr_bufp, hdr_loc, &field_loc) != TS_SUCCESS) {
-      TSError("[%s] Unable to create field", PLUGIN_NAME);
-      goto error;
-    }
-
     p = strchr(argv[i], ':');
     if (p) {
-      retval = TSMimeHdrFieldNameSet(hdr_bufp, hdr_loc, field_loc, argv[i], static_cast<int>(p - argv[i]));
-      if (retval == TS_ERROR) {
-        TSError("[%s] Unable to name field", PLUGIN_NAME);
-        goto error;
-      }
+      name_len = static_cast<size_t>(p - argv[i]);
 
       p += 1;
       while (isspace(*p)) {
         p += 1;
       }
-      retval = TSMimeHdrFieldValueStringInsert(hdr_bufp, hdr_loc, field_loc, -1, p, static_cast<int>(strlen(p)));
-      if (retval == TS_ERROR) {
-        TSError("[%s] Unable to insert field value", PLUGIN_NAME);
-        goto error;
-      }
+      reason = header_block.add({argv[i], name_len}, p);
     } else {
-      retval = TSMimeHdrFieldNameSet(hdr_bufp, hdr_loc, field_loc, argv[i], static_cast<int>(strlen(argv[i])));
-      if (retval == TS_ERROR) {
-        TSError("[%s] Unable to set field name", PLUGIN_NAME);
-        goto error;
-      }
+      reason = header_block.add(argv[i], {});
     }
-
-    // TSMimeHdrFieldAppend is used only after successfully inserting field
-    // names and values
-    retval = TSMimeHdrFieldAppend(hdr_bufp, hdr_loc, field_loc);
-    if (retval != TS_SUCCESS) {
-      TSError("[%s] Unable to add field", PLUGIN_NAME);
+    if (!reason.empty()) {
+      TSError("[%s] Invalid value in \"%s\": %s", PLUGIN_NAME, argv[i], reason.c_str());
       goto error;
     }
   }
 
-  /* Create a continuation with a mutex as there is a shared global structure
-     containing the headers to add */
-  TSHttpHookAdd(TS_HTTP_READ_REQUEST_HDR_HOOK, TSContCreate(add_header_plugin, TSMutexCreate()));
+  /* The block is immutable from here on, so the continuation needs no
+     mutex and transactions on different threads do not serialize on it */
+  TSHttpHookAdd(TS_HTTP_READ_REQUEST_HDR_HOOK, TSContCreate(add_header_plugin, nullptr));
   goto done;
 
 error:
@@ -1,19 +1,191 @@
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <filesystem>
+#include <map>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
 
 #include <yaml-cpp/yaml.h>
-#include <swoc/BufferWriter.h>
 #include "lmdb-cpp.h"
 
+namespace
+{
+
+// A tab-separated record whose serialized size is known up front, so it can be
+// written in place into space reserved with LMDB::Txn::reserve() rather than
+// through a fixed-size intermediate buffer.
+class TsvRecord
+{
+public:
+  TsvRecord &
+  add(std::string field)
+  {
+    size_ += (fields_.empty() ? 0 : 1) + field.size();
+    fields_.push_back(std::move(field));
+    return *this;
+  }
+
+  size_t
+  size() const
+  {
+    return size_;
+  }
+
+  void
+  serialize(std::span<std::byte> out) const
+  {
+    std::byte *p = out.data();
+    for (size_t i = 0; i < fields_.size(); ++i) {
+      if (i) {
+        *p++ = std::byte{'\t'};
+      }
+      std::memcpy(p, fields_[i].data(), fields_[i].size());
+      p += fields_[i].size();
+    }
+  }
+
+  void
+  put(LMDB::Txn &txn, LMDB::Dbi dbi, std::string_view key) const
+  {
+    serialize(txn.reserve(dbi, key, size_));
+  }
+
+  bool
+  operator==(std::string_view serialized) const
+  {
+    if (serialized.size() != size_) {
+      return false;
+    }
+    for (size_t i = 0; i < fields_.size(); ++i) {
+      if (i) {
+        if (serialized.front() != '\t') {
+          return false;
+        }
+        serialized.remove_prefix(1);
+      }
+      if (!serialized.starts_with(fields_[i])) {
+        return false;
+      }
+      serialized.remove_prefix(fields_[i].size());
+    }
+    return true;
+  }
+
+private:
+  std::vector<std::string> fields_;
+  size_t size_ = 0;
+};
+
+// Credential records keyed by credential name. std::map orders std::string keys
+// the same way as LMDB's default comparison (memcmp, then shorter first), which
+// lets syncCredentials merge-join them against a cursor scan.
+using CredentialMap = std::map<std::string, TsvRecord>;
+
+struct SyncResult {
+  size_t added     = 0;
+  size_t updated   = 0;
+  size_t deleted   = 0;
+  size_t unchanged = 0;
+
+  bool
+  changed() const
+  {
+    return added || updated || deleted;
+  }
+};
+
+TsvRecord
+makeCredentialRecord(const YAML::Node &credential)
+{
+  TsvRecord record;
+  record.add(credential["bucket"].as<std::string>())
+    .add(credential["endpoint"].as<std::string>())
+    .add(credential["region"].as<std::string>())
+    .add(credential["access_key"].as<std::string>())
+    .add(credential["secret_key"].as<std::string>());
+  // Optional per access key rate limit, in requests a second, enforced by
+  // obj_store_auth. The burst defaults to one second's worth of requests.
+  if (credential["rate_limit"]) {
+    record.add(std::to_string(credential["rate_limit"].as<uint32_t>()));
+    if (credential["burst"]) {
+      record.add(std::to_string(credential["burst"].as<uint32_t>()));
+    }
+  }
+  return record;
+}
+
+CredentialMap
+loadCredentials(const YAML::Node &credentials)
+{
+  CredentialMap records;
+  for (YAML::const_iterator it = credentials.begin(); it != credentials.end(); ++it) {
+    auto credential                              = *it;
+    records[credential["key"].as<std::string>()] = makeCredentialRecord(credential);
+  }
+  return records;
+}
+
+// Brings dbi in line with records, touching only the keys that differ. The
+// current contents are scanned once in key order and merged against records:
+// stale keys are deleted through the cursor, while new and changed records are
+// written after the scan so the cursor never walks over pages it has dirtied.
+SyncResult
+syncCredentials(LMDB::Txn &txn, LMDB::Dbi dbi, const CredentialMap &records)
+{
+  SyncResult result;
+  std::vector<CredentialMap::const_iterator> puts;
+
+  {
+    auto cursor = txn.open_cursor(dbi);
+    auto it     = records.begin();
+    std::string_view key, value;
+    bool more = cursor.may_get(key, value, MDB_FIRST);
+
+    while (more || it != records.end()) {
+      if (!more || (it != records.end() && std::string_view{it->first} < key)) {
+        std::cout << "add key=" << it->first << '\n';
+        puts.push_back(it++);
+        ++result.added;
+      } else if (it == records.end() || key < std::string_view{it->first}) {
+        std::cout << "delete key=" << key << '\n';
+        cursor.del();
+        ++result.deleted;
+        more = cursor.may_get(key, value, MDB_NEXT);
+      } else {
+        if (it->second != value) {
+          std::cout << "update key=" << key << '\n';
+          puts.push_back(it);
+          ++result.updated;
+        } else {
+          ++result.unchanged;
+        }
+        ++it;
+        more = cursor.may_get(key, value, MDB_NEXT);
+      }
+    }
+  }
+
+  for (auto it : puts) {
+    it->second.put(txn, dbi, it->first);
+  }
+  return result;
+}
+
+} // namespace
+
 int
 main(int argc, char **argv)
 {
-  if (argc != 2) {
-    std::cerr << "Usage: " << argv[0] << " /path/to/obj_store_auth.yaml\n";
+  bool sync = argc == 3 && std::string_view{argv[1]} == "--sync";
+  if (argc != 2 && !sync) {
+    std::cerr << "Usage: " << argv[0] << " [--sync] /path/to/obj_store_auth.yaml\n";
     return 2;
   }
 
-  auto config_path = argv[1];
+  auto config_path = argv[argc - 1];
   try {
     YAML::Node config              = YAML::LoadFile(config_path);
     const std::string lmdb_path    = config["lmdb_path"].as<std::string>();
@@ -34,31 +206,26 @@ main(int argc, char **argv)
       std::cout << "dbi=" << static_cast<unsigned int>(dbi) << '\n';
 
       YAML::Node credentials = config["credentials"];
+      if (sync) {
+        SyncResult result = syncCredentials(txn, dbi, loadCredentials(credentials));
+        std::cout << "sync done, added=" << result.added << ", updated=" << result.updated << ", deleted=" << result.deleted
+                  << ", unchanged=" << result.unchanged << '\n';
+        if (!result.changed()) {
+          // Nothing to write, so skip the commit and its fsync.
+          txn.abort();
+          return 0;
+        }
+        txn.commit();
+        return 0;
+      }
+
       for (YAML::const_iterator it = credentials.begin(); it != credentials.end(); ++it) {
         auto credential = *it;
         auto key        = credential["key"].as<std::string>();
-        auto access_key = credential["access_key"].as<std::string>();
-        auto secret_key = credential["secret_key"].as<std::string>();
-        auto bucket     = credential["bucket"].as<std::string>();
-        auto endpoint   = credential["endpoint"].as<std::string>();
-        auto region     = credential["region"].as<std::string>();
-        swoc::LocalBufferWriter<1024> value;
-        value.write(bucket)
-          .write('\t')
-          .write(endpoint)
-          .write('\t')
-          .write(region)
-          .write('\t')
-          .write(access_key)
-          .write('\t')
-          .write(secret_key);
-        if (value.error()) {
-          std::cerr << "buffer too small\n";
-          return 1;
-        }
-        txn.put<std::string_view, std::string_view>(dbi, key, value);
+        auto record     = makeCredentialRecord(credential);
+        record.put(txn, dbi, key);
         std::cout << "done put value, key=" << key << ", value=" << txn.get<std::string_view, std::string_view>(dbi, key)
-                  << ", valueLen=" << value.size() << '\n';
+                  << ", valueLen=" << record.size() << '\n';
       }
       txn.commit();
     } catch (const LMDB::RuntimeError &e) {
@@ -0,0 +1,187 @@
+/** @file
+
+  Accept-Encoding normalization remap plugin
+
+  @section license License
+
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+  @section description
+    Rewrites the client's Accept-Encoding into one of a small set of
+  canonical values, so that the cache keeps few variants per object. The
+  header is tokenized once, q-values included, and the codings the client
+  accepts are matched against an ordered list of preferred codings:
+
+    --codings=LIST  preferred codings, most preferred first, out of br,
+                    gzip, zstd and identity, each listed once
+                    (default: br,gzip)
+    --combine       keep every accepted coding in the list, in list order,
+                    instead of only the most preferred one
+    --ats-mode=N    a preset: 1 is "gzip", 2 is "br,gzip", 3 is "br,gzip"
+                    with --combine, mirroring proxy.config.http.normalize_ae;
+                    4 is "zstd,br,gzip" and 5 is that with --combine
+
+  When the client accepts none of the listed codings, Accept-Encoding is
+  removed and the origin is asked for the identity encoding.
+ */
+
+#include <cstdlib>
+
+#include <getopt.h>
+#include <string_view>
+
+#include "ts/ts.h"
+#include "ts/remap.h"
+
+#include "accept-encoding.h"
+
+constexpr char PLUGIN[] = "normalize_ae";
+
+static DbgCtl dbg_ctl{PLUGIN};
+
+#define VDEBUG(fmt, ...) Dbg(dbg_ctl, fmt, ##__VA_ARGS__)
+
+#if DEBUG
+#define VERROR(fmt, ...) Dbg(dbg_ctl, fmt, ##__VA_ARGS__)
+#else
+#define VERROR(fmt, ...) TSError("[%s] %s: " fmt, PLUGIN, __FUNCTION__, ##__VA_ARGS__)
+#endif
+
+TSReturnCode
+TSRemapInit([[maybe_unused]] TSRemapInterface *api_info, [[maybe_unused]] char *errbuf, [[maybe_unused]] int errbuf_size)
+{
+  Dbg(dbg_ctl, "enter");
+  return TS_SUCCESS;
+}
+
+TSRemapStatus
+TSRemapDoRemap(void *ih, [[maybe_unused]] TSHttpTxn rh, TSRemapRequestInfo *rri)
+{
+  const NormalizePolicy *policy = static_cast<const NormalizePolicy *>(ih);
+  TSMBuffer bufp                = rri->requestBufp;
+  TSMLoc hdr_loc                = rri->requestHdrp;
+
+  TSMLoc field = TSMimeHdrFieldFind(bufp, hdr_loc, TS_MIME_FIELD_ACCEPT_ENCODING, TS_MIME_LEN_ACCEPT_ENCODING);
+  if (field == TS_NULL_MLOC) {
+    return TSREMAP_NO_REMAP;
+  }
+
+  // Accept-Encoding may be split over several fields; they make up one list.
+  AcceptedCodings accepted;
+  std::string_view first;
+  bool single = true;
+  for (TSMLoc dup = field; dup != TS_NULL_MLOC;) {
+    int len           = 0;
+    const char *value = TSMimeHdrFieldValueStringGet(bufp, hdr_loc, dup, -1, &len);
+    if (value) {
+      ScanAcceptEncoding(value, value + len, accepted);
+    }
+    TSMLoc next = TSMimeHdrFieldNextDup(bufp, hdr_loc, dup);
+    if (dup == field) {
+      first = value ? std::string_view{value, static_cast<size_t>(len)} : std::string_view{};
+    } else {
+      single = false;
+      TSHandleMLocRelease(bufp, hdr_loc, dup);
+    }
+    dup = next;
+  }
+
+  char buf[MAX_NORMALIZED];
+  std::string_view normalized = policy->normalize(accepted, buf);
+  VDEBUG("before=%.*s%s, after=%.*s", static_cast<int>(first.size()), first.data(), single ? "" : ", ...",
+         static_cast<int>(normalized.size()), normalized.data());
+
+  if (normalized.empty()) {
+    for (TSMLoc dup = field; dup != TS_NULL_MLOC;) {
+      TSMLoc next = TSMimeHdrFieldNextDup(bufp, hdr_loc, dup);
+      TSMimeHdrFieldDestroy(bufp, hdr_loc, dup);
+      TSHandleMLocRelease(bufp, hdr_loc, dup);
+      dup = next;
+    }
+    return TSREMAP_NO_REMAP;
+  }
+
+  if (!single || first != normalized) {
+    TSMimeHdrFieldValueStringSet(bufp, hdr_loc, field, -1, normalized.data(), static_cast<int>(normalized.size()));
+    for (TSMLoc dup = TSMimeHdrFieldNextDup(bufp, hdr_loc, field); dup != TS_NULL_MLOC;) {
+      TSMLoc next = TSMimeHdrFieldNextDup(bufp, hdr_loc, dup);
+      TSMimeHdrFieldDestroy(bufp, hdr_loc, dup);
+      TSHandleMLocRelease(bufp, hdr_loc, dup);
+      dup = next;
+    }
+  }
+  TSHandleMLocRelease(bufp, hdr_loc, field);
+
+  return TSREMAP_NO_REMAP;
+}
+
+TSReturnCode
+TSRemapNewInstance(int argc, char *argv[], void **ih, [[maybe_unused]] char *errbuf, [[maybe_unused]] int errbuf_size)
+{
+  static const struct option longopt[] = {
+    {"codings",  required_argument, nullptr, 'c' },
+    {"combine",  no_argument,       nullptr, 'C' },
+    {"ats-mode", required_argument, nullptr, 'a' },
+    {nullptr,    no_argument,       nullptr, '\0'}
+  };
+
+  auto *policy = new NormalizePolicy;
+
+  // argv contains the "to" and "from" URLs. Skip the first so that the
+  // second one poses as the program name.
+  --argc;
+  ++argv;
+  optind = 0;
+
+  while (true) {
+    int opt = getopt_long(argc, (char *const *)argv, "c:Ca:", longopt, nullptr);
+
+    switch (opt) {
+    case 'c': {
+      if (!ParseCodings(optarg, policy->codings)) {
+        VERROR("--codings must list br, gzip, zstd or identity, each once: %s\n", optarg);
+        delete policy;
+        return TS_ERROR;
+      }
+    } break;
+    case 'C': {
+      policy->combine = true;
+    } break;
+    case 'a': {
+      if (!ApplyAtsMode(atoi(optarg), *policy)) {
+        VERROR("--ats-mode must be 1 to 5: %s\n", optarg);
+        delete policy;
+        return TS_ERROR;
+      }
+    } break;
+    }
+
+    if (opt == -1) {
+      break;
+    }
+  }
+
+  *ih = policy;
+  return TS_SUCCESS;
+}
+
+void
+TSRemapDeleteInstance(void *ih)
+{
+  Dbg(dbg_ctl, "enter");
+  delete static_cast<NormalizePolicy *>(ih);
+}
@@ -29,17 +29,22 @@
 #include <cstdio>
 #include <cstdlib>
 #include <climits>
+#include <cinttypes>
 #include <cctype>
 
+#include <algorithm>
 #include <fstream> /* std::ifstream */
+#include <iterator>
 #include <string>
 #include <unordered_map>
 
+#include <charconv>
 #include <chrono>
 #include <atomic>
 #include <thread>
 #include <mutex>
 #include <shared_mutex>
+#include <system_error>
 #include <thread>
 
 #include <ts/ts.h>
@@ -48,6 +53,8 @@
 #include <yaml-cpp/yaml.h>
 #include "swoc/TextView.h"
 #include "lmdb-cpp.h"
+#include "token-bucket-table.h"
+#include "txn-latency.h"
 
 #include "aws_auth_v4.h"
 
@@ -65,6 +72,284 @@ static LMDB::Dbi gLMDBCredentialsDbi;
 
 static const std::string gLmdbUserKey = "user1";
 
+///////////////////////////////////////////////////////////////////////////////
+// LMDB health stats, refreshed periodically on a task thread, plus a histogram
+// of credential lookup latency updated on every signed request.
+//
+static const int64_t gLookupLatencyBucketsUs[] = {1, 4, 16, 64, 256, 1024};
+
+// One bucket per bound above, plus one for everything slower.
+static constexpr size_t N_LOOKUP_LATENCY_BUCKETS = std::size(gLookupLatencyBucketsUs) + 1;
+
+static struct {
+  int readers_max           = -1;
+  int readers_used          = -1;
+  int readers_high_water    = -1;
+  int readers_stale_cleared = -1;
+  int map_size              = -1;
+  int map_used              = -1;
+  int btree_depth           = -1;
+  int branch_pages          = -1;
+  int leaf_pages            = -1;
+  int overflow_pages        = -1;
+  int entries               = -1;
+  int lookup_count          = -1;
+  int lookup_errors         = -1;
+  int lookup_latency_us[N_LOOKUP_LATENCY_BUCKETS];
+} gLmdbStats;
+
+static int
+createStat(const std::string &name, TSRecordDataType type, TSStatSync sync)
+{
+  int id;
+  if (TSStatFindName(name.c_str(), &id) == TS_ERROR) {
+    id = TSStatCreate(name.c_str(), type, TS_STAT_NON_PERSISTENT, sync);
+  }
+  return id;
+}
+
+static void
+createLmdbStats()
+{
+  const std::string prefix = std::string{PLUGIN_NAME} + ".lmdb.";
+  auto gauge               = [&prefix](const std::string &name) {
+    return createStat(prefix + name, TS_RECORDDATATYPE_INT, TS_STAT_SYNC_SUM);
+  };
+  auto counter = [&prefix](const std::string &name) {
+    return createStat(prefix + name, TS_RECORDDATATYPE_COUNTER, TS_STAT_SYNC_SUM);
+  };
+
+  gLmdbStats.readers_max           = gauge("readers.max");
+  gLmdbStats.readers_used          = gauge("readers.used");
+  gLmdbStats.readers_high_water    = gauge("readers.high_water");
+  gLmdbStats.readers_stale_cleared = counter("readers.stale_cleared");
+  gLmdbStats.map_size              = gauge("map.size");
+  gLmdbStats.map_used              = gauge("map.used");
+  gLmdbStats.btree_depth           = gauge("credentials.depth");
+  gLmdbStats.branch_pages          = gauge("credentials.branch_pages");
+  gLmdbStats.leaf_pages            = gauge("credentials.leaf_pages");
+  gLmdbStats.overflow_pages        = gauge("credentials.overflow_pages");
+  gLmdbStats.entries               = gauge("credentials.entries");
+  gLmdbStats.lookup_count          = counter("lookup.count");
+  gLmdbStats.lookup_errors         = counter("lookup.errors");
+  for (size_t i = 0; i < N_LOOKUP_LATENCY_BUCKETS; ++i) {
+    std::string bound               = i < N_LOOKUP_LATENCY_BUCKETS - 1 ? std::to_string(gLookupLatencyBucketsUs[i]) : "inf";
+    gLmdbStats.lookup_latency_us[i] = counter("lookup.latency_us.le_" + bound);
+  }
+}
+
+static void
+recordLmdbLookup(TSHRTime start, bool ok)
+{
+  int64_t elapsed_us = (TShrtime() - start) / 1000;
+  size_t bucket      = 0;
+  while (bucket < N_LOOKUP_LATENCY_BUCKETS - 1 && elapsed_us > gLookupLatencyBucketsUs[bucket]) {
+    ++bucket;
+  }
+  TSStatIntIncrement(gLmdbStats.lookup_latency_us[bucket], 1);
+  TSStatIntIncrement(gLmdbStats.lookup_count, 1);
+  if (!ok) {
+    TSStatIntIncrement(gLmdbStats.lookup_errors, 1);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Per access key rate limiting. A credential record may end with a rate (in
+// requests a second) and an optional burst, and requests signed with an access
+// key over its budget are answered with a 503 and a Retry-After before they
+// are signed, instead of being sent to an origin that would throttle every
+// tenant behind us. The fill level of each key's bucket is exported as
+// obj_store_auth.ratelimit.<access_key>.tokens.
+//
+struct RateLimit {
+  uint32_t rate  = 0; // 0 means unlimited
+  uint32_t burst = 0; // defaults to rate
+};
+
+static TokenBucketTable gRateLimits;
+static int gRetryAfterArg     = -1;
+static TSCont gRetryAfterCont = nullptr;
+
+static struct {
+  int allowed    = -1;
+  int limited    = -1;
+  int table_full = -1;
+  int tokens[TokenBucketTable::N_SLOTS];
+} gRateLimitStats;
+
+static void
+createRateLimitStats()
+{
+  const std::string prefix = std::string{PLUGIN_NAME} + ".ratelimit.";
+
+  gRateLimitStats.allowed    = createStat(prefix + "allowed", TS_RECORDDATATYPE_COUNTER, TS_STAT_SYNC_SUM);
+  gRateLimitStats.limited    = createStat(prefix + "limited", TS_RECORDDATATYPE_COUNTER, TS_STAT_SYNC_SUM);
+  gRateLimitStats.table_full = createStat(prefix + "table_full", TS_RECORDDATATYPE_COUNTER, TS_STAT_SYNC_SUM);
+  std::fill(std::begin(gRateLimitStats.tokens), std::end(gRateLimitStats.tokens), -1);
+}
+
+// Parses the "rate[\tburst]" fields that may follow the secret key in a
+// credential record.
+static bool
+parseRateLimit(std::string_view fields, RateLimit &limit)
+{
+  auto tabPos           = fields.find('\t');
+  std::string_view rate = fields.substr(0, tabPos);
+  if (std::from_chars(rate.data(), rate.data() + rate.size(), limit.rate).ec != std::errc{}) {
+    return false;
+  }
+  limit.burst = limit.rate;
+  if (tabPos != std::string_view::npos) {
+    std::string_view burst = fields.substr(tabPos + 1);
+    if (std::from_chars(burst.data(), burst.data() + burst.size(), limit.burst).ec != std::errc{}) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Takes a token for accessKey. Returns false when the key is over its budget,
+// after arranging for the client response to carry a Retry-After.
+static bool
+takeRateLimitToken(TSHttpTxn txnp, std::string_view accessKey, const RateLimit &limit)
+{
+  if (limit.rate == 0) {
+    return true;
+  }
+
+  int64_t retryAfterNs = 0;
+  switch (gRateLimits.take(accessKey, limit.rate, limit.burst, TShrtime(), retryAfterNs)) {
+  case TokenBucketTable::Result::Allowed:
+    TSStatIntIncrement(gRateLimitStats.allowed, 1);
+    return true;
+  case TokenBucketTable::Result::TableFull:
+    // Fail open: a key we cannot track is not held back.
+    TSStatIntIncrement(gRateLimitStats.table_full, 1);
+    return true;
+  case TokenBucketTable::Result::Limited:
+    break;
+  }
+
+  TSStatIntIncrement(gRateLimitStats.limited, 1);
+  intptr_t retryAfterSec = std::max<int64_t>((retryAfterNs + 999999999) / 1000000000, 1);
+  Dbg(dbg_ctl, "access key %.*s is over its rate limit, retry after %" PRIdPTR "s", static_cast<int>(accessKey.size()),
+      accessKey.data(), retryAfterSec);
+  TSUserArgSet(txnp, gRetryAfterArg, reinterpret_cast<void *>(retryAfterSec));
+  TSHttpTxnHookAdd(txnp, TS_HTTP_SEND_RESPONSE_HDR_HOOK, gRetryAfterCont);
+  return false;
+}
+
+// Adds the Retry-After set by takeRateLimitToken to the 503 sent to the client.
+static int
+retryAfterHandler(TSCont /* cont ATS_UNUSED */, TSEvent /* event ATS_UNUSED */, void *edata)
+{
+  TSHttpTxn txnp         = static_cast<TSHttpTxn>(edata);
+  intptr_t retryAfterSec = reinterpret_cast<intptr_t>(TSUserArgGet(txnp, gRetryAfterArg));
+  TSMBuffer bufp;
+  TSMLoc hdr_loc;
+
+  if (retryAfterSec > 0 && TSHttpTxnClientRespGet(txnp, &bufp, &hdr_loc) == TS_SUCCESS) {
+    TSMLoc field_loc;
+    if (TSMimeHdrFieldCreateNamed(bufp, hdr_loc, TS_MIME_FIELD_RETRY_AFTER, TS_MIME_LEN_RETRY_AFTER, &field_loc) == TS_SUCCESS) {
+      TSMimeHdrFieldValueIntSet(bufp, hdr_loc, field_loc, -1, static_cast<int>(retryAfterSec));
+      TSMimeHdrFieldAppend(bufp, hdr_loc, field_loc);
+      TSHandleMLocRelease(bufp, hdr_loc, field_loc);
+    }
+    TSHandleMLocRelease(bufp, TS_NULL_MLOC, hdr_loc);
+  }
+  TSHttpTxnReenable(txnp, TS_EVENT_HTTP_CONTINUE);
+  return 0;
+}
+
+// Exports the fill level of every bucket. Stats for access keys are created
+// here, on a task thread, the first time a key shows up.
+static int
+rateLimitStatsUpdate(TSCont /* cont ATS_UNUSED */, TSEvent /* event ATS_UNUSED */, void * /* edata ATS_UNUSED */)
+{
+  gRateLimits.forEach(TShrtime(), [](size_t i, std::string_view accessKey, int64_t tokens, int64_t /* burst */) {
+    int &id = gRateLimitStats.tokens[i];
+    if (id == -1) {
+      std::string name = std::string{PLUGIN_NAME} + ".ratelimit." + std::string{accessKey} + ".tokens";
+      id               = createStat(name, TS_RECORDDATATYPE_INT, TS_STAT_SYNC_SUM);
+    }
+    TSStatIntSet(id, tokens);
+  });
+  return 0;
+}
+
+static int
+lmdbStatsUpdate(TSCont /* cont ATS_UNUSED */, TSEvent /* event ATS_UNUSED */, void * /* edata ATS_UNUSED */)
+{
+  try {
+    int dead = gLmdbEnv.reader_check();
+    if (dead > 0) {
+      TSWarning("[%s] cleared %d stale LMDB reader slots", PLUGIN_NAME, dead);
+      TSStatIntIncrement(gLmdbStats.readers_stale_cleared, dead);
+    }
+
+    MDB_envinfo info  = gLmdbEnv.info();
+    MDB_stat env_stat = gLmdbEnv.stat();
+    TSStatIntSet(gLmdbStats.readers_max, info.me_maxreaders);
+    TSStatIntSet(gLmdbStats.readers_used, gLmdbEnv.reader_count());
+    // me_numreaders is the number of reader slots ever taken, not the number
+    // in use now: LMDB does not shrink it when a reader goes away.
+    TSStatIntSet(gLmdbStats.readers_high_water, info.me_numreaders);
+    TSStatIntSet(gLmdbStats.map_size, info.me_mapsize);
+    TSStatIntSet(gLmdbStats.map_used, (info.me_last_pgno + 1) * env_stat.ms_psize);
+
+    auto txn      = gLmdbEnv.begin_readonly_txn();
+    MDB_stat stat = txn.stat(gLMDBCredentialsDbi);
+    txn.commit();
+    TSStatIntSet(gLmdbStats.btree_depth, stat.ms_depth);
+    TSStatIntSet(gLmdbStats.branch_pages, stat.ms_branch_pages);
+    TSStatIntSet(gLmdbStats.leaf_pages, stat.ms_leaf_pages);
+    TSStatIntSet(gLmdbStats.overflow_pages, stat.ms_overflow_pages);
+    TSStatIntSet(gLmdbStats.entries, stat.ms_entries);
+  } catch (const LMDB::RuntimeError &e) {
+    TSWarning("[%s] failed to update LMDB stats: %s", PLUGIN_NAME, e.what());
+  }
+  return 0;
+}
+
+// Reads one byte of every used page of the LMDB map on a task thread, so that
+// requests right after startup do not take the page faults themselves.
+static int
+lmdbWarmup(TSCont cont, TSEvent /* event ATS_UNUSED */, void * /* edata ATS_UNUSED */)
+{
+  try {
+    size_t pages = gLmdbEnv.touch_pages();
+    Dbg(dbg_ctl, "LMDB warm-up touched %zu pages", pages);
+  } catch (const LMDB::RuntimeError &e) {
+    TSWarning("[%s] LMDB warm-up failed: %s", PLUGIN_NAME, e.what());
+  }
+  TSContDestroy(cont);
+  return 0;
+}
+
+// Prefaults the LMDB map according to the "prefault" config value: "willneed"
+// starts asynchronous readahead of the used pages, "mlock" reads them in and
+// pins them. Failures only cost latency, so they are reported as warnings.
+static void
+prefaultLmdbMap(const std::string &prefault)
+{
+  try {
+    if (prefault == "willneed") {
+      gLmdbEnv.advise_willneed();
+    } else if (prefault == "mlock") {
+      gLmdbEnv.lock_map();
+    } else if (prefault != "none") {
+      TSWarning("[%s] unknown prefault value: %s", PLUGIN_NAME, prefault.c_str());
+      return;
+    }
+    Dbg(dbg_ctl, "prefaulted LMDB map with %s", prefault.c_str());
+  } catch (const std::system_error &e) {
+    TSWarning("[%s] failed to prefault LMDB map with %s: %s", PLUGIN_NAME, prefault.c_str(), e.what());
+  } catch (const LMDB::RuntimeError &e) {
+    // Finding the used part of the map may fail too; that is no more fatal.
+    TSWarning("[%s] failed to prefault LMDB map with %s: %s", PLUGIN_NAME, prefault.c_str(), e.what());
+  }
+}
+
 static void
 doOpenLmdbDb(const std::string &config_path)
 {
@@ -74,16 +359,41 @@ doOpenLmdbDb(const std::string &config_path)
   const size_t map_size          = config["map_size"].as<size_t>();
   const unsigned int max_readers = config["max_readers"].as<unsigned int>();
   const unsigned int max_dbs     = config["max_dbs"].as<unsigned int>();
+  const bool no_tls              = config["no_tls"].as<bool>(true);
+  const bool no_readahead        = config["no_readahead"].as<bool>(false);
+  const std::string prefault     = config["prefault"].as<std::string>("none");
+  const bool warmup              = config["warmup"].as<bool>(false);
+  const int stats_interval       = config["stats_interval"].as<int>(10);
+
+  unsigned int flags = LMDB::Env::RDONLY;
+  if (no_tls) {
+    flags |= LMDB::Env::NOTLS;
+  }
+  if (no_readahead) {
+    flags |= LMDB::Env::NORDAHEAD;
+  }
 
   gLmdbEnv.init();
   gLmdbEnv.set_mapsize(map_size);
   gLmdbEnv.set_maxreaders(max_readers);
   gLmdbEnv.set_maxdbs(max_dbs);
-  gLmdbEnv.open(lmdb_path.c_str(), MDB_RDONLY);
+  gLmdbEnv.open(lmdb_path.c_str(), flags);
   auto txn            = gLmdbEnv.begin_readonly_txn();
   gLMDBCredentialsDbi = txn.open_dbi("credentials");
   txn.commit();
   Dbg(dbg_ctl, "gLMDBCredentialsDbi=%u", gLMDBCredentialsDbi);
+
+  prefaultLmdbMap(prefault);
+  if (warmup) {
+    TSContScheduleOnPool(TSContCreate(lmdbWarmup, TSMutexCreate()), 0, TS_THREAD_POOL_TASK);
+  }
+
+  createLmdbStats();
+  createRateLimitStats();
+  if (stats_interval > 0) {
+    TSContScheduleEveryOnPool(TSContCreate(lmdbStatsUpdate, TSMutexCreate()), stats_interval * 1000, TS_THREAD_POOL_TASK);
+    TSContScheduleEveryOnPool(TSContCreate(rateLimitStatsUpdate, TSMutexCreate()), stats_interval * 1000, TS_THREAD_POOL_TASK);
+  }
 }
 
 /**
@@ -808,11 +1118,15 @@ S3Request::authorizeV4(S3Config *s3)
   TsApi api(_bufp, _hdr_loc, _url_loc);
   time_t now = time(nullptr);
 
+  TSHRTime lookupStart = TShrtime();
+  bool lookupDone      = false;
   try {
     Dbg(dbg_ctl, "opening LMDB transaction");
     auto txn = gLmdbEnv.begin_readonly_txn();
     Dbg(dbg_ctl, "opened LMDB transaction, gLMDBCredentialsDbi=%u", gLMDBCredentialsDbi);
     auto userConfig = txn.get<std::string_view, std::string_view>(gLMDBCredentialsDbi, gLmdbUserKey);
+    recordLmdbLookup(lookupStart, true);
+    lookupDone = true;
     Dbg(dbg_ctl, "got userConfig len=%lu", userConfig.size());
     Dbg(dbg_ctl, "userConfig=%.*s", static_cast<int>(userConfig.size()), userConfig.data());
     auto bucketEndPos = userConfig.find('\t');
@@ -837,8 +1151,17 @@ S3Request::authorizeV4(S3Config *s3)
     }
     auto accessKey = userConfig.substr(regionEndPos + 1, accessKeyEndPos - (regionEndPos + 1));
     Dbg(dbg_ctl, "accessKey=%.*s!", static_cast<int>(accessKey.size()), accessKey.data());
-    auto secretKey = userConfig.substr(accessKeyEndPos + 1);
+    auto secretKeyEndPos = userConfig.find('\t', accessKeyEndPos + 1);
+    auto secretKey       = userConfig.substr(accessKeyEndPos + 1, secretKeyEndPos - (accessKeyEndPos + 1));
     Dbg(dbg_ctl, "secretKey=%.*s!", static_cast<int>(secretKey.size()), secretKey.data());
+    RateLimit limit;
+    if (secretKeyEndPos != std::string_view::npos && !parseRateLimit(userConfig.substr(secretKeyEndPos + 1), limit)) {
+      throw std::runtime_error("invalid LMDB data format");
+    }
+    if (!takeRateLimitToken(_txnp, accessKey, limit)) {
+      txn.commit();
+      return TS_HTTP_STATUS_SERVICE_UNAVAILABLE;
+    }
 
     AwsAuthV4 util(api, &now, /* signPayload */ false, accessKey, secretKey, "s3", s3->v4includeHeaders(), s3->v4excludeHeaders(),
                    s3->v4RegionMap());
@@ -878,6 +1201,9 @@ S3Request::authorizeV4(S3Config *s3)
       return TS_HTTP_STATUS_INTERNAL_SERVER_ERROR;
     }
   } catch (std::runtime_error &e) {
+    if (!lookupDone) {
+      recordLmdbLookup(lookupStart, false);
+    }
     TSError("[%s] Failed to get data from LMDB: %s", PLUGIN_NAME, e.what());
     return TS_HTTP_STATUS_INTERNAL_SERVER_ERROR;
   }
@@ -989,6 +1315,14 @@ config_reloader(TSCont cont, TSEvent event, void *edata)
 TSReturnCode
 TSRemapInit(TSRemapInterface *api_info, char *errbuf, int errbuf_size)
 {
+  if (TxnLatency::init(PLUGIN_NAME) != TS_SUCCESS) {
+    return TS_ERROR;
+  }
+  if (TSUserArgIndexReserve(TS_USER_ARGS_TXN, PLUGIN_NAME, "Retry-After of rate limited requests", &gRetryAfterArg) != TS_SUCCESS) {
+    TSError("[%s] Unable to reserve a transaction slot for Retry-After", PLUGIN_NAME);
+    return TS_ERROR;
+  }
+  gRetryAfterCont = TSContCreate(retryAfterHandler, nullptr);
   Dbg(dbg_ctl, "plugin is successfully initialized");
   return TS_SUCCESS;
 }
@@ -1140,6 +1474,9 @@ TSRemapDoRemap(void *ih, TSHttpTxn txnp, TSRemapRequestInfo * /* rri */)
     // Another option would be to use a single global hook, and pass the "s3"
     // configs via a TXN argument.
     s3->schedule(txnp);
+    // Added after the signing hook, so the send stamp is taken once the
+    // request is signed and remap_to_send includes the signing time.
+    TxnLatency::start(txnp);
   } else {
     Dbg(dbg_ctl, "Remap context is invalid");
     TSError("[%s] No remap context available, check code / config", PLUGIN_NAME);
@@ -29,7 +29,10 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <memory>
 #include <pthread.h>
+#include <string>
+#include <string_view>
 
 #include <inttypes.h>
 
@@ -44,6 +47,9 @@
 
 #include "ts/ts.h"
 #include "ts/remap.h"
+#include "instance-registry.h"
+#include "rewrite-engine.h"
+#include "txn-latency.h"
 
 #define PLUGIN_NAME "remap"
 
@@ -55,24 +61,22 @@ DbgCtl dbg_ctl{PLUGIN_NAME};
 class remap_entry
 {
 public:
-  static remap_entry *active_list;
-  static pthread_mutex_t mutex;
-  remap_entry *next;
+  static InstanceRegistry<remap_entry> registry; /* live instances, readable from any thread */
   int argc;
   char **argv;
+  rewrite_engine rules;
   remap_entry(int _argc, char *_argv[]);
   ~remap_entry();
-  static void add_to_list(remap_entry *re);
-  static void remove_from_list(remap_entry *re);
 };
 
 static int plugin_init_counter = 0;               /* remap plugin initialization counter */
+static int instances_stat      = -1;              /* remap.instances: live instances */
+static int rules_stat          = -1;              /* remap.rules: rewrite rules of the live instances */
 static pthread_mutex_t remap_plugin_global_mutex; /* remap plugin global mutex */
-remap_entry *remap_entry::active_list = nullptr;
-pthread_mutex_t remap_entry::mutex; /* remap_entry class mutex */
+InstanceRegistry<remap_entry> remap_entry::registry;
 
 /* ----------------------- remap_entry::remap_entry ------------------------ */
-remap_entry::remap_entry(int _argc, char *_argv[]) : next(nullptr), argc(0), argv(nullptr)
+remap_entry::remap_entry(int _argc, char *_argv[]) : argc(0), argv(nullptr)
 {
   if (_argc > 0 && _argv && (argv = static_cast<char **>(TSmalloc(sizeof(char *) * (_argc + 1)))) != nullptr) {
     int i;
@@ -95,32 +99,34 @@ remap_entry::~remap_entry()
   }
 }
 
-/* --------------------- remap_entry::add_to_list -------------------------- */
-void
-remap_entry::add_to_list(remap_entry *re)
+/* ------------------------ instance_stats_update ------------------------- */
+// Runs on a task thread every STATS_INTERVAL_MS, while instances are being
+// added and removed by config reloads. The registry's snapshot keeps every
+// instance it visits alive until the walk is done.
+static constexpr TSHRTime STATS_INTERVAL_MS = 10000;
+
+static int
+instance_stats_update(TSCont cont ATS_UNUSED, TSEvent event ATS_UNUSED, void *edata ATS_UNUSED)
 {
-  if (likely(re && plugin_init_counter)) {
-    pthread_mutex_lock(&mutex);
-    re->next    = active_list;
-    active_list = re;
-    pthread_mutex_unlock(&mutex);
-  }
+  TSMgmtInt instances = 0;
+  TSMgmtInt rules     = 0;
+  remap_entry::registry.forEach([&](const remap_entry &entry) {
+    instances++;
+    rules += entry.rules.size();
+  });
+  TSStatIntSet(instances_stat, instances);
+  TSStatIntSet(rules_stat, rules);
+  return 0;
 }
 
-/* ------------------ remap_entry::remove_from_list ------------------------ */
-void
-remap_entry::remove_from_list(remap_entry *re)
+static int
+create_gauge(const char *name)
 {
-  if (likely(re && plugin_init_counter)) {
-    pthread_mutex_lock(&mutex);
-    for (remap_entry **rre = &active_list; *rre; rre = &((*rre)->next)) {
-      if (re == *rre) {
-        *rre = re->next;
-        break;
-      }
-    }
-    pthread_mutex_unlock(&mutex);
+  int id;
+  if (TSStatFindName(name, &id) == TS_ERROR) {
+    id = TSStatCreate(name, TS_RECORDDATATYPE_INT, TS_STAT_NON_PERSISTENT, TS_STAT_SYNC_SUM);
   }
+  return id;
 }
 
 /* ----------------------- store_my_error_message -------------------------- */
@@ -163,11 +169,16 @@ TSRemapInit(TSRemapInterface *api_info, char *errbuf, int errbuf_size)
                                     static_cast<int>(api_info->tsremap_version & 0xffff));
     }
 
-    if (pthread_mutex_init(&remap_plugin_global_mutex, nullptr) ||
-        pthread_mutex_init(&remap_entry::mutex, nullptr)) { /* pthread_mutex_init - always returns 0.
-                                                               :) - impossible error */
+    if (pthread_mutex_init(&remap_plugin_global_mutex, nullptr)) { /* pthread_mutex_init - always returns 0.
+                                                                      :) - impossible error */
       return store_my_error_message(TS_ERROR, errbuf, errbuf_size, "Mutex initialization error");
     }
+    if (TxnLatency::init(PLUGIN_NAME) != TS_SUCCESS) {
+      return store_my_error_message(TS_ERROR, errbuf, errbuf_size, "Latency instrumentation initialization error");
+    }
+    instances_stat = create_gauge(PLUGIN_NAME ".instances");
+    rules_stat     = create_gauge(PLUGIN_NAME ".rules");
+    TSContScheduleEveryOnPool(TSContCreate(instance_stats_update, TSMutexCreate()), STATS_INTERVAL_MS, TS_THREAD_POOL_TASK);
     plugin_init_counter++;
   }
   return TS_SUCCESS; /* success */
@@ -196,13 +207,27 @@ TSRemapNewInstance(int argc, char *argv[], void **ih, char *errbuf, int errbuf_s
     Dbg(dbg_ctl, "[%s] - argv[%d] = \"%s\"\n", __func__, i, argv[i]);
   }
 
-  ri = new remap_entry(argc, argv);
+  auto entry = std::make_shared<remap_entry>(argc, argv);
 
-  if (!ri) {
-    return store_my_error_message(TS_ERROR, errbuf, errbuf_size, "Can't create remap_entry class");
+  // Load the rewrite rules given with --rules=<file>, or fall back to the
+  // single hard-coded rule this example has always had.
+  const char *rules_path = nullptr;
+  for (i = 2; i < argc; i++) {
+    if (!strncmp(argv[i], "--rules=", 8)) {
+      rules_path = argv[i] + 8;
+    }
+  }
+  if (rules_path) {
+    std::string path = rules_path[0] == '/' ? rules_path : std::string(TSConfigDirGet()) + "/" + rules_path;
+    std::string error;
+    if (!entry->rules.load(path, error)) {
+      return store_my_error_message(TS_ERROR, errbuf, errbuf_size, "%s", error.c_str());
+    }
+  } else {
+    entry->rules.add_rule("flickr.com", "/47/", "foo.bar.com", "/47_copy/");
   }
 
-  remap_entry::add_to_list(ri);
+  ri = remap_entry::registry.add(std::move(entry));
 
   *ih = ri;
 
@@ -216,13 +241,12 @@ TSRemapDeleteInstance(void *ih)
 
   Dbg(dbg_ctl, "enter");
 
-  remap_entry::remove_from_list(ri);
-
-  delete ri;
+  // The registry owns ri; it is destroyed once no thread iterating the
+  // registry still holds it.
+  remap_entry::registry.remove(ri);
 }
 
 static std::atomic<uint64_t> processing_counter; // sequential counter
-static int arg_index;
 
 /* -------------------------- TSRemapDoRemap -------------------------------- */
 TSRemapStatus
@@ -230,7 +254,7 @@ TSRemapDoRemap(void *ih, TSHttpTxn rh, TSRemapRequestInfo *rri)
 {
   const char *temp;
   const char *temp2;
-  int len, len2, port;
+  int len, len2;
   TSMLoc cfield;
   uint64_t _processing_counter = processing_counter++;
 
@@ -242,6 +266,7 @@ TSRemapDoRemap(void *ih, TSHttpTxn rh, TSRemapRequestInfo *rri)
   }
 
   Dbg(dbg_ctl, "From: \"%s\"  To: \"%s\"\n", ri->argv[0], ri->argv[1]);
+  Dbg(dbg_ctl, "Live remap instances: %zu\n", remap_entry::registry.size());
 
   temp = TSUrlHostGet(rri->requestBufp, rri->requestUrl, &len);
   Dbg(dbg_ctl, "Request Host(%d): \"%.*s\"\n", len, len, temp);
@@ -279,12 +304,9 @@ TSRemapDoRemap(void *ih, TSHttpTxn rh, TSRemapRequestInfo *rri)
     Dbg(dbg_ctl, "Header value: %s\n", value);
   }
 
-  // How to store plugin private arguments inside Traffic Server request
-  // processing block.
-  if (TSUserArgIndexReserve(TS_USER_ARGS_TXN, "remap_example", "Example remap plugin", &arg_index) == TS_SUCCESS) {
-    Dbg(dbg_ctl, "Save processing counter %" PRIu64 " inside request processing block\n", _processing_counter);
-    TSUserArgSet(rh, arg_index, (void *)_processing_counter); // save counter
-  }
+  // Follow the transaction to its close, stamping it along the way. The
+  // stamps live in the plugin's TSUserArg slot of the transaction.
+  TxnLatency::start(rh);
   // How to cancel request processing and return error message to the client
   // We will do it every other request
   if (_processing_counter & 1) {
@@ -299,33 +321,25 @@ TSRemapDoRemap(void *ih, TSHttpTxn rh, TSRemapRequestInfo *rri)
     TSHttpTxnErrorBodySet(rh, tmp, len, nullptr); // Defaults to text/html
     my_local_counter++;
   }
-  // hardcoded case for remapping
-  // You need to check host and port if you are using the same plugin for
-  // multiple remapping rules
+  // Rewrite by the rules of this remapping
   temp  = TSUrlHostGet(rri->requestBufp, rri->requestUrl, &len);
   temp2 = TSUrlPathGet(rri->requestBufp, rri->requestUrl, &len2);
-  port  = TSUrlPortGet(rri->requestBufp, rri->requestUrl);
-
-  if (len == 10 && !memcmp("flickr.com", temp, 10) && port == 80 && len2 >= 3 && !memcmp("47/", temp2, 3)) {
-    char new_path[8192];
-
-    // Ugly, but so is the rest of this "example"
-    if (len2 + 7 >= 8192) {
-      return TSREMAP_NO_REMAP;
-    }
 
-    if (TSUrlPortSet(rri->requestBufp, rri->mapToUrl, TSUrlPortGet(rri->requestBufp, rri->mapToUrl)) != TS_SUCCESS) {
+  size_t matched;
+  const rewrite_engine::target *target;
+  if (temp && (target = ri->rules.match({temp, static_cast<size_t>(len)}, {temp2 ? temp2 : "", static_cast<size_t>(len2)},
+                                        matched)) != nullptr) {
+    // Reused across requests on this thread, so building the path does not
+    // allocate once it has grown to the longest path seen.
+    thread_local std::string new_path;
+    rewrite_engine::rewrite_path(*target, {temp2 ? temp2 : "", static_cast<size_t>(len2)}, matched, new_path);
+
+    if (!target->host.empty() &&
+        TSUrlHostSet(rri->requestBufp, rri->requestUrl, target->host.data(), static_cast<int>(target->host.size())) != TS_SUCCESS) {
       return TSREMAP_NO_REMAP;
     }
 
-    if (TSUrlHostSet(rri->requestBufp, rri->requestUrl, "foo.bar.com", 11) != TS_SUCCESS) {
-      return TSREMAP_NO_REMAP;
-    }
-
-    memcpy(new_path, "47_copy", 7);
-    memcpy(&new_path[7], &temp2[2], len2 - 2);
-
-    if (TSUrlPathSet(rri->requestBufp, rri->requestUrl, new_path, len2 + 5) == TS_SUCCESS) {
+    if (TSUrlPathSet(rri->requestBufp, rri->requestUrl, new_path.data(), static_cast<int>(new_path.size())) == TS_SUCCESS) {
       return TSREMAP_DID_REMAP;
     }
   }
@@ -338,10 +352,7 @@ TSRemapDoRemap(void *ih, TSHttpTxn rh, TSRemapRequestInfo *rri)
 void
 TSRemapOSResponse(void *ih ATS_UNUSED, TSHttpTxn rh, int os_response_type)
 {
-  void *data     = TSUserArgGet(rh,
-                                arg_index); // read counter (we store it in TSRemapDoRemap function call)
-  int request_id = data ? static_cast<int *>(data)[0] : -1;
-
-  Dbg(dbg_ctl, "Read processing counter %d from request processing block\n", request_id);
+  // read the stamp taken in TSRemapDoRemap
+  Dbg(dbg_ctl, "OS response %" PRId64 " us after remap\n", TxnLatency::sinceRemapUs(rh));
   Dbg(dbg_ctl, "OS response status: %d\n", os_response_type);
 }
@@ -24,17 +24,30 @@
  */
 
 #include <cerrno>
+#include <charconv>
 #include <cinttypes>
 
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <fstream>
 #include <sstream>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <random>
 #include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 #include <filesystem>
 #include <getopt.h>
 
@@ -44,243 +57,1938 @@
 #include "ts/ts.h"
 #include "ts/remap.h"
 
+#include "accept-encoding.h"
+
 constexpr char PLUGIN[] = "remap_echo";
 
-static DbgCtl dbg_ctl{PLUGIN};
+static DbgCtl dbg_ctl{PLUGIN};
+
+#define VDEBUG(fmt, ...) Dbg(dbg_ctl, fmt, ##__VA_ARGS__)
+
+#if DEBUG
+#define VERROR(fmt, ...) Dbg(dbg_ctl, fmt, ##__VA_ARGS__)
+#else
+#define VERROR(fmt, ...) TSError("[%s] %s: " fmt, PLUGIN, __FUNCTION__, ##__VA_ARGS__)
+#endif
+
+#define VIODEBUG(vio, fmt, ...)                                                                                              \
+  VDEBUG("vio=%p vio.cont=%p, vio.cont.data=%p, vio.vc=%p " fmt, (vio), TSVIOContGet(vio), TSContDataGet(TSVIOContGet(vio)), \
+         TSVIOVConnGet(vio), ##__VA_ARGS__)
+
+static int StatCountBytes      = -1;
+static int StatCountResponses  = -1;
+static int StatCountPoolHits   = -1;
+static int StatCountPoolMisses = -1;
+
+static int RemapEchoInterceptHook(TSCont contp, TSEvent event, void *edata);
+static int RemapEchoTxnHook(TSCont contp, TSEvent event, void *edata);
+static int RemapEchoContentWatch(TSCont contp, TSEvent event, void *edata);
+
+// The Connection field and empty line that end each response header.
+constexpr std::string_view KEEP_ALIVE_TAIL = "Connection: keep-alive\r\n\r\n";
+constexpr std::string_view CLOSE_TAIL      = "Connection: close\r\n\r\n";
+
+// Returns the smallest IOBuffer size index whose blocks hold nbytes, up to 32K.
+static TSIOBufferSizeIndex
+IOBufferSizeIndexFor(int64_t nbytes)
+{
+  int index = TS_IOBUFFER_SIZE_INDEX_128;
+  while (index < TS_IOBUFFER_SIZE_INDEX_32K && (int64_t{128} << index) < nbytes) {
+    ++index;
+  }
+  return static_cast<TSIOBufferSizeIndex>(index);
+}
+
+// Length of an IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT".
+constexpr size_t HTTP_DATE_LEN = 29;
+
+// Formats t as an IMF-fixdate into buf, which must hold HTTP_DATE_LEN + 1
+// bytes. Day and month names are fixed, so the result does not depend on the
+// locale.
+static void
+FormatHttpDate(time_t t, char *buf)
+{
+  static constexpr char DAYS[][4]   = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+  static constexpr char MONTHS[][4] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+  struct tm tm;
+
+  gmtime_r(&t, &tm);
+  snprintf(buf, HTTP_DATE_LEN + 1, "%s, %02d %s %04d %02d:%02d:%02d GMT", DAYS[tm.tm_wday], tm.tm_mday, MONTHS[tm.tm_mon],
+           tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+// Returns the current time as an IMF-fixdate. The string is cached per thread
+// and only reformatted when the second changes.
+static std::string_view
+HttpDateNow()
+{
+  thread_local time_t cachedTime = -1;
+  thread_local char cachedDate[HTTP_DATE_LEN + 1];
+
+  time_t now = time(nullptr);
+  if (now != cachedTime) {
+    FormatHttpDate(now, cachedDate);
+    cachedTime = now;
+  }
+  return {cachedDate, HTTP_DATE_LEN};
+}
+
+// The status line and header fields of a response, serialized once per
+// config. Only the Date value differs between requests, and since it has a
+// fixed width it is patched in place while the header is copied out. Range
+// responses build their own template, with the Content-Range field in
+// extraFields.
+struct RemapEchoHeaderTemplate {
+  // Pass as contentLength for a response that never has a body, such as a
+  // 304. Content-Length and Content-Type are then left out.
+  static constexpr int64_t NO_BODY = -1;
+
+  RemapEchoHeaderTemplate(TSHttpStatus status, std::string_view mimeType, int64_t contentLength, std::string_view extraFields = {})
+  {
+    const char *reason = TSHttpHdrReasonLookup(status);
+
+    text.append("HTTP/1.1 ").append(std::to_string(status)).append(" ").append(reason ? reason : "").append("\r\n");
+    text.append(TS_MIME_FIELD_DATE, TS_MIME_LEN_DATE).append(": ");
+    dateOffset = text.size();
+    text.append(HTTP_DATE_LEN, ' ').append("\r\n");
+    if (contentLength != NO_BODY) {
+      text.append(TS_MIME_FIELD_CONTENT_LENGTH, TS_MIME_LEN_CONTENT_LENGTH).append(": ").append(std::to_string(contentLength));
+      text.append("\r\n");
+    }
+    text.append(TS_MIME_FIELD_CACHE_CONTROL, TS_MIME_LEN_CACHE_CONTROL).append(": no-cache\r\n");
+    if (contentLength != NO_BODY) {
+      text.append(TS_MIME_FIELD_CONTENT_TYPE, TS_MIME_LEN_CONTENT_TYPE).append(": ").append(mimeType).append("\r\n");
+    }
+    text.append(extraFields);
+  }
+
+  // Writes the header with the current Date, followed by tail, into iobuf and
+  // returns the number of bytes written. tail holds any per-request fields
+  // and the empty line ending the header. When the current block has room,
+  // everything is copied straight into it.
+  int64_t
+  write(TSIOBuffer iobuf, std::string_view tail) const
+  {
+    std::string_view date = HttpDateNow();
+    int64_t len           = text.size() + tail.size();
+    int64_t avail         = 0;
+    char *start           = TSIOBufferBlockWriteStart(TSIOBufferStart(iobuf), &avail);
+
+    if (avail >= len) {
+      memcpy(start, text.data(), text.size());
+      memcpy(start + dateOffset, date.data(), date.size());
+      memcpy(start + text.size(), tail.data(), tail.size());
+      TSIOBufferProduce(iobuf, len);
+    } else {
+      TSIOBufferWrite(iobuf, text.data(), dateOffset);
+      TSIOBufferWrite(iobuf, date.data(), date.size());
+      TSIOBufferWrite(iobuf, text.data() + dateOffset + date.size(), text.size() - dateOffset - date.size());
+      TSIOBufferWrite(iobuf, tail.data(), tail.size());
+    }
+    return len;
+  }
+
+  std::string text;
+  size_t dateOffset = 0;
+};
+
+// Returns the 64-bit FNV-1a hash of data.
+static uint64_t
+Fnv1a(std::string_view data)
+{
+  uint64_t hash = 0xcbf29ce484222325;
+  for (unsigned char c : data) {
+    hash ^= c;
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+
+// An open content file that responses are read from in chunks with pread(),
+// so serving the file does not pin it in memory. The descriptor keeps the
+// inode that was opened, so a file replaced by renaming a new one over it is
+// still served whole from the old inode until the next reload. A file that
+// is truncated or rewritten in place is not: reads past its new end fail and
+// the response is cut short. Replace content files by atomic rename.
+class ContentFile
+{
+public:
+  ContentFile() = default;
+
+  ~ContentFile()
+  {
+    if (fd_ != -1) {
+      ::close(fd_);
+    }
+  }
+
+  ContentFile(const ContentFile &)            = delete;
+  ContentFile &operator=(const ContentFile &) = delete;
+
+  // Opens path, returning false with errno set on failure.
+  bool
+  open(const std::string &path)
+  {
+    fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_ == -1) {
+      return false;
+    }
+
+    if (fstat(fd_, &st_) == -1) {
+      return false;
+    }
+    // Responses read the file front to back.
+    posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return true;
+  }
+
+  int64_t
+  size() const
+  {
+    return st_.st_size;
+  }
+
+  // Appends length bytes of the file starting at offset to out, reading them
+  // straight into the blocks of out. Returns false if the file could not be
+  // read, or ended early because it was truncated since it was opened.
+  bool
+  read(TSIOBuffer out, int64_t offset, int64_t length) const
+  {
+    while (length > 0) {
+      int64_t avail = 0;
+      char *start   = TSIOBufferBlockWriteStart(TSIOBufferStart(out), &avail);
+      ssize_t n     = pread(fd_, start, std::min(avail, length), offset);
+
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return false;
+      }
+      TSIOBufferProduce(out, n);
+      offset += n;
+      length -= n;
+    }
+    return true;
+  }
+
+  // Returns a hash of the inode, size and mtime of the file. Any change that
+  // a replacement by rename or a rewrite leaves behind changes it, so it makes
+  // a strong entity tag without reading the file through.
+  uint64_t
+  identityHash() const
+  {
+    int64_t stamp[] = {static_cast<int64_t>(st_.st_ino), st_.st_size, st_.st_mtim.tv_sec, st_.st_mtim.tv_nsec};
+    return Fnv1a({reinterpret_cast<const char *>(stamp), sizeof(stamp)});
+  }
+
+private:
+  int fd_ = -1;
+  struct stat st_ {};
+};
+
+// One representation of the response body: the content file itself, or one
+// of its precompressed siblings. The body is either loaded once into an
+// IOBuffer that is never consumed, or read from its open file. In the first
+// case requests copy it into their own write buffer with TSIOBufferCopy(),
+// which clones the blocks by reference, so serving the body copies no bytes. A
+// file body is streamed in chunks instead, so large files never need to fit in
+// an IOBuffer.
+struct RemapEchoVariant {
+  // fields holds the header fields that describe this variant, which every
+  // response serving it carries. A 304 carries only notModifiedFields, the
+  // subset that RFC 9110 section 15.4.5 asks for.
+  RemapEchoVariant(std::unique_ptr<ContentFile> file, std::string_view data, std::string_view encoding, std::string etag,
+                   std::string fields, std::string_view notModifiedFields, TSHttpStatus status, const std::string &mimeType,
+                   bool rangeable)
+    : file{std::move(file)},
+      size{this->file ? this->file->size() : static_cast<int64_t>(data.size())},
+      encoding{encoding},
+      coding{encoding.empty() ? CODING_IDENTITY : static_cast<Coding>(MatchCoding(encoding.data(), encoding.size()))},
+      etag{std::move(etag)},
+      fields{std::move(fields)},
+      header{status, mimeType, size, (rangeable ? "Accept-Ranges: bytes\r\n" : "") + this->fields},
+      notModified{TS_HTTP_STATUS_NOT_MODIFIED, mimeType, RemapEchoHeaderTemplate::NO_BODY, notModifiedFields}
+  {
+    if (!this->file) {
+      iobuf  = TSIOBufferCreate();
+      reader = TSIOBufferReaderAlloc(iobuf);
+      TSIOBufferWrite(iobuf, data.data(), size);
+    }
+  }
+
+  ~RemapEchoVariant()
+  {
+    if (reader) {
+      TSIOBufferReaderFree(reader);
+      TSIOBufferDestroy(iobuf);
+    }
+  }
+
+  RemapEchoVariant(const RemapEchoVariant &)            = delete;
+  RemapEchoVariant &operator=(const RemapEchoVariant &) = delete;
+
+  // Whether the body has to be copied out in bounded chunks.
+  bool
+  streamed() const
+  {
+    return file != nullptr;
+  }
+
+  // Appends length bytes of the body starting at offset to out. Returns false
+  // if the file of a streamed body could not be read.
+  bool
+  copy(TSIOBuffer out, int64_t offset, int64_t length) const
+  {
+    if (file) {
+      return file->read(out, offset, length);
+    }
+    TSIOBufferCopy(out, reader, length, offset);
+    return true;
+  }
+
+  std::unique_ptr<ContentFile> file;
+  TSIOBuffer iobuf        = nullptr;
+  TSIOBufferReader reader = nullptr;
+  int64_t size;
+  std::string encoding; // Empty for the identity variant.
+  Coding coding;        // The coding of encoding, as Accept-Encoding names it.
+  std::string etag;     // A strong entity tag, including the quotes.
+  std::string fields;
+  RemapEchoHeaderTemplate header;
+  RemapEchoHeaderTemplate notModified;
+};
+
+// What a remap rule answers with.
+enum class RemapEchoMode {
+  Content,   // The content file.
+  Generator, // Synthetic bodies described by the request URL.
+  EchoText,  // The received request header, as text.
+  EchoJson,  // The received request header, as JSON.
+};
+
+// The content served by a remap rule, in all of its variants. The identity
+// variant comes first, followed by the encoded ones in order of preference.
+// The content is held by shared_ptr so that it outlives the config for
+// requests that are still in flight.
+struct RemapEchoContent {
+  RemapEchoContent(const std::string &mimeType, TSHttpStatus status) : mimeType{mimeType}, status{status} {}
+
+  RemapEchoContent(const RemapEchoContent &)            = delete;
+  RemapEchoContent &operator=(const RemapEchoContent &) = delete;
+
+  const RemapEchoVariant &
+  identity() const
+  {
+    return *variants.front();
+  }
+
+  // Ranges and conditional requests are only served for a 200 response, since
+  // any other configured status does not describe the selected representation.
+  bool
+  rangeable() const
+  {
+    return status == TS_HTTP_STATUS_OK;
+  }
+
+  std::string mimeType;
+  TSHttpStatus status;
+  time_t lastModified = 0; // The mtime of the content file.
+  std::vector<std::unique_ptr<const RemapEchoVariant>> variants;
+  // Size of the response IOBuffer blocks, large enough for a whole identity
+  // response when it is no bigger than 32K.
+  TSIOBufferSizeIndex writeSizeIndex = TS_IOBUFFER_SIZE_INDEX_32K;
+  // Separates the parts of multipart/byteranges responses.
+  std::string boundary = makeBoundary();
+  // In generator mode the identity variant holds a pattern block that
+  // generated bodies are cut from, instead of a whole body. Echo modes have
+  // no variants at all.
+  RemapEchoMode mode = RemapEchoMode::Content;
+
+private:
+  static std::string
+  makeBoundary()
+  {
+    std::random_device rd;
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%08x%08x", rd(), rd());
+    return buf;
+  }
+};
+
+// Content codings that may be served from precompressed siblings of the
+// content file, in order of preference.
+constexpr std::pair<std::string_view, std::string_view> PRECOMPRESSED_SUFFIXES[] = {
+  {"br",   ".br" },
+  {"zstd", ".zst"},
+  {"gzip", ".gz" },
+};
+
+// Returns a strong entity tag made from the 64-bit hash of a body.
+static std::string
+MakeEntityTag(uint64_t hash)
+{
+  char buf[19];
+  snprintf(buf, sizeof(buf), "\"%016" PRIx64 "\"", hash);
+  return buf;
+}
+
+// Opens the file at path into file when streamFile is set, or loads it into
+// data otherwise, and stores its mtime in mtime. Returns false if the file
+// cannot be read.
+static bool
+LoadRemapEchoBody(const std::string &path, bool streamFile, std::unique_ptr<ContentFile> &file, std::string &data, time_t &mtime)
+{
+  struct stat st;
+  if (stat(path.c_str(), &st) == -1) {
+    VERROR("cannot stat %s: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+  mtime = st.st_mtime;
+
+  if (streamFile) {
+    file = std::make_unique<ContentFile>();
+    if (!file->open(path)) {
+      VERROR("cannot open %s: %s", path.c_str(), strerror(errno));
+      return false;
+    }
+    return true;
+  }
+
+  std::ifstream ifstr;
+  ifstr.open(path.data());
+  if (!ifstr) {
+    VERROR("cannot open %s", path.c_str());
+    return false;
+  }
+  std::stringstream sstr;
+  sstr << ifstr.rdbuf();
+  data = sstr.str();
+  return true;
+}
+
+// Loads the content file at path, keeping it open when streamFile is set. With
+// precompressed, the ".br", ".zst" and ".gz" siblings of path that exist are
+// loaded as encoded variants, so compression is paid for once ahead of time
+// rather than per response. Each variant gets an ETag from a hash of its
+// bytes, or of its inode, size and mtime when it is streamed, so that a large
+// file is not read through on every load. Returns nullptr if a file cannot be
+// read.
+static std::shared_ptr<const RemapEchoContent>
+LoadRemapEchoContent(const std::string &path, const std::string &mimeType, TSHttpStatus status, bool streamFile, bool precompressed)
+{
+  struct Body {
+    std::string_view encoding;
+    std::unique_ptr<ContentFile> file;
+    std::string data;
+    time_t mtime = 0;
+  };
+  std::vector<Body> bodies(1);
+
+  if (!LoadRemapEchoBody(path, streamFile, bodies.front().file, bodies.front().data, bodies.front().mtime)) {
+    return nullptr;
+  }
+  if (precompressed) {
+    for (const auto &[encoding, suffix] : PRECOMPRESSED_SUFFIXES) {
+      std::string variantPath = path + std::string(suffix);
+      std::error_code ec;
+      if (!std::filesystem::is_regular_file(variantPath, ec)) {
+        continue;
+      }
+      Body &body    = bodies.emplace_back();
+      body.encoding = encoding;
+      if (!LoadRemapEchoBody(variantPath, streamFile, body.file, body.data, body.mtime)) {
+        return nullptr;
+      }
+      VDEBUG("loaded %.*s variant %s", static_cast<int>(encoding.size()), encoding.data(), variantPath.c_str());
+    }
+  }
+
+  auto content          = std::make_shared<RemapEchoContent>(mimeType, status);
+  content->lastModified = bodies.front().mtime;
+
+  char lastModified[HTTP_DATE_LEN + 1];
+  FormatHttpDate(content->lastModified, lastModified);
+
+  for (Body &body : bodies) {
+    // Ranges are served from the identity variant only, so only it says so.
+    bool rangeable   = content->rangeable() && body.encoding.empty();
+    std::string etag = MakeEntityTag(body.file ? body.file->identityHash() : Fnv1a(body.data));
+    std::string notModifiedFields;
+    if (bodies.size() > 1) {
+      notModifiedFields.append(TS_MIME_FIELD_VARY, TS_MIME_LEN_VARY).append(": Accept-Encoding\r\n");
+    }
+    notModifiedFields.append(TS_MIME_FIELD_ETAG, TS_MIME_LEN_ETAG).append(": ").append(etag).append("\r\n");
+    notModifiedFields.append(TS_MIME_FIELD_LAST_MODIFIED, TS_MIME_LEN_LAST_MODIFIED).append(": ").append(lastModified);
+    notModifiedFields.append("\r\n");
+
+    std::string fields;
+    if (!body.encoding.empty()) {
+      fields.append(TS_MIME_FIELD_CONTENT_ENCODING, TS_MIME_LEN_CONTENT_ENCODING).append(": ").append(body.encoding).append("\r\n");
+    }
+    fields.append(notModifiedFields);
+
+    content->variants.push_back(std::make_unique<const RemapEchoVariant>(std::move(body.file), body.data, body.encoding,
+                                                                         std::move(etag), std::move(fields), notModifiedFields,
+                                                                         status, mimeType, rangeable));
+  }
+
+  const RemapEchoVariant &identity = content->identity();
+  content->writeSizeIndex          = IOBufferSizeIndexFor(identity.header.text.size() + KEEP_ALIVE_TAIL.size() + identity.size);
+  return content;
+}
+
+// What stat() reports about a content file, compared between polls to notice
+// changes. A file that does not exist has a size of -1.
+struct FileStamp {
+  ino_t ino       = 0;
+  off_t size      = -1;
+  int64_t mtimeNs = 0;
+
+  bool operator==(const FileStamp &) const = default;
+};
+
+static FileStamp
+StatFileStamp(const std::string &path)
+{
+  FileStamp stamp;
+  struct stat st;
+
+  if (stat(path.c_str(), &st) == 0) {
+    stamp.ino     = st.st_ino;
+    stamp.size    = st.st_size;
+    stamp.mtimeNs = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+  }
+  return stamp;
+}
+
+// Size of the pattern block that generated bodies are cut from.
+constexpr int64_t GENERATOR_BLOCK_SIZE = 64 * 1024;
+
+// Returns the content for generator mode: a block filled once with a
+// repeating printable pattern, shared by every generated response. Requests
+// clone its blocks by reference, so they allocate no body memory of their own.
+static std::shared_ptr<const RemapEchoContent>
+MakeGeneratorContent(const std::string &mimeType)
+{
+  static constexpr std::string_view PATTERN = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ\n";
+  std::string block;
+
+  block.reserve(GENERATOR_BLOCK_SIZE);
+  while (static_cast<int64_t>(block.size()) < GENERATOR_BLOCK_SIZE) {
+    block.append(PATTERN.substr(0, GENERATOR_BLOCK_SIZE - block.size()));
+  }
+
+  auto content  = std::make_shared<RemapEchoContent>(mimeType, TS_HTTP_STATUS_OK);
+  content->mode = RemapEchoMode::Generator;
+  content->variants.push_back(
+    std::make_unique<const RemapEchoVariant>(nullptr, block, "", "", "", "", TS_HTTP_STATUS_OK, mimeType, false));
+  content->writeSizeIndex = TS_IOBUFFER_SIZE_INDEX_32K;
+  return content;
+}
+
+// Returns the content for an echo mode, whose responses are built from each
+// request instead.
+static std::shared_ptr<const RemapEchoContent>
+MakeEchoContent(RemapEchoMode mode)
+{
+  auto content            = std::make_shared<RemapEchoContent>(mode == RemapEchoMode::EchoJson ? "application/json" : "text/plain",
+                                                               TS_HTTP_STATUS_OK);
+  content->mode           = mode;
+  content->writeSizeIndex = TS_IOBUFFER_SIZE_INDEX_4K;
+  return content;
+}
+
+struct RemapEchoConfig {
+  // A config serving built-in content, such as generated bodies, instead of a
+  // content file.
+  explicit RemapEchoConfig(std::shared_ptr<const RemapEchoContent> builtin)
+    : content{builtin},
+      mimeType{builtin->mimeType},
+      statusCode{builtin->status},
+      streamFile{false},
+      precompressed{false}
+  {
+  }
+
+  explicit RemapEchoConfig(const std::string &contentPathStr, const std::string &mimeType, int statusCode, bool streamFile,
+                           bool precompressed)
+    : mimeType{mimeType}, statusCode{statusCode}, streamFile{streamFile}, precompressed{precompressed}
+  {
+    std::filesystem::path contentPath{contentPathStr};
+
+    if (!contentPath.is_absolute()) {
+      contentPath = std::filesystem::path(TSConfigDirGet()) / contentPath;
+    }
+    this->contentPath = std::filesystem::weakly_canonical(contentPath);
+
+    stamps  = contentStamps();
+    content = LoadRemapEchoContent(this->contentPath, mimeType, static_cast<TSHttpStatus>(statusCode), streamFile, precompressed);
+  }
+
+  ~RemapEchoConfig()
+  {
+    if (watch) {
+      // Wait for a poll that is already running, so that it does not touch
+      // the config after it is gone.
+      TSMutexLock(TSContMutexGet(watch));
+      TSActionCancel(watchAction);
+      TSMutexUnlock(TSContMutexGet(watch));
+      TSContDestroy(watch);
+    }
+    if (cont) {
+      TSContDestroy(cont);
+    }
+  }
+
+  // Poll the content files every intervalSec seconds and reload them when
+  // they change.
+  void
+  startWatching(int intervalSec)
+  {
+    watch = TSContCreate(RemapEchoContentWatch, TSMutexCreate());
+    TSContDataSet(watch, this);
+    watchAction = TSContScheduleEveryOnPool(watch, intervalSec * 1000, TS_THREAD_POOL_TASK);
+  }
+
+  // Reload the content if any of its files changed since the last load. The
+  // new snapshot replaces the current one atomically. Requests in flight keep
+  // the snapshot they started with, and it is freed when the last of them
+  // finishes. If loading fails, the current content stays in place until the
+  // files change again.
+  //
+  // A snapshot of streamed files holds them open, so it stays intact when a
+  // file is replaced by renaming a new one over it. A file rewritten in place
+  // changes under the snapshot too, which is reported since responses in
+  // flight may then mix old and new bytes or end early.
+  void
+  reloadIfChanged()
+  {
+    std::vector<FileStamp> current = contentStamps();
+    if (current == stamps) {
+      return;
+    }
+    if (streamFile) {
+      for (size_t i = 0; i < current.size(); ++i) {
+        if (current[i] != stamps[i] && current[i].size >= 0 && current[i].ino == stamps[i].ino) {
+          std::string path = i == 0 ? contentPath : contentPath + std::string(PRECOMPRESSED_SUFFIXES[i - 1].second);
+          VERROR("%s was modified in place; replace it by renaming a new file over it instead", path.c_str());
+        }
+      }
+    }
+    stamps = std::move(current);
+
+    auto snapshot = LoadRemapEchoContent(contentPath, mimeType, static_cast<TSHttpStatus>(statusCode), streamFile, precompressed);
+    if (snapshot == nullptr) {
+      VERROR("keeping the previous content of %s", contentPath.c_str());
+      return;
+    }
+    VDEBUG("reloaded %s", contentPath.c_str());
+    content.store(std::move(snapshot));
+  }
+
+  std::atomic<std::shared_ptr<const RemapEchoContent>> content;
+  std::string contentPath;
+  std::string mimeType;
+  int statusCode;
+  bool streamFile;
+  bool precompressed;
+
+  TSCont cont          = nullptr;
+  TSCont watch         = nullptr;
+  TSAction watchAction = nullptr;
+
+private:
+  // Stamps of the content file and of each precompressed sibling it may have.
+  std::vector<FileStamp>
+  contentStamps() const
+  {
+    std::vector<FileStamp> result{StatFileStamp(contentPath)};
+    if (precompressed) {
+      for (const auto &[encoding, suffix] : PRECOMPRESSED_SUFFIXES) {
+        result.push_back(StatFileStamp(contentPath + std::string(suffix)));
+      }
+    }
+    return result;
+  }
+
+  std::vector<FileStamp> stamps; // Only used by the constructor and the watch task.
+};
+
+struct RemapEchoRequest;
+
+union argument_type {
+  void *ptr;
+  intptr_t ecode;
+  TSVConn vc;
+  TSVIO vio;
+  TSHttpTxn txn;
+  RemapEchoRequest *trq;
+
+  argument_type(void *_p) : ptr(_p) {}
+};
+
+// This structure represents the state of a streaming I/O request. It
+// is directional (ie. either a read or a write). We need two of these
+// for each TSVConn; one to push data into the TSVConn and one to pull
+// data out.
+struct IOChannel {
+  TSVIO vio = nullptr;
+  TSIOBuffer iobuf;
+  TSIOBufferReader reader;
+
+  explicit IOChannel(TSIOBufferSizeIndex index) : iobuf(TSIOBufferSizedCreate(index)), reader(TSIOBufferReaderAlloc(iobuf)) {}
+  ~IOChannel()
+  {
+    if (this->reader) {
+      TSIOBufferReaderFree(this->reader);
+    }
+
+    if (this->iobuf) {
+      TSIOBufferDestroy(this->iobuf);
+    }
+  }
+
+  void
+  read(TSVConn vc, TSCont contp)
+  {
+    this->vio = TSVConnRead(vc, contp, this->iobuf, INT64_MAX);
+  }
+
+  void
+  write(TSVConn vc, TSCont contp)
+  {
+    this->vio = TSVConnWrite(vc, contp, this->reader, INT64_MAX);
+  }
+
+  // Drop any buffered data so that the channel can serve another VC.
+  void
+  reset()
+  {
+    TSIOBufferReaderConsume(this->reader, TSIOBufferReaderAvail(this->reader));
+    this->vio = nullptr;
+  }
+};
+
+struct RemapEchoHttpHeader {
+  TSMBuffer buffer;
+  TSMLoc header;
+  TSHttpParser parser;
+
+  RemapEchoHttpHeader()
+  {
+    this->buffer = TSMBufferCreate();
+    this->header = TSHttpHdrCreate(this->buffer);
+    this->parser = TSHttpParserCreate();
+  }
+
+  ~RemapEchoHttpHeader()
+  {
+    if (this->parser) {
+      TSHttpParserDestroy(this->parser);
+    }
+
+    this->destroy();
+  }
+
+  // Get ready to parse the next request on the same connection. The header is
+  // recreated in the same marshal buffer. The space of a destroyed header is
+  // not reclaimed, so the buffer itself is only replaced once every
+  // MAX_HEADERS_PER_BUFFER requests, which bounds its growth on long-lived
+  // connections.
+  void
+  reset()
+  {
+    if (++this->headers < MAX_HEADERS_PER_BUFFER) {
+      TSHttpHdrDestroy(this->buffer, this->header);
+      TSHandleMLocRelease(this->buffer, TS_NULL_MLOC, this->header);
+      this->header = TSHttpHdrCreate(this->buffer);
+    } else {
+      this->destroy();
+      this->buffer  = TSMBufferCreate();
+      this->header  = TSHttpHdrCreate(this->buffer);
+      this->headers = 0;
+    }
+    TSHttpParserClear(this->parser);
+  }
+
+private:
+  static constexpr int MAX_HEADERS_PER_BUFFER = 64;
+
+  int headers = 0; // Headers recreated in the current buffer.
+
+  void
+  destroy()
+  {
+    TSHttpHdrDestroy(this->buffer, this->header);
+    TSHandleMLocRelease(this->buffer, TS_NULL_MLOC, this->header);
+    TSMBufferDestroy(this->buffer);
+  }
+};
+
+// Transaction milestones reported by the echo modes. Points in time are
+// reported in nanoseconds since UA_BEGIN, and durations as they are. "remap"
+// is when the intercept was set up, and "respond" when the echo was written.
+struct EchoMilestone {
+  const char *name;
+  TSMilestonesType type; // TS_MILESTONE_NULL for the ones taken by the plugin.
+  bool duration;
+};
+
+constexpr EchoMilestone ECHO_MILESTONES[] = {
+  {"ua_begin",            TS_MILESTONE_UA_BEGIN,            false},
+  {"ua_first_read",       TS_MILESTONE_UA_FIRST_READ,       false},
+  {"ua_read_header_done", TS_MILESTONE_UA_READ_HEADER_DONE, false},
+  {"tls_handshake_start", TS_MILESTONE_TLS_HANDSHAKE_START, false},
+  {"tls_handshake_end",   TS_MILESTONE_TLS_HANDSHAKE_END,   false},
+  {"sm_start",            TS_MILESTONE_SM_START,            false},
+  {"remap",               TS_MILESTONE_NULL,                false},
+  {"respond",             TS_MILESTONE_NULL,                false},
+  {"plugin_active",       TS_MILESTONE_PLUGIN_ACTIVE,       true },
+  {"plugin_total",        TS_MILESTONE_PLUGIN_TOTAL,        true },
+};
+
+constexpr size_t N_ECHO_MILESTONES     = std::size(ECHO_MILESTONES);
+constexpr size_t ECHO_MILESTONE_REMAP   = 6;
+constexpr size_t ECHO_MILESTONE_RESPOND = 7;
+
+// The state of one server intercept connection. Requests on it are parsed and
+// answered one after another, so pipelined and keep-alive requests reuse the
+// continuation, the IO channels and the parser.
+//
+// Requests are recycled through RemapEchoRequestPool, so everything created
+// here, including the continuation and its mutex, outlives a single
+// connection. Per-connection state is cleared by reset().
+struct RemapEchoRequest {
+  explicit RemapEchoRequest(TSIOBufferSizeIndex writeSizeIndex)
+    : readio{TS_IOBUFFER_SIZE_INDEX_4K}, writeio{writeSizeIndex}, cont{TSContCreate(RemapEchoInterceptHook, TSMutexCreate())}
+  {
+    TSContDataSet(this->cont, this);
+  }
+
+  ~RemapEchoRequest() { TSContDestroy(this->cont); }
+
+  RemapEchoRequest(const RemapEchoRequest &)            = delete;
+  RemapEchoRequest &operator=(const RemapEchoRequest &) = delete;
+
+  void
+  reset()
+  {
+    this->vc         = nullptr;
+    this->writing    = false;
+    this->keepAlive  = true;
+    this->readClosed = false;
+    this->unreadBody = 0;
+    this->readio.reset();
+    this->writeio.reset();
+    this->rqheader.reset();
+    this->content.reset();
+    this->variant = nullptr;
+    this->clearBody();
+    this->gen = {};
+    this->milestones.fill(0);
+  }
+
+  // A piece of the response body: either a byte range of the content, or a
+  // slice of parts holding multipart/byteranges delimiters.
+  struct BodyPiece {
+    bool literal;
+    int64_t offset;
+    int64_t length;
+  };
+
+  void
+  clearBody()
+  {
+    this->parts.clear();
+    this->pieces.clear();
+    this->pieceIndex = 0;
+    this->pieceDone  = 0;
+  }
+
+  TSVConn vc         = nullptr;
+  bool writing       = false; // A response is being written.
+  bool keepAlive     = true;  // Keep reading requests after the current response.
+  bool readClosed    = false; // The client will not send more requests.
+  int64_t unreadBody = 0;     // Request body bytes to skip before the next request.
+  IOChannel readio;
+  IOChannel writeio;
+  RemapEchoHttpHeader rqheader;
+  TSCont cont;
+
+  std::shared_ptr<const RemapEchoContent> content;
+  const RemapEchoVariant *variant = nullptr;
+
+  // The body of the current response and how much of it has been queued.
+  std::string parts;
+  std::vector<BodyPiece> pieces;
+  size_t pieceIndex = 0;
+  int64_t pieceDone = 0;
+
+  // The body still to be generated for the current response in generator
+  // mode.
+  struct Generated {
+    int64_t remaining = 0; // Body bytes not queued yet.
+    int64_t chunk     = 0; // Bytes per chunk, before each delay.
+    int64_t delayMs   = 0; // Pause after each chunk.
+    bool chunked      = false;
+    TSAction timer    = nullptr; // Pending wake-up after a delay.
+  } gen;
+
+  // Transaction milestones captured at remap time for the echo modes, indexed
+  // like ECHO_MILESTONES.
+  std::array<TSHRTime, N_ECHO_MILESTONES> milestones{};
+};
+
+// Per-thread free lists of idle requests, one for each write buffer size. A
+// request goes back to the list of the thread its connection ended on, and
+// each list is capped so that a burst of connections does not pin memory
+// forever. Requests still idle when a thread exits are not reclaimed.
+class RemapEchoRequestPool
+{
+public:
+  static RemapEchoRequest *
+  acquire(TSIOBufferSizeIndex writeSizeIndex)
+  {
+    std::vector<RemapEchoRequest *> &idle = freeLists[writeSizeIndex];
+
+    if (idle.empty()) {
+      TSStatIntIncrement(StatCountPoolMisses, 1);
+      return new RemapEchoRequest(writeSizeIndex);
+    }
+
+    TSStatIntIncrement(StatCountPoolHits, 1);
+    RemapEchoRequest *trq = idle.back();
+    idle.pop_back();
+    return trq;
+  }
+
+  static void
+  release(RemapEchoRequest *trq, TSIOBufferSizeIndex writeSizeIndex)
+  {
+    std::vector<RemapEchoRequest *> &idle = freeLists[writeSizeIndex];
+
+    if (idle.size() >= MAX_IDLE_PER_LIST) {
+      delete trq;
+      return;
+    }
+
+    trq->reset();
+    idle.push_back(trq);
+  }
+
+private:
+  static constexpr size_t MAX_IDLE_PER_LIST = 64;
+
+  static thread_local std::array<std::vector<RemapEchoRequest *>, TS_IOBUFFER_SIZE_INDEX_32K + 1> freeLists;
+};
+
+thread_local std::array<std::vector<RemapEchoRequest *>, TS_IOBUFFER_SIZE_INDEX_32K + 1> RemapEchoRequestPool::freeLists;
+
+// Close the connection of a RemapEchoRequest and return it to the pool.
+static void
+RemapEchoRequestDestroy(RemapEchoRequest *trq)
+{
+  if (trq->gen.timer) {
+    TSActionCancel(trq->gen.timer);
+  }
+  if (trq->vc) {
+    TSVConnClose(trq->vc);
+  }
+
+  RemapEchoRequestPool::release(trq, trq->content->writeSizeIndex);
+}
+
+// Whether the connection can stay open after answering the parsed request:
+// HTTP/1.1 unless the client sent "Connection: close", HTTP/1.0 only if it
+// sent "Connection: keep-alive".
+static bool
+RequestAllowsKeepAlive(const RemapEchoHttpHeader &rq)
+{
+  bool keepAlive = TSHttpHdrVersionGet(rq.buffer, rq.header) >= TS_HTTP_VERSION(1, 1);
+  TSMLoc field   = TSMimeHdrFieldFind(rq.buffer, rq.header, TS_MIME_FIELD_CONNECTION, TS_MIME_LEN_CONNECTION);
+
+  if (field != TS_NULL_MLOC) {
+    int count = TSMimeHdrFieldValuesCount(rq.buffer, rq.header, field);
+    for (int i = 0; i < count; ++i) {
+      int len           = 0;
+      const char *value = TSMimeHdrFieldValueStringGet(rq.buffer, rq.header, field, i, &len);
+      if (len == 5 && strncasecmp(value, "close", len) == 0) {
+        keepAlive = false;
+      } else if (len == 10 && strncasecmp(value, "keep-alive", len) == 0) {
+        keepAlive = true;
+      }
+    }
+    TSHandleMLocRelease(rq.buffer, rq.header, field);
+  }
+  return keepAlive;
+}
+
+// How many body bytes follow the parsed request header: its Content-Length, or
+// 0 without one. Returns -1 for a body that cannot be skipped without decoding
+// it, such as a chunked one, or whose length is missing or invalid.
+static int64_t
+RequestBodyLength(const RemapEchoHttpHeader &rq)
+{
+  TSMLoc field = TSMimeHdrFieldFind(rq.buffer, rq.header, TS_MIME_FIELD_TRANSFER_ENCODING, TS_MIME_LEN_TRANSFER_ENCODING);
+  if (field != TS_NULL_MLOC) {
+    TSHandleMLocRelease(rq.buffer, rq.header, field);
+    return -1;
+  }
+
+  field = TSMimeHdrFieldFind(rq.buffer, rq.header, TS_MIME_FIELD_CONTENT_LENGTH, TS_MIME_LEN_CONTENT_LENGTH);
+  if (field == TS_NULL_MLOC) {
+    return 0;
+  }
+
+  int64_t length    = -1;
+  int len           = 0;
+  const char *value = TSMimeHdrFieldValueStringGet(rq.buffer, rq.header, field, -1, &len);
+  TSMLoc dup        = TSMimeHdrFieldNextDup(rq.buffer, rq.header, field);
+  if (dup != TS_NULL_MLOC) {
+    // Several Content-Length fields leave the framing in doubt.
+    TSHandleMLocRelease(rq.buffer, rq.header, dup);
+  } else if (value && len > 0) {
+    auto [ptr, ec] = std::from_chars(value, value + len, length);
+    if (ec != std::errc{} || ptr != value + len || length < 0) {
+      length = -1;
+    }
+  }
+  TSHandleMLocRelease(rq.buffer, rq.header, field);
+  return length;
+}
+
+static bool
+IsHeadRequest(const RemapEchoHttpHeader &rq)
+{
+  int methodLen = 0;
+  return TSHttpHdrMethodGet(rq.buffer, rq.header, &methodLen) == TS_HTTP_METHOD_HEAD;
+}
+
+// Strips optional whitespace (spaces and tabs) from both ends of sv.
+static std::string_view
+TrimOws(std::string_view sv)
+{
+  while (!sv.empty() && (sv.front() == ' ' || sv.front() == '\t')) {
+    sv.remove_prefix(1);
+  }
+  while (!sv.empty() && (sv.back() == ' ' || sv.back() == '\t')) {
+    sv.remove_suffix(1);
+  }
+  return sv;
+}
+
+struct ByteRange {
+  int64_t first;
+  int64_t last;
+};
+
+enum class RangeResult { Ignore, Unsatisfiable, Satisfiable };
+
+// Ranges beyond this count are not worth the multipart overhead, and the full
+// body is sent instead.
+constexpr size_t MAX_BYTE_RANGES = 64;
+
+// Parses a Range field value for a body of size bytes, as described in RFC
+// 9110 section 14.1.2. Ranges starting past the end are dropped, and the rest
+// are clamped to the body. Values that do not parse are ignored, in which
+// case the full body is sent.
+static RangeResult
+ParseByteRanges(std::string_view value, int64_t size, std::vector<ByteRange> &ranges)
+{
+  auto parseNumber = [](std::string_view sv, int64_t &n) {
+    if (sv.empty() || sv.front() < '0' || sv.front() > '9') {
+      return false;
+    }
+    auto [ptr, ec] = std::from_chars(sv.data(), sv.data() + sv.size(), n);
+    return ec == std::errc{} && ptr == sv.data() + sv.size();
+  };
+
+  value = TrimOws(value);
+  if (value.size() < 6 || strncasecmp(value.data(), "bytes=", 6) != 0) {
+    return RangeResult::Ignore;
+  }
+  value.remove_prefix(6);
+
+  ranges.clear();
+  bool any = false;
+  while (!value.empty()) {
+    size_t comma          = value.find(',');
+    std::string_view spec = TrimOws(value.substr(0, comma));
+    value.remove_prefix(comma == std::string_view::npos ? value.size() : comma + 1);
+    if (spec.empty()) {
+      continue;
+    }
+
+    size_t dash = spec.find('-');
+    if (dash == std::string_view::npos) {
+      return RangeResult::Ignore;
+    }
+    any = true;
+
+    int64_t first = 0;
+    int64_t last  = 0;
+    if (dash == 0) {
+      // A suffix range, "-N", selects the last N bytes.
+      if (!parseNumber(spec.substr(1), last)) {
+        return RangeResult::Ignore;
+      }
+      if (last == 0 || size == 0) {
+        continue;
+      }
+      first = std::max<int64_t>(0, size - last);
+      last  = size - 1;
+    } else {
+      if (!parseNumber(spec.substr(0, dash), first)) {
+        return RangeResult::Ignore;
+      }
+      if (dash + 1 == spec.size()) {
+        last = size - 1;
+      } else if (!parseNumber(spec.substr(dash + 1), last) || last < first) {
+        return RangeResult::Ignore;
+      }
+      if (first >= size) {
+        continue;
+      }
+      last = std::min(last, size - 1);
+    }
+
+    if (ranges.size() == MAX_BYTE_RANGES) {
+      return RangeResult::Ignore;
+    }
+    ranges.push_back({first, last});
+  }
+
+  if (!any) {
+    return RangeResult::Ignore;
+  }
+  return ranges.empty() ? RangeResult::Unsatisfiable : RangeResult::Satisfiable;
+}
+
+// Whether an If-Range field, if any, still matches the identity variant. An
+// entity tag must match the ETag exactly and a date must equal Last-Modified.
+static bool
+IfRangeMatches(const RemapEchoContent &content, const RemapEchoHttpHeader &rq)
+{
+  TSMLoc field = TSMimeHdrFieldFind(rq.buffer, rq.header, TS_MIME_FIELD_IF_RANGE, TS_MIME_LEN_IF_RANGE);
+  if (field == TS_NULL_MLOC) {
+    return true;
+  }
+
+  int len                  = 0;
+  const char *value        = TSMimeHdrFieldValueStringGet(rq.buffer, rq.header, field, -1, &len);
+  std::string_view ifRange = TrimOws({value, static_cast<size_t>(len)});
+  bool matches             = false;
+  if (ifRange.starts_with('"')) {
+    matches = ifRange == content.identity().etag;
+  } else if (!ifRange.starts_with("W/")) {
+    matches = TSMimeHdrFieldValueDateGet(rq.buffer, rq.header, field) == content.lastModified;
+  }
+  TSHandleMLocRelease(rq.buffer, rq.header, field);
+  return matches;
+}
+
+// Returns the ranges of the identity variant that a GET request asked for.
+static RangeResult
+RequestedByteRanges(const RemapEchoContent &content, const RemapEchoHttpHeader &rq, std::vector<ByteRange> &ranges)
+{
+  int methodLen      = 0;
+  const char *method = TSHttpHdrMethodGet(rq.buffer, rq.header, &methodLen);
+  if (method != TS_HTTP_METHOD_GET) {
+    return RangeResult::Ignore;
+  }
+
+  TSMLoc field = TSMimeHdrFieldFind(rq.buffer, rq.header, TS_MIME_FIELD_RANGE, TS_MIME_LEN_RANGE);
+  if (field == TS_NULL_MLOC) {
+    return RangeResult::Ignore;
+  }
+  if (!IfRangeMatches(content, rq)) {
+    TSHandleMLocRelease(rq.buffer, rq.header, field);
+    return RangeResult::Ignore;
+  }
+
+  int len            = 0;
+  const char *value  = TSMimeHdrFieldValueStringGet(rq.buffer, rq.header, field, -1, &len);
+  RangeResult result = ParseByteRanges({value, static_cast<size_t>(len)}, content.identity().size, ranges);
+  TSHandleMLocRelease(rq.buffer, rq.header, field);
+  return result;
+}
+
+static std::string
+ContentRangeValue(const ByteRange &range, int64_t size)
+{
+  return "bytes " + std::to_string(range.first) + "-" + std::to_string(range.last) + "/" + std::to_string(size);
+}
+
+// Picks the variant to send for the request's Accept-Encoding. Among the
+// encoded variants, the one with the highest quality wins, ties going to the
+// more preferred coding. It is sent unless the client ranks identity above
+// it. Identity stays acceptable unless it is excluded explicitly.
+static const RemapEchoVariant &
+SelectVariant(const RemapEchoContent &content, const RemapEchoHttpHeader &rq)
+{
+  if (content.variants.size() == 1) {
+    return content.identity();
+  }
+
+  AcceptedCodings accepted;
+  TSMLoc field = TSMimeHdrFieldFind(rq.buffer, rq.header, TS_MIME_FIELD_ACCEPT_ENCODING, TS_MIME_LEN_ACCEPT_ENCODING);
+  if (field == TS_NULL_MLOC) {
+    return content.identity();
+  }
+  while (field != TS_NULL_MLOC) {
+    int len           = 0;
+    const char *value = TSMimeHdrFieldValueStringGet(rq.buffer, rq.header, field, -1, &len);
+    ScanAcceptEncoding(value, value + len, accepted);
+
+    TSMLoc next = TSMimeHdrFieldNextDup(rq.buffer, rq.header, field);
+    TSHandleMLocRelease(rq.buffer, rq.header, field);
+    field = next;
+  }
+
+  const RemapEchoVariant *best = &content.identity();
+  int bestQuality              = 0;
+  for (size_t i = 1; i < content.variants.size(); ++i) {
+    const RemapEchoVariant &variant = *content.variants[i];
+    int quality                     = accepted.qualityOf(variant.coding);
+    if (quality > bestQuality) {
+      best        = &variant;
+      bestQuality = quality;
+    }
+  }
+
+  // Only an explicit quality for identity, or one given by "*", can rank it
+  // above an encoded variant the client asked for.
+  int identityQuality = accepted.quality[CODING_IDENTITY] >= 0 ? accepted.quality[CODING_IDENTITY] : accepted.wildcard;
+  if (bestQuality > 0 && bestQuality >= identityQuality) {
+    return *best;
+  }
+  return content.identity();
+}
+
+// Whether an If-None-Match value lists etag or "*". Entity tags are compared
+// weakly, as RFC 9110 section 13.1.2 requires, so a "W/" prefix is ignored.
+static bool
+IfNoneMatchMatches(std::string_view value, std::string_view etag)
+{
+  while (true) {
+    while (!value.empty() && (value.front() == ',' || value.front() == ' ' || value.front() == '\t')) {
+      value.remove_prefix(1);
+    }
+    if (value.empty()) {
+      return false;
+    }
+    if (value.front() == '*') {
+      return true;
+    }
+    if (value.starts_with("W/")) {
+      value.remove_prefix(2);
+    }
+    if (!value.starts_with('"')) {
+      return false;
+    }
+
+    size_t end = value.find('"', 1);
+    if (end == std::string_view::npos) {
+      return false;
+    }
+    if (value.substr(0, end + 1) == etag) {
+      return true;
+    }
+    value.remove_prefix(end + 1);
+  }
+}
+
+// Evaluates If-None-Match, or If-Modified-Since when there is none, for a GET
+// or HEAD request. Returns true if the client's copy of variant is current.
+static bool
+IsNotModified(const RemapEchoContent &content, const RemapEchoVariant &variant, const RemapEchoHttpHeader &rq)
+{
+  int methodLen      = 0;
+  const char *method = TSHttpHdrMethodGet(rq.buffer, rq.header, &methodLen);
+  if (method != TS_HTTP_METHOD_GET && method != TS_HTTP_METHOD_HEAD) {
+    return false;
+  }
+
+  TSMLoc field = TSMimeHdrFieldFind(rq.buffer, rq.header, TS_MIME_FIELD_IF_NONE_MATCH, TS_MIME_LEN_IF_NONE_MATCH);
+  if (field != TS_NULL_MLOC) {
+    bool matches = false;
+    while (field != TS_NULL_MLOC && !matches) {
+      int len           = 0;
+      const char *value = TSMimeHdrFieldValueStringGet(rq.buffer, rq.header, field, -1, &len);
+      matches           = IfNoneMatchMatches({value, static_cast<size_t>(len)}, variant.etag);
+
+      TSMLoc next = TSMimeHdrFieldNextDup(rq.buffer, rq.header, field);
+      TSHandleMLocRelease(rq.buffer, rq.header, field);
+      field = next;
+    }
+    if (field != TS_NULL_MLOC) {
+      TSHandleMLocRelease(rq.buffer, rq.header, field);
+    }
+    return matches;
+  }
+
+  field = TSMimeHdrFieldFind(rq.buffer, rq.header, TS_MIME_FIELD_IF_MODIFIED_SINCE, TS_MIME_LEN_IF_MODIFIED_SINCE);
+  if (field == TS_NULL_MLOC) {
+    return false;
+  }
+  time_t since = TSMimeHdrFieldValueDateGet(rq.buffer, rq.header, field);
+  TSHandleMLocRelease(rq.buffer, rq.header, field);
+  return since > 0 && content.lastModified <= since;
+}
+
+// Fills in the body pieces of a 206 response for ranges of the identity
+// variant and returns its header.
+static RemapEchoHeaderTemplate
+PreparePartialResponse(RemapEchoRequest *trq, const std::vector<ByteRange> &ranges)
+{
+  const RemapEchoContent &content  = *trq->content;
+  const RemapEchoVariant &identity = content.identity();
+
+  if (ranges.size() == 1) {
+    const ByteRange &range = ranges.front();
+    int64_t length         = range.last - range.first + 1;
+
+    trq->pieces.push_back({false, range.first, length});
+    return {TS_HTTP_STATUS_PARTIAL_CONTENT, content.mimeType, length,
+            identity.fields + "Content-Range: " + ContentRangeValue(range, identity.size) + "\r\n"};
+  }
+
+  int64_t length = 0;
+  for (const ByteRange &range : ranges) {
+    size_t offset = trq->parts.size();
+    trq->parts.append("\r\n--").append(content.boundary).append("\r\n");
+    trq->parts.append("Content-Type: ").append(content.mimeType).append("\r\n");
+    trq->parts.append("Content-Range: ").append(ContentRangeValue(range, identity.size)).append("\r\n\r\n");
+    trq->pieces.push_back({true, static_cast<int64_t>(offset), static_cast<int64_t>(trq->parts.size() - offset)});
+    trq->pieces.push_back({false, range.first, range.last - range.first + 1});
+    length += trq->pieces[trq->pieces.size() - 2].length + trq->pieces.back().length;
+  }
+  size_t offset = trq->parts.size();
+  trq->parts.append("\r\n--").append(content.boundary).append("--\r\n");
+  trq->pieces.push_back({true, static_cast<int64_t>(offset), static_cast<int64_t>(trq->parts.size() - offset)});
+  length += trq->pieces.back().length;
+
+  return {TS_HTTP_STATUS_PARTIAL_CONTENT, "multipart/byteranges; boundary=" + content.boundary, length, identity.fields};
+}
+
+// Upper bound on the body bytes buffered for a streamed response. More is
+// queued on each WRITE_READY, so memory use does not grow with the body size.
+constexpr int64_t STREAM_HIGH_WATER = 4 * 32 * 1024;
 
-#define VDEBUG(fmt, ...) Dbg(dbg_ctl, fmt, ##__VA_ARGS__)
+// Queue as much of the remaining response body as the write buffer may hold.
+// Returns false if the content file could not be read, leaving the response
+// unfinished.
+static bool
+StreamBody(RemapEchoRequest *trq)
+{
+  const RemapEchoVariant &variant = *trq->variant;
+  int64_t room = variant.streamed() ? STREAM_HIGH_WATER - TSIOBufferReaderAvail(trq->writeio.reader) : INT64_MAX;
+
+  while (room > 0 && trq->pieceIndex < trq->pieces.size()) {
+    const RemapEchoRequest::BodyPiece &piece = trq->pieces[trq->pieceIndex];
+    int64_t n                                = std::min(room, piece.length - trq->pieceDone);
+
+    if (piece.literal) {
+      TSIOBufferWrite(trq->writeio.iobuf, trq->parts.data() + piece.offset + trq->pieceDone, n);
+    } else if (!variant.copy(trq->writeio.iobuf, piece.offset + trq->pieceDone, n)) {
+      VERROR("content file for trq=%p is unreadable or was truncated", trq);
+      return false;
+    }
 
-#if DEBUG
-#define VERROR(fmt, ...) Dbg(dbg_ctl, fmt, ##__VA_ARGS__)
-#else
-#define VERROR(fmt, ...) TSError("[%s] %s: " fmt, PLUGIN, __FUNCTION__, ##__VA_ARGS__)
-#endif
+    room           -= n;
+    trq->pieceDone += n;
+    if (trq->pieceDone == piece.length) {
+      ++trq->pieceIndex;
+      trq->pieceDone = 0;
+    }
+  }
+  return true;
+}
 
-#define VIODEBUG(vio, fmt, ...)                                                                                              \
-  VDEBUG("vio=%p vio.cont=%p, vio.cont.data=%p, vio.vc=%p " fmt, (vio), TSVIOContGet(vio), TSContDataGet(TSVIOContGet(vio)), \
-         TSVIOVConnGet(vio), ##__VA_ARGS__)
+// Parameters of a generated response, taken from the request URL.
+struct GeneratorParams {
+  TSHttpStatus status = TS_HTTP_STATUS_OK;
+  int64_t size        = 0;
+  int64_t chunk       = 16 * 1024;
+  int64_t delayMs     = 0;
+  bool chunked        = false;
+};
 
-static int StatCountBytes     = -1;
-static int StatCountResponses = -1;
+// Limits on generator parameters, so that a typo cannot tie up a connection
+// for hours. The size limit also keeps the header plus the chunked body
+// length, at up to 7 bytes per body byte, far from overflowing.
+constexpr int64_t GENERATOR_MAX_SIZE     = int64_t{1} << 40; // 1 TiB
+constexpr int64_t GENERATOR_MAX_CHUNK    = 16 * 1024 * 1024;
+constexpr int64_t GENERATOR_MAX_DELAY_MS = 60 * 1000;
+
+// Parses a generator request. The last path segment is the body size, and the
+// query may set chunk=<bytes>, delay=<ms>, status=<code> and
+// framing=length|chunked, e.g. "/gen/1048576?chunk=16384&delay=10". Returns
+// false if any of them is malformed or out of range.
+static bool
+ParseGeneratorParams(std::string_view path, std::string_view query, GeneratorParams &params)
+{
+  auto parseNumber = [](std::string_view sv, int64_t &n, int64_t min, int64_t max) {
+    auto [ptr, ec] = std::from_chars(sv.data(), sv.data() + sv.size(), n);
+    return !sv.empty() && ec == std::errc{} && ptr == sv.data() + sv.size() && n >= min && n <= max;
+  };
 
-static int RemapEchoInterceptHook(TSCont contp, TSEvent event, void *edata);
-static int RemapEchoTxnHook(TSCont contp, TSEvent event, void *edata);
+  while (path.ends_with('/')) {
+    path.remove_suffix(1);
+  }
+  size_t slash = path.rfind('/');
+  if (!parseNumber(slash == std::string_view::npos ? path : path.substr(slash + 1), params.size, 0, GENERATOR_MAX_SIZE)) {
+    return false;
+  }
 
-struct RemapEchoConfig {
-  explicit RemapEchoConfig(const std::string &contentPathStr, const std::string &mimeType, int statusCode)
-    : mimeType{mimeType}, statusCode{statusCode}
-  {
-    std::filesystem::path contentPath{contentPathStr};
+  while (!query.empty()) {
+    size_t amp            = query.find('&');
+    std::string_view pair = query.substr(0, amp);
+    query.remove_prefix(amp == std::string_view::npos ? query.size() : amp + 1);
 
-    if (!contentPath.is_absolute()) {
-      contentPath = std::filesystem::path(TSConfigDirGet()) / contentPath;
-    }
-    contentPath = std::filesystem::weakly_canonical(contentPath);
+    size_t eq              = pair.find('=');
+    std::string_view key   = pair.substr(0, eq);
+    std::string_view value = eq == std::string_view::npos ? std::string_view{} : pair.substr(eq + 1);
+    int64_t n              = 0;
 
-    std::string cookedPathStr = contentPath;
-    std::ifstream ifstr;
-    ifstr.open(cookedPathStr.data());
-    std::stringstream sstr;
-    sstr << ifstr.rdbuf();
-    content = sstr.str();
+    if (key == "chunk") {
+      if (!parseNumber(value, params.chunk, 1, GENERATOR_MAX_CHUNK)) {
+        return false;
+      }
+    } else if (key == "delay") {
+      if (!parseNumber(value, params.delayMs, 0, GENERATOR_MAX_DELAY_MS)) {
+        return false;
+      }
+    } else if (key == "status") {
+      // Statuses without a body would contradict the requested size.
+      if (!parseNumber(value, n, 200, 599) || n == TS_HTTP_STATUS_NO_CONTENT || n == TS_HTTP_STATUS_NOT_MODIFIED) {
+        return false;
+      }
+      params.status = static_cast<TSHttpStatus>(n);
+    } else if (key == "framing") {
+      if (value != "length" && value != "chunked") {
+        return false;
+      }
+      params.chunked = value == "chunked";
+    }
   }
+  return true;
+}
 
-  ~RemapEchoConfig() { TSContDestroy(cont); }
-
-  std::string content;
-  std::string mimeType;
-  int statusCode;
+// Returns the number of bytes chunked framing adds to a body of size bytes
+// sent in chunks of chunk bytes, including the last chunk.
+static int64_t
+ChunkedOverhead(int64_t size, int64_t chunk)
+{
+  auto chunkOverhead = [](int64_t n) {
+    int digits = 1;
+    while (n >>= 4) {
+      ++digits;
+    }
+    return digits + 4; // The size line's CRLF and the one after the data.
+  };
 
-  TSCont cont = nullptr;
-};
+  int64_t full     = size / chunk;
+  int64_t overhead = full * chunkOverhead(chunk) + 5; // "0\r\n\r\n"
+  if (size % chunk) {
+    overhead += chunkOverhead(size % chunk);
+  }
+  return overhead;
+}
 
-struct RemapEchoRequest;
+// Writes the header of a response built per request, such as a generated one,
+// without allocating, and returns its length. A chunked response has no
+// Content-Length.
+static int64_t
+WriteSimpleHeader(TSIOBuffer iobuf, TSHttpStatus status, std::string_view mimeType, bool chunked, int64_t size,
+                  std::string_view tail)
+{
+  const char *reason    = TSHttpHdrReasonLookup(status);
+  std::string_view date = HttpDateNow();
+  char buf[256];
+  int len = snprintf(buf, sizeof(buf), "HTTP/1.1 %d %s\r\nDate: %.*s\r\nCache-Control: no-cache\r\n", status, reason ? reason : "",
+                     static_cast<int>(date.size()), date.data());
+  if (chunked) {
+    len += snprintf(buf + len, sizeof(buf) - len, "Transfer-Encoding: chunked\r\nContent-Type: ");
+  } else {
+    len += snprintf(buf + len, sizeof(buf) - len, "Content-Length: %" PRId64 "\r\nContent-Type: ", size);
+  }
 
-union argument_type {
-  void *ptr;
-  intptr_t ecode;
-  TSVConn vc;
-  TSVIO vio;
-  TSHttpTxn txn;
-  RemapEchoRequest *trq;
+  TSIOBufferWrite(iobuf, buf, len);
+  TSIOBufferWrite(iobuf, mimeType.data(), mimeType.size());
+  TSIOBufferWrite(iobuf, "\r\n", 2);
+  TSIOBufferWrite(iobuf, tail.data(), tail.size());
+  return len + mimeType.size() + 2 + tail.size();
+}
 
-  argument_type(void *_p) : ptr(_p) {}
-};
+// Queue generated chunks until the write buffer is full, the body is done, or
+// a delay has to pass before the next chunk.
+static void
+GenerateBody(RemapEchoRequest *trq)
+{
+  RemapEchoRequest::Generated &gen = trq->gen;
+  const RemapEchoVariant &pattern  = trq->content->identity();
+  int64_t room                     = STREAM_HIGH_WATER - TSIOBufferReaderAvail(trq->writeio.reader);
 
-// This structure represents the state of a streaming I/O request. It
-// is directional (ie. either a read or a write). We need two of these
-// for each TSVConn; one to push data into the TSVConn and one to pull
-// data out.
-struct IOChannel {
-  TSVIO vio = nullptr;
-  TSIOBuffer iobuf;
-  TSIOBufferReader reader;
+  while (room > 0 && gen.remaining > 0 && gen.timer == nullptr) {
+    int64_t n = std::min(gen.chunk, gen.remaining);
 
-  IOChannel() : iobuf(TSIOBufferSizedCreate(TS_IOBUFFER_SIZE_INDEX_32K)), reader(TSIOBufferReaderAlloc(iobuf)) {}
-  ~IOChannel()
-  {
-    if (this->reader) {
-      TSIOBufferReaderFree(this->reader);
+    if (gen.chunked) {
+      char line[24];
+      int len = snprintf(line, sizeof(line), "%" PRIx64 "\r\n", n);
+      TSIOBufferWrite(trq->writeio.iobuf, line, len);
     }
+    for (int64_t done = 0; done < n; done += GENERATOR_BLOCK_SIZE) {
+      pattern.copy(trq->writeio.iobuf, 0, std::min(GENERATOR_BLOCK_SIZE, n - done));
+    }
+    gen.remaining -= n;
+    room          -= n;
 
-    if (this->iobuf) {
-      TSIOBufferDestroy(this->iobuf);
+    if (gen.chunked) {
+      TSIOBufferWrite(trq->writeio.iobuf, gen.remaining ? "\r\n" : "\r\n0\r\n\r\n", gen.remaining ? 2 : 7);
+    }
+    if (gen.delayMs > 0 && gen.remaining > 0) {
+      gen.timer = TSContScheduleOnPool(trq->cont, gen.delayMs, TS_THREAD_POOL_NET);
     }
   }
+}
 
-  void
-  read(TSVConn vc, TSCont contp)
-  {
-    this->vio = TSVConnRead(vc, contp, this->iobuf, INT64_MAX);
+static void
+WriteGeneratedResponse(RemapEchoRequest *trq, TSCont contp, std::string_view tail)
+{
+  RemapEchoHttpHeader &rq = trq->rqheader;
+  GeneratorParams params;
+  TSMLoc url = TS_NULL_MLOC;
+  bool valid = false;
+
+  if (TSHttpHdrUrlGet(rq.buffer, rq.header, &url) == TS_SUCCESS) {
+    int pathLen       = 0;
+    int queryLen      = 0;
+    const char *path  = TSUrlPathGet(rq.buffer, url, &pathLen);
+    const char *query = TSUrlHttpQueryGet(rq.buffer, url, &queryLen);
+    valid             = ParseGeneratorParams({path, static_cast<size_t>(path ? pathLen : 0)},
+                                             {query, static_cast<size_t>(query ? queryLen : 0)}, params);
+    TSHandleMLocRelease(rq.buffer, rq.header, url);
+  }
+  if (!valid) {
+    params = {TS_HTTP_STATUS_BAD_REQUEST, 0, 1, 0, false};
   }
 
-  void
-  write(TSVConn vc, TSCont contp)
-  {
-    this->vio = TSVConnWrite(vc, contp, this->reader, INT64_MAX);
+  VDEBUG("generating status=%d size=%" PRId64 " chunk=%" PRId64 " delay=%" PRId64 " chunked=%d for trq=%p", params.status,
+         params.size, params.chunk, params.delayMs, params.chunked, trq);
+
+  // A HEAD response announces the body a GET would get, but sends none.
+  bool head          = IsHeadRequest(rq);
+  int64_t hdrlen     =
+    WriteSimpleHeader(trq->writeio.iobuf, params.status, trq->content->mimeType, params.chunked, params.size, tail);
+  int64_t bodylen    = head ? 0 : params.size + (params.chunked ? ChunkedOverhead(params.size, params.chunk) : 0);
+  trq->gen.remaining = head ? 0 : params.size;
+  trq->gen.chunk     = params.chunk;
+  trq->gen.delayMs   = params.delayMs;
+  trq->gen.chunked   = params.chunked;
+  if (params.chunked && params.size == 0 && !head) {
+    TSIOBufferWrite(trq->writeio.iobuf, "0\r\n\r\n", 5);
   }
-};
+  GenerateBody(trq);
 
-struct RemapEchoHttpHeader {
-  TSMBuffer buffer;
-  TSMLoc header;
-  TSHttpParser parser;
+  trq->writeio.write(trq->vc, contp);
+  TSVIONBytesSet(trq->writeio.vio, hdrlen + bodylen);
+  TSVIOReenable(trq->writeio.vio);
 
-  RemapEchoHttpHeader()
+  TSStatIntIncrement(StatCountResponses, 1);
+  TSStatIntIncrement(StatCountBytes, hdrlen + bodylen);
+}
+
+// Writes JSON into an IOBuffer or, without one, only counts its bytes. Running
+// the same code with both computes the Content-Length and then writes the
+// body, straight from the request's marshal buffer.
+struct JsonSink {
+  TSIOBuffer iobuf = nullptr;
+  int64_t length   = 0;
+
+  void
+  raw(std::string_view sv)
   {
-    this->buffer = TSMBufferCreate();
-    this->header = TSHttpHdrCreate(this->buffer);
-    this->parser = TSHttpParserCreate();
+    if (iobuf) {
+      TSIOBufferWrite(iobuf, sv.data(), sv.size());
+    }
+    length += sv.size();
   }
 
-  ~RemapEchoHttpHeader()
+  // Returns the length of the well-formed UTF-8 sequence at the start of sv,
+  // whose first byte is at least 0x80, or 0 if it is not one (RFC 3629).
+  static size_t
+  utf8SequenceLength(std::string_view sv)
   {
-    if (this->parser) {
-      TSHttpParserDestroy(this->parser);
+    auto byte       = [&sv](size_t i) { return static_cast<unsigned char>(sv[i]); };
+    unsigned char c = byte(0);
+    size_t n        = c >= 0xc2 && c <= 0xdf ? 2 : c >= 0xe0 && c <= 0xef ? 3 : c >= 0xf0 && c <= 0xf4 ? 4 : 0;
+    if (n == 0 || sv.size() < n) {
+      return 0;
     }
-
-    TSHttpHdrDestroy(this->buffer, this->header);
-    TSHandleMLocRelease(this->buffer, TS_NULL_MLOC, this->header);
-    TSMBufferDestroy(this->buffer);
+    // The second byte has a narrower range after some lead bytes, to rule out
+    // overlong forms, surrogates and code points above U+10FFFF.
+    unsigned char lo = c == 0xe0 ? 0xa0 : c == 0xf0 ? 0x90 : 0x80;
+    unsigned char hi = c == 0xed ? 0x9f : c == 0xf4 ? 0x8f : 0xbf;
+    if (byte(1) < lo || byte(1) > hi) {
+      return 0;
+    }
+    for (size_t i = 2; i < n; ++i) {
+      if ((byte(i) & 0xc0) != 0x80) {
+        return 0;
+      }
+    }
+    return n;
   }
-};
 
-struct RemapEchoRequest {
-  RemapEchoRequest() {}
-
-  off_t nbytes   = 0; // Number of bytes to generate.
-  int statusCode = 200;
-  IOChannel readio;
-  IOChannel writeio;
-  RemapEchoHttpHeader rqheader;
+  // Writes the inside of a JSON string, escaping what RFC 8259 requires.
+  // Well-formed UTF-8 is copied as it is. Any other byte of 0x80 and above is
+  // written as the code point of the same value, so that the output stays
+  // valid JSON whatever the client sent.
+  void
+  escaped(std::string_view sv)
+  {
+    size_t start = 0;
+    for (size_t i = 0; i < sv.size(); ++i) {
+      unsigned char c = sv[i];
+      if (c >= 0x80) {
+        size_t n = utf8SequenceLength(sv.substr(i));
+        if (n > 0) {
+          i += n - 1;
+          continue;
+        }
+      } else if (c >= 0x20 && c != '"' && c != '\\') {
+        continue;
+      }
+      raw(sv.substr(start, i - start));
+      start = i + 1;
 
-  std::string content;
-  std::string mimeType;
+      char esc[8];
+      switch (c) {
+      case '"':
+        raw("\\\"");
+        break;
+      case '\\':
+        raw("\\\\");
+        break;
+      case '\n':
+        raw("\\n");
+        break;
+      case '\r':
+        raw("\\r");
+        break;
+      case '\t':
+        raw("\\t");
+        break;
+      default:
+        snprintf(esc, sizeof(esc), "\\u%04x", c);
+        raw({esc, 6});
+        break;
+      }
+    }
+    raw(sv.substr(start));
+  }
 
-  static RemapEchoRequest *
-  createRemapEchoRequest(RemapEchoConfig *tc, [[maybe_unused]] TSHttpTxn txn)
+  void
+  string(std::string_view sv)
   {
-    RemapEchoRequest *shr = new RemapEchoRequest;
-
-    shr->statusCode = tc->statusCode;
-    shr->content    = tc->content;
-    shr->nbytes     = static_cast<off_t>(shr->content.size());
-    shr->mimeType   = tc->mimeType;
-    return shr;
+    raw("\"");
+    escaped(sv);
+    raw("\"");
   }
 
-  ~RemapEchoRequest() = default;
+  void
+  number(int64_t n)
+  {
+    char buf[24];
+    int len = snprintf(buf, sizeof(buf), "%" PRId64, n);
+    raw({buf, static_cast<size_t>(len)});
+  }
 };
 
-// Destroy a RemapEchoRequest, including the per-txn continuation.
+// Calls fn(name, value) for each captured milestone, skipping those that were
+// not reached.
+template <typename Fn>
 static void
-RemapEchoRequestDestroy(RemapEchoRequest *trq, TSVIO vio, TSCont contp)
+ForEachEchoMilestone(const RemapEchoRequest *trq, Fn fn)
 {
-  if (vio) {
-    TSVConnClose(TSVIOVConnGet(vio));
+  TSHRTime begin = trq->milestones[0];
+  for (size_t i = 0; i < N_ECHO_MILESTONES; ++i) {
+    TSHRTime value = trq->milestones[i];
+    if (value == 0) {
+      continue;
+    }
+    fn(ECHO_MILESTONES[i].name, ECHO_MILESTONES[i].duration || begin == 0 ? value : value - begin);
   }
-
-  TSContDestroy(contp);
-  delete trq;
 }
 
-// NOTE: This will always append a new "field_name: value"
+// Writes the echo of the parsed request as JSON, e.g.
+// {"method":"GET","url":"/a?b","version":"HTTP/1.1","headers":[["Host","x"]],
+//  "milestones_ns":{"ua_first_read":1200}}
 static void
-HeaderFieldDateSet(const RemapEchoHttpHeader &http, const char *field_name, int field_len, time_t value)
+EchoJson(const RemapEchoRequest *trq, JsonSink &out)
 {
-  TSMLoc field;
+  const RemapEchoHttpHeader &rq = trq->rqheader;
+  int len                       = 0;
+  const char *str               = TSHttpHdrMethodGet(rq.buffer, rq.header, &len);
+
+  out.raw("{\"method\":");
+  out.string({str, static_cast<size_t>(str ? len : 0)});
+
+  out.raw(",\"url\":\"/");
+  TSMLoc url = TS_NULL_MLOC;
+  if (TSHttpHdrUrlGet(rq.buffer, rq.header, &url) == TS_SUCCESS) {
+    str = TSUrlPathGet(rq.buffer, url, &len);
+    out.escaped({str, static_cast<size_t>(str ? len : 0)});
+    str = TSUrlHttpQueryGet(rq.buffer, url, &len);
+    if (str && len > 0) {
+      out.raw("?");
+      out.escaped({str, static_cast<size_t>(len)});
+    }
+    TSHandleMLocRelease(rq.buffer, rq.header, url);
+  }
+
+  int version = TSHttpHdrVersionGet(rq.buffer, rq.header);
+  char versionStr[32];
+  len = snprintf(versionStr, sizeof(versionStr), "\",\"version\":\"HTTP/%d.%d\"", TS_HTTP_MAJOR(version), TS_HTTP_MINOR(version));
+  out.raw({versionStr, static_cast<size_t>(len)});
+
+  out.raw(",\"headers\":[");
+  int count = TSMimeHdrFieldsCount(rq.buffer, rq.header);
+  for (int i = 0; i < count; ++i) {
+    TSMLoc field = TSMimeHdrFieldGet(rq.buffer, rq.header, i);
+    out.raw(i ? ",[" : "[");
+    str = TSMimeHdrFieldNameGet(rq.buffer, rq.header, field, &len);
+    out.string({str, static_cast<size_t>(str ? len : 0)});
+    out.raw(",");
+    str = TSMimeHdrFieldValueStringGet(rq.buffer, rq.header, field, -1, &len);
+    out.string({str, static_cast<size_t>(str ? len : 0)});
+    out.raw("]");
+    TSHandleMLocRelease(rq.buffer, rq.header, field);
+  }
 
-  TSMimeHdrFieldCreateNamed(http.buffer, http.header, field_name, field_len, &field);
-  TSMimeHdrFieldValueDateSet(http.buffer, http.header, field, value);
-  TSMimeHdrFieldAppend(http.buffer, http.header, field);
-  TSHandleMLocRelease(http.buffer, http.header, field);
+  out.raw("],\"milestones_ns\":{");
+  bool first = true;
+  ForEachEchoMilestone(trq, [&](const char *name, TSHRTime value) {
+    out.raw(first ? "" : ",");
+    out.string(name);
+    out.raw(":");
+    out.number(value);
+    first = false;
+  });
+  out.raw("}}\n");
 }
 
-// NOTE: This will always append a new "field_name: value"
+// Answers with the request as it was received: its header printed straight
+// from the marshal buffer followed by the milestones as text, or everything
+// as JSON.
 static void
-HeaderFieldIntSet(const RemapEchoHttpHeader &http, const char *field_name, int field_len, int64_t value)
+WriteEchoResponse(RemapEchoRequest *trq, TSCont contp, std::string_view tail)
 {
-  TSMLoc field;
+  const RemapEchoContent &content = *trq->content;
+  const RemapEchoHttpHeader &rq   = trq->rqheader;
+  int64_t bodylen                 = 0;
+  char milestones[N_ECHO_MILESTONES * 48];
+  int milestonesLen = 0;
+
+  trq->milestones[ECHO_MILESTONE_RESPOND] = TShrtime();
+  if (content.mode == RemapEchoMode::EchoJson) {
+    JsonSink counter;
+    EchoJson(trq, counter);
+    bodylen = counter.length;
+  } else {
+    ForEachEchoMilestone(trq, [&](const char *name, TSHRTime value) {
+      milestonesLen += snprintf(milestones + milestonesLen, sizeof(milestones) - milestonesLen, "%s: %" PRId64 "\n", name, value);
+    });
+    bodylen = TSHttpHdrLengthGet(rq.buffer, rq.header) + milestonesLen;
+  }
 
-  TSMimeHdrFieldCreateNamed(http.buffer, http.header, field_name, field_len, &field);
-  TSMimeHdrFieldValueInt64Set(http.buffer, http.header, field, -1, value);
-  TSMimeHdrFieldAppend(http.buffer, http.header, field);
-  TSHandleMLocRelease(http.buffer, http.header, field);
-}
+  // A HEAD request is echoed as well, but only the length of the echo is sent.
+  int64_t hdrlen = WriteSimpleHeader(trq->writeio.iobuf, TS_HTTP_STATUS_OK, content.mimeType, false, bodylen, tail);
+  if (IsHeadRequest(rq)) {
+    bodylen = 0;
+  } else if (content.mode == RemapEchoMode::EchoJson) {
+    JsonSink writer{trq->writeio.iobuf};
+    EchoJson(trq, writer);
+  } else {
+    TSHttpHdrPrint(rq.buffer, rq.header, trq->writeio.iobuf);
+    TSIOBufferWrite(trq->writeio.iobuf, milestones, milestonesLen);
+  }
 
-// NOTE: This will always append a new "field_name: value"
-static void
-HeaderFieldStringSet(const RemapEchoHttpHeader &http, const char *field_name, int field_len, const char *value)
-{
-  TSMLoc field;
+  trq->writeio.write(trq->vc, contp);
+  TSVIONBytesSet(trq->writeio.vio, hdrlen + bodylen);
+  TSVIOReenable(trq->writeio.vio);
 
-  TSMimeHdrFieldCreateNamed(http.buffer, http.header, field_name, field_len, &field);
-  TSMimeHdrFieldValueStringSet(http.buffer, http.header, field, -1, value, -1);
-  TSMimeHdrFieldAppend(http.buffer, http.header, field);
-  TSHandleMLocRelease(http.buffer, http.header, field);
+  TSStatIntIncrement(StatCountResponses, 1);
+  TSStatIntIncrement(StatCountBytes, hdrlen + bodylen);
 }
 
-static TSReturnCode
-WriteResponseHeader(RemapEchoRequest *trq, [[maybe_unused]] TSCont contp, TSHttpStatus status)
+static void
+WriteResponse(RemapEchoRequest *trq, TSCont contp)
 {
-  RemapEchoHttpHeader response;
+  const RemapEchoContent &content = *trq->content;
+
+  // The request body is never used, but it has to be read off the connection
+  // before the next request header. A body whose end is only known by decoding
+  // it is not worth that, so the connection is closed after the response.
+  int64_t requestBody = RequestBodyLength(trq->rqheader);
+  trq->unreadBody     = std::max<int64_t>(requestBody, 0);
+  trq->keepAlive      = trq->keepAlive && !trq->readClosed && requestBody >= 0 && RequestAllowsKeepAlive(trq->rqheader);
+  trq->writing        = true;
+  trq->clearBody();
+
+  std::string_view tail = trq->keepAlive ? KEEP_ALIVE_TAIL : CLOSE_TAIL;
+  int64_t hdrlen        = 0;
+  int64_t bodylen       = 0;
+
+  switch (content.mode) {
+  case RemapEchoMode::Generator:
+    WriteGeneratedResponse(trq, contp, tail);
+    return;
+  case RemapEchoMode::EchoText:
+  case RemapEchoMode::EchoJson:
+    WriteEchoResponse(trq, contp, tail);
+    return;
+  case RemapEchoMode::Content:
+    break;
+  }
 
-  VDEBUG("writing response header");
+  trq->variant = &SelectVariant(content, trq->rqheader);
+  if (content.rangeable() && IsNotModified(content, *trq->variant, trq->rqheader)) {
+    VDEBUG("writing 304 for trq=%p, keepAlive=%d", trq, trq->keepAlive);
+    hdrlen = trq->variant->notModified.write(trq->writeio.iobuf, tail);
+    trq->writeio.write(trq->vc, contp);
+    TSVIONBytesSet(trq->writeio.vio, hdrlen);
+    TSVIOReenable(trq->writeio.vio);
 
-  if (TSHttpHdrTypeSet(response.buffer, response.header, TS_HTTP_TYPE_RESPONSE) != TS_SUCCESS) {
-    VERROR("failed to set type");
-    return TS_ERROR;
+    TSStatIntIncrement(StatCountResponses, 1);
+    TSStatIntIncrement(StatCountBytes, hdrlen);
+    return;
   }
-  if (TSHttpHdrVersionSet(response.buffer, response.header, TS_HTTP_VERSION(1, 1)) != TS_SUCCESS) {
-    VERROR("failed to set HTTP version");
-    return TS_ERROR;
+
+  // A HEAD response has the header of the full GET response, Content-Length
+  // included, but no body. Range only applies to GET.
+  if (IsHeadRequest(trq->rqheader)) {
+    VDEBUG("writing HEAD response for trq=%p, keepAlive=%d", trq, trq->keepAlive);
+    hdrlen = trq->variant->header.write(trq->writeio.iobuf, tail);
+    trq->writeio.write(trq->vc, contp);
+    TSVIONBytesSet(trq->writeio.vio, hdrlen);
+    TSVIOReenable(trq->writeio.vio);
+
+    TSStatIntIncrement(StatCountResponses, 1);
+    TSStatIntIncrement(StatCountBytes, hdrlen);
+    return;
   }
-  if (TSHttpHdrStatusSet(response.buffer, response.header, status) != TS_SUCCESS) {
-    VERROR("failed to set HTTP status");
-    return TS_ERROR;
+
+  // Ranges always refer to the identity variant, since a multipart body cannot
+  // carry a per-part Content-Encoding.
+  std::vector<ByteRange> ranges;
+  RangeResult rangeResult = content.rangeable() ? RequestedByteRanges(content, trq->rqheader, ranges) : RangeResult::Ignore;
+  if (rangeResult != RangeResult::Ignore) {
+    trq->variant = &content.identity();
   }
 
-  TSHttpHdrReasonSet(response.buffer, response.header, TSHttpHdrReasonLookup(status), -1);
+  VDEBUG("writing response for trq=%p, keepAlive=%d, ranges=%zu, encoding=%s", trq, trq->keepAlive, ranges.size(),
+         trq->variant->encoding.c_str());
 
-  // Set the Content-Length header.
-  HeaderFieldIntSet(response, TS_MIME_FIELD_CONTENT_LENGTH, TS_MIME_LEN_CONTENT_LENGTH, trq->nbytes);
+  switch (rangeResult) {
+  case RangeResult::Ignore:
+    trq->pieces.push_back({false, 0, trq->variant->size});
+    hdrlen  = trq->variant->header.write(trq->writeio.iobuf, tail);
+    bodylen = trq->variant->size;
+    break;
 
-  // Set the Cache-Control header.
-  HeaderFieldStringSet(response, TS_MIME_FIELD_CACHE_CONTROL, TS_MIME_LEN_CACHE_CONTROL, "no-cache");
+  case RangeResult::Unsatisfiable: {
+    RemapEchoHeaderTemplate header{TS_HTTP_STATUS_RANGE_NOT_SATISFIABLE, content.mimeType, 0,
+                                   trq->variant->fields + "Content-Range: bytes */" + std::to_string(trq->variant->size) + "\r\n"};
+    hdrlen = header.write(trq->writeio.iobuf, tail);
+    break;
+  }
 
-  HeaderFieldStringSet(response, TS_MIME_FIELD_CONTENT_TYPE, TS_MIME_LEN_CONTENT_TYPE, trq->mimeType.c_str());
+  case RangeResult::Satisfiable: {
+    RemapEchoHeaderTemplate header = PreparePartialResponse(trq, ranges);
+    hdrlen                         = header.write(trq->writeio.iobuf, tail);
+    for (const RemapEchoRequest::BodyPiece &piece : trq->pieces) {
+      bodylen += piece.length;
+    }
+    break;
+  }
+  }
 
-  // Write the header to the IO buffer. Set the VIO bytes so that we can get a WRITE_COMPLETE
-  // event when this is done.
-  int hdrlen = TSHttpHdrLengthGet(response.buffer, response.header);
+  // A read failure is noticed again, and the connection closed, on the first
+  // WRITE_READY.
+  StreamBody(trq);
 
-  TSHttpHdrPrint(response.buffer, response.header, trq->writeio.iobuf);
-  TSVIONBytesSet(trq->writeio.vio, hdrlen);
+  // Set the VIO bytes so that we get a WRITE_COMPLETE event when the whole
+  // response has been sent.
+  trq->writeio.write(trq->vc, contp);
+  TSVIONBytesSet(trq->writeio.vio, hdrlen + bodylen);
   TSVIOReenable(trq->writeio.vio);
 
-  TSStatIntIncrement(StatCountBytes, hdrlen);
+  TSStatIntIncrement(StatCountResponses, 1);
+  TSStatIntIncrement(StatCountBytes, hdrlen + bodylen);
+}
 
-  return TS_SUCCESS;
+// Parse as much of the buffered request data as possible, answering the first
+// complete request. Bytes are consumed as they are parsed, so anything left in
+// the reader belongs to the body of the answered request, which is skipped, or
+// to the next pipelined request, which is parsed once the current response has
+// been written. Returns false if the connection was destroyed.
+static bool
+ParseRequests(RemapEchoRequest *trq, TSCont contp)
+{
+  RemapEchoHttpHeader &rqheader = trq->rqheader;
+
+  while (!trq->writing) {
+    if (trq->unreadBody > 0) {
+      int64_t n = std::min(TSIOBufferReaderAvail(trq->readio.reader), trq->unreadBody);
+      TSIOBufferReaderConsume(trq->readio.reader, n);
+      trq->unreadBody -= n;
+      if (trq->unreadBody > 0) {
+        break;
+      }
+    }
+
+    TSIOBufferBlock blk = TSIOBufferReaderStart(trq->readio.reader);
+    int64_t nbytes      = 0;
+    const char *start   = blk ? TSIOBufferBlockReadStart(blk, trq->readio.reader, &nbytes) : nullptr;
+
+    if (start == nullptr || nbytes == 0) {
+      break;
+    }
+
+    const char *ptr      = start;
+    TSParseResult result = TSHttpHdrParseReq(rqheader.parser, rqheader.buffer, rqheader.header, &ptr, start + nbytes);
+    TSIOBufferReaderConsume(trq->readio.reader, ptr - start);
+
+    switch (result) {
+    case TS_PARSE_ERROR:
+      // If we got a bad request, just shut it down.
+      VDEBUG("bad request on trq=%p, closing", trq);
+      RemapEchoRequestDestroy(trq);
+      return false;
+
+    case TS_PARSE_DONE:
+      WriteResponse(trq, contp);
+      break;
+
+    case TS_PARSE_CONT:
+      break;
+    }
+  }
+
+  if (trq->readClosed && !trq->writing) {
+    // Nothing more will arrive and there is no response left to send.
+    RemapEchoRequestDestroy(trq);
+    return false;
+  }
+
+  if (!trq->readClosed) {
+    // Reenable the read VIO to get more events.
+    TSVIOReenable(trq->readio.vio);
+  }
+  return true;
 }
 
 // Handle events from TSHttpTxnServerIntercept. The intercept
@@ -302,14 +2010,10 @@ RemapEchoInterceptHook(TSCont contp, TSEvent event, void *edata)
     // request state and start reading the VC.
     RemapEchoRequest *trq = static_cast<RemapEchoRequest *>(TSContDataGet(contp));
 
-    TSStatIntIncrement(StatCountResponses, 1);
     VDEBUG("allocated server intercept RemapEcho trq=%p", trq);
 
-    // This continuation was allocated in RemapEchoTxnHook. Reset the
-    // data to keep track of this generator request.
-    TSContDataSet(contp, trq);
-
     // Start reading the request from the server intercept VC.
+    trq->vc = arg.vc;
     trq->readio.read(arg.vc, contp);
     VIODEBUG(trq->readio.vio, "started reading RemapEcho request");
 
@@ -323,86 +2027,42 @@ RemapEchoInterceptHook(TSCont contp, TSEvent event, void *edata)
     // is if the intercept is attached early, and then we serve
     // the document out of cache.
 
-    // There's nothing to do here except nuke the continuation
-    // that was allocated in RemapEchoTxnHook().
-
-    RemapEchoRequest *trq = static_cast<RemapEchoRequest *>(TSContDataGet(contp));
-    delete trq;
+    // There's nothing to do here except return the request that was
+    // taken from the pool in RemapEchoSetupIntercept().
 
-    TSContDestroy(contp);
+    RemapEchoRequestDestroy(static_cast<RemapEchoRequest *>(TSContDataGet(contp)));
     return TS_EVENT_NONE;
   }
 
   case TS_EVENT_VCONN_READ_READY: {
-    argument_type cdata           = TSContDataGet(contp);
-    RemapEchoHttpHeader &rqheader = cdata.trq->rqheader;
+    argument_type cdata = TSContDataGet(contp);
 
     VDEBUG("reading vio=%p vc=%p, trq=%p", arg.vio, TSVIOVConnGet(arg.vio), cdata.trq);
-
-    TSIOBufferBlock blk;
-    TSParseResult result = TS_PARSE_CONT;
-
-    for (blk = TSIOBufferReaderStart(cdata.trq->readio.reader); blk; blk = TSIOBufferBlockNext(blk)) {
-      const char *ptr;
-      const char *end;
-      int64_t nbytes;
-      TSHttpStatus status = static_cast<TSHttpStatus>(cdata.trq->statusCode);
-
-      ptr = TSIOBufferBlockReadStart(blk, cdata.trq->readio.reader, &nbytes);
-      if (ptr == nullptr || nbytes == 0) {
-        continue;
-      }
-
-      end    = ptr + nbytes;
-      result = TSHttpHdrParseReq(rqheader.parser, rqheader.buffer, rqheader.header, &ptr, end);
-      switch (result) {
-      case TS_PARSE_ERROR:
-        // If we got a bad request, just shut it down.
-        VDEBUG("bad request on trq=%p, sending an error", cdata.trq);
-        RemapEchoRequestDestroy(cdata.trq, arg.vio, contp);
-        return TS_EVENT_ERROR;
-
-      case TS_PARSE_DONE:
-        // Start the vconn write.
-        cdata.trq->writeio.write(TSVIOVConnGet(arg.vio), contp);
-        TSVIONBytesSet(cdata.trq->writeio.vio, 0);
-
-        if (WriteResponseHeader(cdata.trq, contp, status) != TS_SUCCESS) {
-          VERROR("failure writing response");
-          return TS_EVENT_ERROR;
-        }
-
-        return TS_EVENT_NONE;
-
-      case TS_PARSE_CONT:
-        break;
-      }
-    }
-
-    TSReleaseAssert(result == TS_PARSE_CONT);
-
-    // Reenable the read VIO to get more events.
-    TSVIOReenable(arg.vio);
+    ParseRequests(cdata.trq, contp);
     return TS_EVENT_NONE;
   }
 
   case TS_EVENT_VCONN_WRITE_READY: {
+    // Top up the write buffer with the next chunk of a streamed body.
     argument_type cdata = TSContDataGet(contp);
 
-    if (cdata.trq->nbytes) {
-      int64_t nbytes = cdata.trq->nbytes;
-
-      VIODEBUG(arg.vio, "writing %" PRId64 " bytes for trq=%p", nbytes, cdata.trq);
-      nbytes = TSIOBufferWrite(cdata.trq->writeio.iobuf, cdata.trq->content.c_str(), nbytes);
-
-      cdata.trq->nbytes -= nbytes;
-      TSStatIntIncrement(StatCountBytes, nbytes);
-
-      // Update the number of bytes to write.
-      TSVIONBytesSet(arg.vio, TSVIONBytesGet(arg.vio) + nbytes);
-      TSVIOReenable(arg.vio);
+    switch (cdata.trq->content->mode) {
+    case RemapEchoMode::Content:
+      if (!StreamBody(cdata.trq)) {
+        // The client sees the response end before its Content-Length.
+        RemapEchoRequestDestroy(cdata.trq);
+        return TS_EVENT_NONE;
+      }
+      break;
+    case RemapEchoMode::Generator:
+      GenerateBody(cdata.trq);
+      break;
+    case RemapEchoMode::EchoText:
+    case RemapEchoMode::EchoJson:
+      // Echo responses are queued whole.
+      break;
     }
-
+    TSVIOReenable(arg.vio);
     return TS_EVENT_NONE;
   }
 
@@ -411,7 +2071,13 @@ RemapEchoInterceptHook(TSCont contp, TSEvent event, void *edata)
     argument_type cdata = TSContDataGet(contp);
 
     VIODEBUG(arg.vio, "received EOS or ERROR for trq=%p", cdata.trq);
-    RemapEchoRequestDestroy(cdata.trq, arg.vio, contp);
+    if (event == TS_EVENT_VCONN_EOS && arg.vio == cdata.trq->readio.vio && cdata.trq->writing) {
+      // The client finished sending, but still waits for the current
+      // response. Close once it has been written.
+      cdata.trq->readClosed = true;
+      return TS_EVENT_NONE;
+    }
+    RemapEchoRequestDestroy(cdata.trq);
     return event == TS_EVENT_ERROR ? TS_EVENT_ERROR : TS_EVENT_NONE;
   }
 
@@ -421,22 +2087,29 @@ RemapEchoInterceptHook(TSCont contp, TSEvent event, void *edata)
     return TS_EVENT_NONE;
 
   case TS_EVENT_VCONN_WRITE_COMPLETE: {
-    argument_type cdata = TSContDataGet(contp);
+    argument_type cdata   = TSContDataGet(contp);
+    RemapEchoRequest *trq = cdata.trq;
 
-    // If we still have bytes to write, kick off a new write operation, otherwise
-    // we are done and we can shut down the VC.
-    if (cdata.trq->nbytes) {
-      cdata.trq->writeio.write(TSVIOVConnGet(arg.vio), contp);
-      TSVIONBytesSet(cdata.trq->writeio.vio, cdata.trq->nbytes);
-    } else {
-      VIODEBUG(arg.vio, "TS_EVENT_VCONN_WRITE_COMPLETE %" PRId64 " todo", TSVIONTodoGet(arg.vio));
-      RemapEchoRequestDestroy(cdata.trq, arg.vio, contp);
+    VIODEBUG(arg.vio, "TS_EVENT_VCONN_WRITE_COMPLETE %" PRId64 " todo", TSVIONTodoGet(arg.vio));
+    if (!trq->keepAlive) {
+      RemapEchoRequestDestroy(trq);
+      return TS_EVENT_NONE;
     }
 
+    // Get ready for the next request, which may already be buffered.
+    trq->writing = false;
+    trq->rqheader.reset();
+    ParseRequests(trq, contp);
     return TS_EVENT_NONE;
   }
 
   case TS_EVENT_TIMEOUT: {
+    // A generator delay has passed, so the next chunk can go out.
+    argument_type cdata = TSContDataGet(contp);
+
+    cdata.trq->gen.timer = nullptr;
+    GenerateBody(cdata.trq);
+    TSVIOReenable(cdata.trq->writeio.vio);
     return TS_EVENT_NONE;
   }
 
@@ -453,16 +2126,20 @@ RemapEchoInterceptHook(TSCont contp, TSEvent event, void *edata)
 static void
 RemapEchoSetupIntercept(RemapEchoConfig *cfg, TSHttpTxn txn)
 {
-  RemapEchoRequest *req = RemapEchoRequest::createRemapEchoRequest(cfg, txn);
+  std::shared_ptr<const RemapEchoContent> content = cfg->content.load();
+  RemapEchoRequest *req                           = RemapEchoRequestPool::acquire(content->writeSizeIndex);
 
-  if (req == nullptr) {
-    return;
+  if (content->mode == RemapEchoMode::EchoText || content->mode == RemapEchoMode::EchoJson) {
+    for (size_t i = 0; i < N_ECHO_MILESTONES; ++i) {
+      if (ECHO_MILESTONES[i].type != TS_MILESTONE_NULL) {
+        TSHttpTxnMilestoneGet(txn, ECHO_MILESTONES[i].type, &req->milestones[i]);
+      }
+    }
+    req->milestones[ECHO_MILESTONE_REMAP] = TShrtime();
   }
 
-  TSCont cnt = TSContCreate(RemapEchoInterceptHook, TSMutexCreate());
-  TSContDataSet(cnt, req);
-
-  TSHttpTxnServerIntercept(cnt, txn);
+  req->content = std::move(content);
+  TSHttpTxnServerIntercept(req->cont, txn);
 
   return;
 }
@@ -515,6 +2192,14 @@ done:
   return TS_EVENT_NONE;
 }
 
+// Periodic task that reloads the content of a config when its files change.
+static int
+RemapEchoContentWatch(TSCont contp, [[maybe_unused]] TSEvent event, [[maybe_unused]] void *edata)
+{
+  static_cast<RemapEchoConfig *>(TSContDataGet(contp))->reloadIfChanged();
+  return TS_EVENT_NONE;
+}
+
 TSReturnCode
 TSRemapInit([[maybe_unused]] TSRemapInterface *api_info, [[maybe_unused]] char *errbuf, [[maybe_unused]] int errbuf_size)
 {
@@ -526,6 +2211,15 @@ TSRemapInit([[maybe_unused]] TSRemapInterface *api_info, [[maybe_unused]] char *
     StatCountResponses =
       TSStatCreate("RemapEcho.response_count", TS_RECORDDATATYPE_COUNTER, TS_STAT_NON_PERSISTENT, TS_STAT_SYNC_COUNT);
   }
+
+  if (TSStatFindName("RemapEcho.pool_hit", &StatCountPoolHits) == TS_ERROR) {
+    StatCountPoolHits = TSStatCreate("RemapEcho.pool_hit", TS_RECORDDATATYPE_COUNTER, TS_STAT_NON_PERSISTENT, TS_STAT_SYNC_COUNT);
+  }
+
+  if (TSStatFindName("RemapEcho.pool_miss", &StatCountPoolMisses) == TS_ERROR) {
+    StatCountPoolMisses =
+      TSStatCreate("RemapEcho.pool_miss", TS_RECORDDATATYPE_COUNTER, TS_STAT_NON_PERSISTENT, TS_STAT_SYNC_COUNT);
+  }
   return TS_SUCCESS;
 }
 
@@ -556,15 +2250,25 @@ TSReturnCode
 TSRemapNewInstance(int argc, char *argv[], void **ih, [[maybe_unused]] char *errbuf, [[maybe_unused]] int errbuf_size)
 {
   static const struct option longopt[] = {
-    {"content-path", required_argument, nullptr, 'c' },
-    {"mime-type",    required_argument, nullptr, 'm' },
-    {"status-code",  required_argument, nullptr, 's' },
-    {nullptr,        no_argument,       nullptr, '\0'}
+    {"content-path",    required_argument, nullptr, 'c' },
+    {"mime-type",       required_argument, nullptr, 'm' },
+    {"status-code",     required_argument, nullptr, 's' },
+    {"stream-file",     no_argument,       nullptr, 'S' },
+    {"precompressed",   no_argument,       nullptr, 'P' },
+    {"reload-interval", required_argument, nullptr, 'r' },
+    {"generator",       no_argument,       nullptr, 'g' },
+    {"echo",            required_argument, nullptr, 'e' },
+    {nullptr,           no_argument,       nullptr, '\0'}
   };
 
   std::string contentPath;
   std::string mimeType = "text/plain";
-  int statusCode       = 0;
+  int statusCode       = TS_HTTP_STATUS_OK;
+  bool streamFile      = false;
+  bool precompressed   = false;
+  int reloadInterval   = 0;
+  bool generator       = false;
+  std::string echo;
 
   // argv contains the "to" and "from" URLs. Skip the first so that the
   // second one poses as the program name.
@@ -573,7 +2277,7 @@ TSRemapNewInstance(int argc, char *argv[], void **ih, [[maybe_unused]] char *err
   optind = 0;
 
   while (true) {
-    int opt = getopt_long(argc, (char *const *)argv, "c:m:s", longopt, nullptr);
+    int opt = getopt_long(argc, (char *const *)argv, "c:m:s:SPr:ge:", longopt, nullptr);
 
     switch (opt) {
     case 'c': {
@@ -585,6 +2289,21 @@ TSRemapNewInstance(int argc, char *argv[], void **ih, [[maybe_unused]] char *err
     case 's': {
       statusCode = atoi(optarg);
     } break;
+    case 'S': {
+      streamFile = true;
+    } break;
+    case 'P': {
+      precompressed = true;
+    } break;
+    case 'r': {
+      reloadInterval = atoi(optarg);
+    } break;
+    case 'g': {
+      generator = true;
+    } break;
+    case 'e': {
+      echo = std::string(optarg);
+    } break;
     }
 
     if (opt == -1) {
@@ -592,12 +2311,30 @@ TSRemapNewInstance(int argc, char *argv[], void **ih, [[maybe_unused]] char *err
     }
   }
 
-  if (contentPath.size() == 0) {
-    VERROR("Need to specify --content-path\n");
+  if (!echo.empty() && echo != "text" && echo != "json") {
+    VERROR("--echo must be text or json\n");
+    return TS_ERROR;
+  }
+  if (contentPath.size() == 0 && !generator && echo.empty()) {
+    VERROR("Need to specify --content-path, --generator or --echo\n");
     return TS_ERROR;
   }
 
-  RemapEchoConfig *tc = new RemapEchoConfig(contentPath, mimeType, statusCode);
+  RemapEchoConfig *tc = nullptr;
+  if (!echo.empty()) {
+    tc = new RemapEchoConfig(MakeEchoContent(echo == "json" ? RemapEchoMode::EchoJson : RemapEchoMode::EchoText));
+  } else if (generator) {
+    tc = new RemapEchoConfig(MakeGeneratorContent(mimeType));
+  } else {
+    tc = new RemapEchoConfig(contentPath, mimeType, statusCode, streamFile, precompressed);
+  }
+  if (tc->content.load() == nullptr) {
+    delete tc;
+    return TS_ERROR;
+  }
+  if (reloadInterval > 0 && tc->content.load()->mode == RemapEchoMode::Content) {
+    tc->startWatching(reloadInterval);
+  }
 
   // Finally, create the continuation to use for this remap rule, tracking the config as cont data.
   tc->cont = TSContCreate(RemapEchoTxnHook, nullptr);
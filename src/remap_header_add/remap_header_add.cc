@@ -21,69 +21,364 @@
   limitations under the License.
 
   @section description
-    This is a very simple plugin: it will add headers that are specified on a
-  remap line
+    This is a very simple plugin: it will edit the request headers as
+  specified on a remap line
+
+    Each parameter is one operation, applied in order:
+      name:value    append a field (same as +name:value)
+      +name:value   append a field, even if one is already present
+      =name:value   replace all fields named name with one holding value
+      ?name:value   add the field only if the request has none by that name
+      -name         delete every field named name
+  A value may be wrapped in double quotes, and may contain the variables
+  listed in header-template.h, e.g. X-Client:"%{client-ip}". Here
+  %{remap-tag} stands for the rule's "from" URL. Any operation may be prefixed
+  with one or more conditions, all of which must hold for it to run:
+      [method=GET]  the request method is GET
+      [header=name] the request has a field named name
+      [path=/api/]  the request path starts with /api/
 
     Example usage:
     map /foo http://127.0.0.1/ @plugin=remap_header_add.so @pparam=foo:"x"
-  @pparam=@test:"c" @pparam=a:"b"
+  @pparam=@test:"c" @pparam=a:"b" @pparam=-Proxy @pparam=[method=POST]?X-Body:"yes"
 
  */
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <strings.h>
+#include <string>
+#include <string_view>
+#include <vector>
 
 #include "ts/ts.h"
 #include "ts/remap.h"
-
-struct remap_line {
-  int argc;
-  char **argv; // store the originals
-
-  int nvc;     // the number of name value pairs, should be argc - 2.
-  char **name; // at load we will parse out the name and values.
-  char **val;
-};
+#include "header-template.h"
 
 #define PLUGIN_NAME "headeradd_remap"
 
 namespace
 {
 DbgCtl dbg_ctl{PLUGIN_NAME};
+
+// A field name resolved when the rule is loaded. Names ATS keeps as
+// well-known strings are replaced by the well-known pointer, which lets the
+// header code skip its tokenizer lookup on every request.
+class FieldName
+{
+public:
+  FieldName() = default;
+  explicit FieldName(std::string_view name);
+
+  const char *
+  data() const
+  {
+    return wks_ ? wks_ : text_.data();
+  }
+
+  int
+  size() const
+  {
+    return static_cast<int>(text_.size());
+  }
+
+private:
+  std::string text_;
+  const char *wks_ = nullptr;
+};
+
+struct WellKnownName {
+  const char *const &name;
+  const int &len;
+};
+
+const WellKnownName WELL_KNOWN_NAMES[] = {
+  {TS_MIME_FIELD_ACCEPT,          TS_MIME_LEN_ACCEPT         },
+  {TS_MIME_FIELD_ACCEPT_ENCODING, TS_MIME_LEN_ACCEPT_ENCODING},
+  {TS_MIME_FIELD_ACCEPT_LANGUAGE, TS_MIME_LEN_ACCEPT_LANGUAGE},
+  {TS_MIME_FIELD_AUTHORIZATION,   TS_MIME_LEN_AUTHORIZATION  },
+  {TS_MIME_FIELD_CACHE_CONTROL,   TS_MIME_LEN_CACHE_CONTROL  },
+  {TS_MIME_FIELD_CLIENT_IP,       TS_MIME_LEN_CLIENT_IP      },
+  {TS_MIME_FIELD_CONNECTION,      TS_MIME_LEN_CONNECTION     },
+  {TS_MIME_FIELD_COOKIE,          TS_MIME_LEN_COOKIE         },
+  {TS_MIME_FIELD_FORWARDED,       TS_MIME_LEN_FORWARDED      },
+  {TS_MIME_FIELD_HOST,            TS_MIME_LEN_HOST           },
+  {TS_MIME_FIELD_PRAGMA,          TS_MIME_LEN_PRAGMA         },
+  {TS_MIME_FIELD_REFERER,         TS_MIME_LEN_REFERER        },
+  {TS_MIME_FIELD_USER_AGENT,      TS_MIME_LEN_USER_AGENT     },
+  {TS_MIME_FIELD_VIA,             TS_MIME_LEN_VIA            },
+  {TS_MIME_FIELD_X_FORWARDED_FOR, TS_MIME_LEN_X_FORWARDED_FOR},
+};
+
+FieldName::FieldName(std::string_view name) : text_{name}
+{
+  for (const auto &wk : WELL_KNOWN_NAMES) {
+    if (static_cast<size_t>(wk.len) == name.size() && strncasecmp(wk.name, name.data(), name.size()) == 0) {
+      wks_ = wk.name;
+      break;
+    }
+  }
 }
 
-void
-ParseArgIntoNv(const char *arg, char **n, char **v)
+enum class OpCode { Append, Replace, SetIfAbsent, Delete };
+
+struct Condition {
+  enum Kind { Method, Header, PathPrefix };
+
+  Kind kind = Method;
+  std::string text; // the method or the path prefix without its leading '/'
+  FieldName name;   // the field for Header
+};
+
+struct Op {
+  OpCode code = OpCode::Append;
+  FieldName name;
+  HeaderTemplate value;
+  std::vector<Condition> conditions;
+};
+
+struct remap_line {
+  std::vector<Op> ops; // compiled out of the remap arguments at load
+};
+
+// The parts of a request that conditions look at, fetched on first use so a
+// rule without conditions never touches them.
+class RequestView
 {
-  const char *colon_pos = strchr(arg, ':');
+public:
+  RequestView(TSMBuffer bufp, TSMLoc hdr_loc, TSMLoc url_loc) : bufp_{bufp}, hdr_loc_{hdr_loc}, url_loc_{url_loc} {}
+
+  bool
+  matches(const Condition &cond)
+  {
+    switch (cond.kind) {
+    case Condition::Method:
+      return method() == cond.text;
+    case Condition::Header:
+      return has(cond.name);
+    case Condition::PathPrefix:
+      return path().starts_with(cond.text);
+    }
+    return false;
+  }
 
-  if (colon_pos == nullptr) {
-    *n = nullptr;
-    *v = nullptr;
-    Dbg(dbg_ctl, "No name value pair since it was malformed");
-    return;
+  bool
+  has(const FieldName &name) const
+  {
+    TSMLoc field_loc = TSMimeHdrFieldFind(bufp_, hdr_loc_, name.data(), name.size());
+    if (field_loc == TS_NULL_MLOC) {
+      return false;
+    }
+    TSHandleMLocRelease(bufp_, hdr_loc_, field_loc);
+    return true;
+  }
+
+private:
+  std::string_view
+  method()
+  {
+    if (!method_.data()) {
+      int len       = 0;
+      const char *p = TSHttpHdrMethodGet(bufp_, hdr_loc_, &len);
+      method_       = p ? std::string_view{p, static_cast<size_t>(len)} : std::string_view{"", 0};
+    }
+    return method_;
+  }
+
+  std::string_view
+  path()
+  {
+    if (!path_.data()) {
+      int len       = 0;
+      const char *p = TSUrlPathGet(bufp_, url_loc_, &len);
+      path_         = p ? std::string_view{p, static_cast<size_t>(len)} : std::string_view{"", 0};
+    }
+    return path_;
+  }
+
+  TSMBuffer bufp_;
+  TSMLoc hdr_loc_;
+  TSMLoc url_loc_;
+  std::string_view method_;
+  std::string_view path_;
+};
+
+bool
+ParseCondition(std::string_view spec, Condition &cond)
+{
+  auto eq = spec.find('=');
+  if (eq == std::string_view::npos || eq + 1 == spec.size()) {
+    return false;
+  }
+  std::string_view key = spec.substr(0, eq);
+  std::string_view arg = spec.substr(eq + 1);
+
+  if (key == "method") {
+    cond.kind = Condition::Method;
+    cond.text = arg;
+  } else if (key == "header") {
+    cond.kind = Condition::Header;
+    cond.name = FieldName{arg};
+  } else if (key == "path") {
+    // TSUrlPathGet returns the path without its leading slash.
+    if (arg.front() == '/') {
+      arg.remove_prefix(1);
+    }
+    cond.kind = Condition::PathPrefix;
+    cond.text = arg;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Compiles one remap argument into an operation. All parsing happens here so
+// that TSRemapDoRemap only walks the resulting ops.
+bool
+CompileOp(const char *arg, std::string_view remap_tag, Op &op)
+{
+  std::string_view spec{arg};
+
+  while (spec.starts_with('[')) {
+    auto close = spec.find(']');
+    Condition cond;
+    if (close == std::string_view::npos || !ParseCondition(spec.substr(1, close - 1), cond)) {
+      TSError("[%s] Invalid condition in \"%s\"", PLUGIN_NAME, arg);
+      return false;
+    }
+    op.conditions.push_back(std::move(cond));
+    spec.remove_prefix(close + 1);
   }
 
-  size_t name_len = colon_pos - arg;
-  *n              = static_cast<char *>(TSmalloc(name_len + 1));
-  memcpy(*n, arg, colon_pos - arg);
-  (*n)[name_len] = '\0';
+  if (!spec.empty()) {
+    switch (spec.front()) {
+    case '+':
+      spec.remove_prefix(1);
+      break;
+    case '=':
+      op.code = OpCode::Replace;
+      spec.remove_prefix(1);
+      break;
+    case '?':
+      op.code = OpCode::SetIfAbsent;
+      spec.remove_prefix(1);
+      break;
+    case '-':
+      op.code = OpCode::Delete;
+      spec.remove_prefix(1);
+      break;
+    default:
+      break;
+    }
+  }
 
-  size_t val_len = strlen(colon_pos + 1); // skip past the ':'
+  if (op.code == OpCode::Delete) {
+    if (spec.empty() || spec.find(':') != std::string_view::npos) {
+      TSError("[%s] Invalid delete operation \"%s\"", PLUGIN_NAME, arg);
+      return false;
+    }
+    op.name = FieldName{spec};
+    Dbg(dbg_ctl, "\t delete %.*s", op.name.size(), op.name.data());
+    return true;
+  }
 
+  auto colon = spec.find(':');
+  if (colon == std::string_view::npos || colon == 0) {
+    TSError("[%s] No name value pair in \"%s\"", PLUGIN_NAME, arg);
+    return false;
+  }
+
+  std::string_view val = spec.substr(colon + 1);
   // check to see if the value is quoted.
-  if (val_len > 1 && colon_pos[1] == '"' && colon_pos[val_len] == '"') {
-    colon_pos++;  // advance past the first quote
-    val_len -= 2; // don't include the trailing quote
+  if (val.size() > 1 && val.front() == '"' && val.back() == '"') {
+    val = val.substr(1, val.size() - 2);
   }
 
-  *v = static_cast<char *>(TSmalloc(val_len + 1));
-  memcpy(*v, colon_pos + 1, val_len);
-  (*v)[val_len] = '\0';
+  std::string reason = op.value.compile(val, remap_tag);
+  if (!reason.empty()) {
+    TSError("[%s] Invalid value in \"%s\": %s", PLUGIN_NAME, arg, reason.c_str());
+    return false;
+  }
+  op.name = FieldName{spec.substr(0, colon)};
 
-  Dbg(dbg_ctl, "\t name_len=%zu, val_len=%zu, %s=%s", name_len, val_len, *n, *v);
+  Dbg(dbg_ctl, "\t op=%d, name_len=%d, val_len=%zu, %.*s=%.*s", static_cast<int>(op.code), op.name.size(), val.size(),
+      op.name.size(), op.name.data(), static_cast<int>(val.size()), val.data());
+  return true;
 }
 
+void
+AppendField(TSMBuffer bufp, TSMLoc hdr_loc, const FieldName &name, std::string_view value)
+{
+  TSMLoc field_loc;
+  if (TSMimeHdrFieldCreateNamed(bufp, hdr_loc, name.data(), name.size(), &field_loc) != TS_SUCCESS) {
+    TSError("[%s] Failure on TSMimeHdrFieldCreateNamed", PLUGIN_NAME);
+    return;
+  }
+  if (!value.empty()) {
+    TSMimeHdrFieldValueStringSet(bufp, hdr_loc, field_loc, -1, value.data(), static_cast<int>(value.size()));
+  }
+  TSMimeHdrFieldAppend(bufp, hdr_loc, field_loc);
+  TSHandleMLocRelease(bufp, hdr_loc, field_loc);
+}
+
+// Destroys field_loc and every duplicate that follows it.
+void
+DestroyFields(TSMBuffer bufp, TSMLoc hdr_loc, TSMLoc field_loc)
+{
+  while (field_loc != TS_NULL_MLOC) {
+    TSMLoc next_loc = TSMimeHdrFieldNextDup(bufp, hdr_loc, field_loc);
+    TSMimeHdrFieldDestroy(bufp, hdr_loc, field_loc);
+    TSHandleMLocRelease(bufp, hdr_loc, field_loc);
+    field_loc = next_loc;
+  }
+}
+
+// Runs op against the header of rq. buf must hold HeaderTemplate::MAX_SIZE
+// bytes; the value is rendered into it only once the op knows it needs it.
+void
+RunOp(const TemplateRequest &rq, const Op &op, char *buf)
+{
+  TSMBuffer bufp = rq.bufp;
+  TSMLoc hdr_loc = rq.hdr_loc;
+
+  if (op.code == OpCode::Append) {
+    AppendField(bufp, hdr_loc, op.name, op.value.render(rq, buf));
+    return;
+  }
+
+  TSMLoc field_loc = TSMimeHdrFieldFind(bufp, hdr_loc, op.name.data(), op.name.size());
+  switch (op.code) {
+  case OpCode::Replace: {
+    std::string_view value = op.value.render(rq, buf);
+    if (field_loc == TS_NULL_MLOC) {
+      AppendField(bufp, hdr_loc, op.name, value);
+      break;
+    }
+    // An empty value still clears the existing one, but the API refuses a
+    // null pointer, which is what an empty rendered value may hold.
+    const char *data = value.empty() ? "" : value.data();
+    TSMimeHdrFieldValueStringSet(bufp, hdr_loc, field_loc, -1, data, static_cast<int>(value.size()));
+    DestroyFields(bufp, hdr_loc, TSMimeHdrFieldNextDup(bufp, hdr_loc, field_loc));
+    TSHandleMLocRelease(bufp, hdr_loc, field_loc);
+    break;
+  }
+  case OpCode::SetIfAbsent:
+    if (field_loc == TS_NULL_MLOC) {
+      AppendField(bufp, hdr_loc, op.name, op.value.render(rq, buf));
+    } else {
+      TSHandleMLocRelease(bufp, hdr_loc, field_loc);
+    }
+    break;
+  case OpCode::Delete:
+    DestroyFields(bufp, hdr_loc, field_loc);
+    break;
+  case OpCode::Append:
+    break;
+  }
+}
+
+} // namespace
+
 TSReturnCode
 TSRemapInit(TSRemapInterface *, char *, int)
 {
@@ -93,8 +388,6 @@ TSRemapInit(TSRemapInterface *, char *, int)
 TSReturnCode
 TSRemapNewInstance(int argc, char *argv[], void **ih, char *, int)
 {
-  remap_line *rl = nullptr;
-
   Dbg(dbg_ctl, "TSRemapNewInstance()");
 
   if (!argv || !ih) {
@@ -102,20 +395,17 @@ TSRemapNewInstance(int argc, char *argv[], void **ih, char *, int)
     return TS_ERROR;
   }
 
-  // print all arguments for this particular remapping
-
-  rl       = static_cast<remap_line *>(TSmalloc(sizeof(remap_line)));
-  rl->argc = argc;
-  rl->argv = argv;
-  rl->nvc  = argc - 2; // the first two are the remap from and to
-  if (rl->nvc) {
-    rl->name = static_cast<char **>(TSmalloc(sizeof(char *) * rl->nvc));
-    rl->val  = static_cast<char **>(TSmalloc(sizeof(char *) * rl->nvc));
-  }
+  auto *rl = new remap_line;
+  rl->ops.reserve(argc > 2 ? argc - 2 : 0);
 
   Dbg(dbg_ctl, "NewInstance:");
-  for (int i = 2; i < argc; i++) {
-    ParseArgIntoNv(argv[i], &rl->name[i - 2], &rl->val[i - 2]);
+  for (int i = 2; i < argc; i++) { // the first two are the remap from and to
+    Op op;
+    if (!CompileOp(argv[i], argv[0], op)) {
+      delete rl;
+      return TS_ERROR;
+    }
+    rl->ops.push_back(std::move(op));
   }
 
   *ih = rl;
@@ -128,17 +418,7 @@ TSRemapDeleteInstance(void *ih)
 {
   Dbg(dbg_ctl, "deleting instance %p", ih);
 
-  if (ih) {
-    remap_line *rl = static_cast<remap_line *>(ih);
-    for (int i = 0; i < rl->nvc; ++i) {
-      TSfree(rl->name[i]);
-      TSfree(rl->val[i]);
-    }
-
-    TSfree(rl->name);
-    TSfree(rl->val);
-    TSfree(rl);
-  }
+  delete static_cast<remap_line *>(ih);
 }
 
 TSRemapStatus
@@ -151,25 +431,21 @@ TSRemapDoRemap(void *ih, TSHttpTxn txn, TSRemapRequestInfo *rri)
     return TSREMAP_NO_REMAP;
   }
 
-  Dbg(dbg_ctl, "TSRemapDoRemap:");
-
-  TSMBuffer req_bufp;
-  TSMLoc req_loc;
-  if (TSHttpTxnClientReqGet(txn, &req_bufp, &req_loc) != TS_SUCCESS) {
-    TSError("[%s] Error while retrieving client request header", PLUGIN_NAME);
-    return TSREMAP_NO_REMAP;
-  }
-
-  for (int i = 0; i < rl->nvc; ++i) {
-    Dbg(dbg_ctl, R"(Attaching header "%s" with value "%s".)", rl->name[i], rl->val[i]);
-
-    TSMLoc field_loc;
-    if (TSMimeHdrFieldCreate(req_bufp, req_loc, &field_loc) == TS_SUCCESS) {
-      TSMimeHdrFieldNameSet(req_bufp, req_loc, field_loc, rl->name[i], strlen(rl->name[i]));
-      TSMimeHdrFieldAppend(req_bufp, req_loc, field_loc);
-      TSMimeHdrFieldValueStringInsert(req_bufp, req_loc, field_loc, 0, rl->val[i], strlen(rl->val[i]));
-    } else {
-      TSError("[%s] Failure on TSMimeHdrFieldCreate", PLUGIN_NAME);
+  Dbg(dbg_ctl, "TSRemapDoRemap: %zu ops", rl->ops.size());
+
+  RequestView request{rri->requestBufp, rri->requestHdrp, rri->requestUrl};
+  TemplateRequest rq{txn, rri->requestBufp, rri->requestHdrp, rri->requestUrl};
+  char buf[HeaderTemplate::MAX_SIZE];
+  for (const Op &op : rl->ops) {
+    bool run = true;
+    for (const Condition &cond : op.conditions) {
+      if (!request.matches(cond)) {
+        run = false;
+        break;
+      }
+    }
+    if (run) {
+      RunOp(rq, op, buf);
     }
   }
 
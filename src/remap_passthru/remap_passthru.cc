@@ -19,8 +19,29 @@
   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
   See the License for the specific language governing permissions and
   limitations under the License.
+
+  @section description
+    Makes requests on the remap rule skip the cache, both lookup and write.
+  Without parameters every request does. Otherwise only the requests that
+  match at least one of these predicates do, and the rest keep being served
+  from and stored in the cache:
+
+    --method=LIST       the method is one of LIST, e.g. POST,PUT,DELETE;
+                        names are upper-cased
+    --header=NAME       the request has a NAME field
+    --header=NAME:VALUE a NAME field holds VALUE as one of its comma
+                        separated values, compared without regard to case,
+                        e.g. Cache-Control:no-cache
+    --query=LIST        the query string has one of the keys in LIST
+    --suffix=LIST       the path ends with one of LIST, e.g. .m3u8,.mpd
+
+  Each option may be given more than once, and an unknown option fails the
+  rule rather than leave it without predicates. The predicates
+  are compiled when the rule is loaded, so that TSRemapDoRemap only does
+  bitmask tests and byte compares.
  */
 
+#include <cctype>
 #include <cerrno>
 #include <cinttypes>
 
@@ -32,9 +53,14 @@
 #include <fstream>
 #include <sstream>
 
+#include <algorithm>
+#include <bitset>
 #include <filesystem>
 #include <getopt.h>
 #include <string>
+#include <string_view>
+#include <strings.h>
+#include <vector>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -58,6 +84,234 @@ static DbgCtl dbg_ctl{PLUGIN};
   VDEBUG("vio=%p vio.cont=%p, vio.cont.data=%p, vio.vc=%p " fmt, (vio), TSVIOContGet(vio), TSContDataGet(TSVIOContGet(vio)), \
          TSVIOVConnGet(vio), ##__VA_ARGS__)
 
+namespace
+{
+// Methods ATS keeps as well-known strings. TSHttpHdrMethodGet returns the
+// well-known pointer for them, so they are matched by address and each takes
+// one bit of the method mask.
+const char *const *const WELL_KNOWN_METHODS[] = {
+  &TS_HTTP_METHOD_GET,     &TS_HTTP_METHOD_HEAD,  &TS_HTTP_METHOD_POST,    &TS_HTTP_METHOD_PUT,   &TS_HTTP_METHOD_DELETE,
+  &TS_HTTP_METHOD_OPTIONS, &TS_HTTP_METHOD_PURGE, &TS_HTTP_METHOD_CONNECT, &TS_HTTP_METHOD_TRACE, &TS_HTTP_METHOD_PUSH,
+};
+
+struct HeaderPredicate {
+  std::string name;
+  std::string value; // empty for a presence test
+};
+
+// The predicates of one remap rule. A request bypasses the cache when any
+// of them matches.
+struct BypassRules {
+  uint32_t methods = 0;                   // bit i stands for WELL_KNOWN_METHODS[i]
+  std::vector<std::string> other_methods; // methods ATS has no well-known string for
+  std::vector<HeaderPredicate> headers;
+  std::vector<std::string> query_keys;
+  std::vector<std::string> suffixes;
+  // The last byte of every suffix, which turns most paths away with one test.
+  std::bitset<256> suffix_last_bytes;
+
+  bool
+  empty() const
+  {
+    return methods == 0 && other_methods.empty() && headers.empty() && query_keys.empty() && suffixes.empty();
+  }
+
+  bool matches(TSMBuffer bufp, TSMLoc hdr_loc, TSMLoc url_loc) const;
+
+private:
+  bool matchesMethod(TSMBuffer bufp, TSMLoc hdr_loc) const;
+  bool matchesHeader(TSMBuffer bufp, TSMLoc hdr_loc, const HeaderPredicate &pred) const;
+  bool matchesQuery(TSMBuffer bufp, TSMLoc url_loc) const;
+  bool matchesSuffix(TSMBuffer bufp, TSMLoc url_loc) const;
+};
+
+// Calls add on every non-empty element of a comma separated list, and
+// returns how many there were.
+template <typename F>
+size_t
+ForEachListItem(std::string_view list, F &&add)
+{
+  size_t count = 0;
+  while (!list.empty()) {
+    auto comma            = list.find(',');
+    std::string_view item = list.substr(0, comma);
+    if (!item.empty()) {
+      add(item);
+      ++count;
+    }
+    list.remove_prefix(comma == std::string_view::npos ? list.size() : comma + 1);
+  }
+  return count;
+}
+
+// Methods are case-sensitive and the standard ones are upper case, so the
+// name is upper-cased: --method=post bypasses the cache for POST.
+void
+AddMethod(std::string_view name, BypassRules &rules)
+{
+  std::string upper{name};
+  for (char &c : upper) {
+    c = toupper(static_cast<unsigned char>(c));
+  }
+  for (size_t i = 0; i < std::size(WELL_KNOWN_METHODS); ++i) {
+    if (upper == *WELL_KNOWN_METHODS[i]) {
+      rules.methods |= 1u << i;
+      return;
+    }
+  }
+  rules.other_methods.emplace_back(std::move(upper));
+}
+
+bool
+AddHeader(std::string_view spec, BypassRules &rules)
+{
+  auto colon = spec.find(':');
+  HeaderPredicate pred;
+  pred.name = spec.substr(0, colon);
+  if (colon != std::string_view::npos) {
+    std::string_view value = spec.substr(colon + 1);
+    while (!value.empty() && value.front() == ' ') {
+      value.remove_prefix(1);
+    }
+    if (value.empty()) {
+      return false;
+    }
+    pred.value = value;
+  }
+  if (pred.name.empty()) {
+    return false;
+  }
+  rules.headers.push_back(std::move(pred));
+  return true;
+}
+
+std::string_view
+Trim(std::string_view s)
+{
+  while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+    s.remove_prefix(1);
+  }
+  while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+    s.remove_suffix(1);
+  }
+  return s;
+}
+
+bool
+BypassRules::matchesMethod(TSMBuffer bufp, TSMLoc hdr_loc) const
+{
+  int len            = 0;
+  const char *method = TSHttpHdrMethodGet(bufp, hdr_loc, &len);
+  if (!method) {
+    return false;
+  }
+  for (size_t i = 0; i < std::size(WELL_KNOWN_METHODS); ++i) {
+    if (method == *WELL_KNOWN_METHODS[i]) {
+      return (methods >> i) & 1;
+    }
+  }
+  std::string_view name{method, static_cast<size_t>(len)};
+  for (const auto &other : other_methods) {
+    if (name == other) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool
+BypassRules::matchesHeader(TSMBuffer bufp, TSMLoc hdr_loc, const HeaderPredicate &pred) const
+{
+  TSMLoc field_loc = TSMimeHdrFieldFind(bufp, hdr_loc, pred.name.data(), static_cast<int>(pred.name.size()));
+  bool found       = field_loc != TS_NULL_MLOC && pred.value.empty();
+
+  while (field_loc != TS_NULL_MLOC && !found) {
+    int count = TSMimeHdrFieldValuesCount(bufp, hdr_loc, field_loc);
+    for (int i = 0; i < count && !found; ++i) {
+      int len                = 0;
+      const char *p          = TSMimeHdrFieldValueStringGet(bufp, hdr_loc, field_loc, i, &len);
+      std::string_view value = p ? Trim({p, static_cast<size_t>(len)}) : std::string_view{};
+      found                  = value.size() == pred.value.size() && strncasecmp(value.data(), pred.value.data(), value.size()) == 0;
+    }
+    TSMLoc next_loc = TSMimeHdrFieldNextDup(bufp, hdr_loc, field_loc);
+    TSHandleMLocRelease(bufp, hdr_loc, field_loc);
+    field_loc = next_loc;
+  }
+  if (field_loc != TS_NULL_MLOC) {
+    TSHandleMLocRelease(bufp, hdr_loc, field_loc);
+  }
+  return found;
+}
+
+bool
+BypassRules::matchesQuery(TSMBuffer bufp, TSMLoc url_loc) const
+{
+  int len       = 0;
+  const char *p = TSUrlHttpQueryGet(bufp, url_loc, &len);
+  if (!p || len == 0) {
+    return false;
+  }
+  std::string_view query{p, static_cast<size_t>(len)};
+  while (!query.empty()) {
+    auto amp               = query.find('&');
+    std::string_view param = query.substr(0, amp);
+    std::string_view key   = param.substr(0, param.find('='));
+    for (const auto &k : query_keys) {
+      if (key == k) {
+        return true;
+      }
+    }
+    query.remove_prefix(amp == std::string_view::npos ? query.size() : amp + 1);
+  }
+  return false;
+}
+
+bool
+BypassRules::matchesSuffix(TSMBuffer bufp, TSMLoc url_loc) const
+{
+  int len       = 0;
+  const char *p = TSUrlPathGet(bufp, url_loc, &len);
+  if (!p || len == 0 || !suffix_last_bytes.test(static_cast<unsigned char>(p[len - 1]))) {
+    return false;
+  }
+  std::string_view path{p, static_cast<size_t>(len)};
+  for (const auto &suffix : suffixes) {
+    if (path.ends_with(suffix)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Tests the cheapest predicates first: the method is a pointer compare and
+// the path suffix usually stops at a bitmap test, while headers need a field
+// lookup each.
+bool
+BypassRules::matches(TSMBuffer bufp, TSMLoc hdr_loc, TSMLoc url_loc) const
+{
+  if ((methods != 0 || !other_methods.empty()) && matchesMethod(bufp, hdr_loc)) {
+    VDEBUG("method matches");
+    return true;
+  }
+  if (!suffixes.empty() && matchesSuffix(bufp, url_loc)) {
+    VDEBUG("path suffix matches");
+    return true;
+  }
+  if (!query_keys.empty() && matchesQuery(bufp, url_loc)) {
+    VDEBUG("query key matches");
+    return true;
+  }
+  for (const auto &pred : headers) {
+    if (matchesHeader(bufp, hdr_loc, pred)) {
+      VDEBUG("header %s matches", pred.name.c_str());
+      return true;
+    }
+  }
+  return false;
+}
+
+} // namespace
+
 TSReturnCode
 TSRemapInit([[maybe_unused]] TSRemapInterface *api_info, [[maybe_unused]] char *errbuf, [[maybe_unused]] int errbuf_size)
 {
@@ -66,7 +320,7 @@ TSRemapInit([[maybe_unused]] TSRemapInterface *api_info, [[maybe_unused]] char *
 }
 
 TSRemapStatus
-TSRemapDoRemap([[maybe_unused]] void *ih, TSHttpTxn rh, [[maybe_unused]] TSRemapRequestInfo *rri)
+TSRemapDoRemap(void *ih, TSHttpTxn rh, TSRemapRequestInfo *rri)
 {
   const TSHttpStatus txnstat = TSHttpTxnStatusGet(rh);
   if (txnstat != TS_HTTP_STATUS_NONE && txnstat != TS_HTTP_STATUS_OK) {
@@ -74,6 +328,11 @@ TSRemapDoRemap([[maybe_unused]] void *ih, TSHttpTxn rh, [[maybe_unused]] TSRemap
     return TSREMAP_NO_REMAP;
   }
 
+  const auto *rules = static_cast<const BypassRules *>(ih);
+  if (rules && !rules->matches(rri->requestBufp, rri->requestHdrp, rri->requestUrl)) {
+    return TSREMAP_NO_REMAP;
+  }
+
   // Disable cache lookup
   VDEBUG("disable cache lookup");
   TSHttpTxnConfigIntSet(rh, TS_CONFIG_HTTP_CACHE_HTTP, 0);
@@ -82,15 +341,83 @@ TSRemapDoRemap([[maybe_unused]] void *ih, TSHttpTxn rh, [[maybe_unused]] TSRemap
 }
 
 TSReturnCode
-TSRemapNewInstance([[maybe_unused]] int argc, [[maybe_unused]] char *argv[], [[maybe_unused]] void **ih,
-                   [[maybe_unused]] char *errbuf, [[maybe_unused]] int errbuf_size)
+TSRemapNewInstance(int argc, char *argv[], void **ih, [[maybe_unused]] char *errbuf, [[maybe_unused]] int errbuf_size)
 {
+  static const struct option longopt[] = {
+    {"method", required_argument, nullptr, 'm' },
+    {"header", required_argument, nullptr, 'h' },
+    {"query",  required_argument, nullptr, 'q' },
+    {"suffix", required_argument, nullptr, 's' },
+    {nullptr,  no_argument,       nullptr, '\0'}
+  };
+
   Dbg(dbg_ctl, "enter");
+  auto *rules = new BypassRules;
+
+  // argv contains the "to" and "from" URLs. Skip the first so that the
+  // second one poses as the program name.
+  --argc;
+  ++argv;
+  optind = 0;
+
+  while (true) {
+    int opt      = getopt_long(argc, (char *const *)argv, "m:h:q:s:", longopt, nullptr);
+    size_t items = 1;
+
+    switch (opt) {
+    case 'm': {
+      items = ForEachListItem(optarg, [rules](std::string_view method) { AddMethod(method, *rules); });
+    } break;
+    case 'h': {
+      if (!AddHeader(optarg, *rules)) {
+        VERROR("--header must be NAME or NAME:VALUE: %s\n", optarg);
+        delete rules;
+        return TS_ERROR;
+      }
+    } break;
+    case 'q': {
+      items = ForEachListItem(optarg, [rules](std::string_view key) { rules->query_keys.emplace_back(key); });
+    } break;
+    case 's': {
+      items = ForEachListItem(optarg, [rules](std::string_view suffix) {
+        rules->suffixes.emplace_back(suffix);
+        rules->suffix_last_bytes.set(static_cast<unsigned char>(suffix.back()));
+      });
+    } break;
+    case '?': {
+      // A mistyped option would otherwise leave the rule without predicates,
+      // and so bypass the cache for every request.
+      VERROR("unknown option or missing argument: %s\n", argv[std::min(optind, argc) - 1]);
+      delete rules;
+      return TS_ERROR;
+    } break;
+    }
+
+    // A list that names nothing, such as --query= or --method=",", adds no
+    // predicate either, and must not make the rule bypass every request.
+    if (items == 0) {
+      VERROR("option lists nothing: %s\n", argv[std::min(optind, argc) - 1]);
+      delete rules;
+      return TS_ERROR;
+    }
+    if (opt == -1) {
+      break;
+    }
+  }
+
+  // A rule without predicates bypasses the cache for every request, as
+  // this plugin always did.
+  if (rules->empty()) {
+    delete rules;
+    rules = nullptr;
+  }
+  *ih = rules;
   return TS_SUCCESS;
 }
 
 void
-TSRemapDeleteInstance([[maybe_unused]] void *ih)
+TSRemapDeleteInstance(void *ih)
 {
   Dbg(dbg_ctl, "enter");
+  delete static_cast<BypassRules *>(ih);
 }
@@ -0,0 +1,164 @@
+/**
+ * @file test_accept_encoding.cc
+ * @brief Unit tests and benchmarks for the Accept-Encoding scanner and
+ * normalizer of normalize_ae.
+ *
+ * The benchmarks are hidden; run them with: test_accept_encoding "[!benchmark]"
+ * They time the scanner alone. tools/bench_normalize_ae.sh compares the whole
+ * plugin with the tslua script it replaced, under load in traffic_server.
+ */
+
+#include <string>
+#include <string_view>
+#include <vector>
+#define CATCH_CONFIG_MAIN /* include main function */
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
+#include <catch.hpp> /* catch unit-test framework */
+#include "accept-encoding.h"
+
+namespace
+{
+// Scans the Accept-Encoding fields in values, as if each came in a field of
+// its own.
+AcceptedCodings
+scan(const std::vector<std::string_view> &values)
+{
+  AcceptedCodings accepted;
+  for (std::string_view value : values) {
+    ScanAcceptEncoding(value.data(), value.data() + value.size(), accepted);
+  }
+  return accepted;
+}
+
+std::string
+normalize(const NormalizePolicy &policy, const std::vector<std::string_view> &values)
+{
+  char out[MAX_NORMALIZED];
+  return std::string{policy.normalize(scan(values), out)};
+}
+
+NormalizePolicy
+atsMode(int mode)
+{
+  NormalizePolicy policy;
+  REQUIRE(ApplyAtsMode(mode, policy));
+  return policy;
+}
+} // namespace
+
+TEST_CASE("ScanAcceptEncoding: codings without q-values are fully accepted", "[accept_encoding]")
+{
+  AcceptedCodings accepted = scan({"gzip, deflate, br"});
+  CHECK(accepted.qualityOf(CODING_GZIP) == 1000);
+  CHECK(accepted.qualityOf(CODING_BR) == 1000);
+  CHECK(accepted.qualityOf(CODING_ZSTD) == 0);
+  CHECK(accepted.qualityOf(CODING_IDENTITY) == 1000);
+}
+
+TEST_CASE("ScanAcceptEncoding: parses q-values", "[accept_encoding]")
+{
+  AcceptedCodings accepted = scan({"br;q=0.5, gzip ; Q=1.0, zstd;level=3;q=0.125, identity;q=0"});
+  CHECK(accepted.qualityOf(CODING_BR) == 500);
+  CHECK(accepted.qualityOf(CODING_GZIP) == 1000);
+  CHECK(accepted.qualityOf(CODING_ZSTD) == 125);
+  CHECK(accepted.qualityOf(CODING_IDENTITY) == 0);
+}
+
+TEST_CASE("ScanAcceptEncoding: malformed q-values refuse the coding", "[accept_encoding]")
+{
+  for (std::string_view value : {"gzip;q=", "gzip;q=2", "gzip;q=1.5", "gzip;q=0.1234", "gzip;q=.5", "gzip;q=0.x"}) {
+    CAPTURE(value);
+    CHECK(scan({value}).qualityOf(CODING_GZIP) == 0);
+  }
+}
+
+TEST_CASE("ScanAcceptEncoding: '*' covers the codings not listed", "[accept_encoding]")
+{
+  AcceptedCodings accepted = scan({"br;q=0, *;q=0.3"});
+  CHECK(accepted.qualityOf(CODING_BR) == 0);
+  CHECK(accepted.qualityOf(CODING_GZIP) == 300);
+  CHECK(accepted.qualityOf(CODING_IDENTITY) == 300);
+
+  CHECK(scan({"*;q=0"}).qualityOf(CODING_IDENTITY) == 0);
+}
+
+TEST_CASE("ScanAcceptEncoding: x-gzip and upper case are gzip", "[accept_encoding]")
+{
+  CHECK(scan({"x-gzip"}).qualityOf(CODING_GZIP) == 1000);
+  CHECK(scan({"X-GZIP;q=0.2"}).qualityOf(CODING_GZIP) == 200);
+  CHECK(scan({"GZip"}).qualityOf(CODING_GZIP) == 1000);
+  CHECK(scan({"gzipx, xgzip, x-gzi"}).qualityOf(CODING_GZIP) == 0);
+}
+
+TEST_CASE("ScanAcceptEncoding: duplicate fields make up one list", "[accept_encoding]")
+{
+  AcceptedCodings accepted = scan({"gzip;q=0.8", " , br", "identity;q=0"});
+  CHECK(accepted.qualityOf(CODING_GZIP) == 800);
+  CHECK(accepted.qualityOf(CODING_BR) == 1000);
+  CHECK(accepted.qualityOf(CODING_IDENTITY) == 0);
+
+  // A later element for the same coding wins, across fields too.
+  CHECK(scan({"gzip", "gzip;q=0"}).qualityOf(CODING_GZIP) == 0);
+}
+
+TEST_CASE("NormalizePolicy: picks the most preferred accepted coding", "[accept_encoding]")
+{
+  NormalizePolicy policy;
+  CHECK(normalize(policy, {"gzip, br"}) == "br");
+  CHECK(normalize(policy, {"br;q=0, gzip"}) == "gzip");
+  CHECK(normalize(policy, {"deflate"}).empty());
+  CHECK(normalize(policy, {"*"}) == "br");
+}
+
+TEST_CASE("NormalizePolicy: ats-mode presets", "[accept_encoding]")
+{
+  const std::vector<std::string_view> all = {"gzip, br, zstd"};
+  CHECK(normalize(atsMode(1), all) == "gzip");
+  CHECK(normalize(atsMode(1), {"br"}).empty());
+  CHECK(normalize(atsMode(2), all) == "br");
+  CHECK(normalize(atsMode(3), all) == "br, gzip");
+  CHECK(normalize(atsMode(4), all) == "zstd");
+  CHECK(normalize(atsMode(5), all) == "zstd, br, gzip");
+  CHECK(normalize(atsMode(5), {"gzip", "zstd"}) == "zstd, gzip");
+
+  NormalizePolicy policy;
+  CHECK_FALSE(ApplyAtsMode(0, policy));
+  CHECK_FALSE(ApplyAtsMode(6, policy));
+}
+
+TEST_CASE("NormalizePolicy: the longest combined value fits MAX_NORMALIZED", "[accept_encoding]")
+{
+  NormalizePolicy policy;
+  REQUIRE(ParseCodings("zstd,br,gzip,identity", policy.codings));
+  policy.combine = true;
+  std::string value = normalize(policy, {"*"});
+  CHECK(value == "zstd, br, gzip, identity");
+  CHECK(value.size() == MAX_NORMALIZED);
+}
+
+TEST_CASE("ParseCodings: accepts each known coding once", "[accept_encoding]")
+{
+  std::vector<Coding> codings;
+  REQUIRE(ParseCodings("identity,GZIP", codings));
+  CHECK(codings == std::vector<Coding>{CODING_IDENTITY, CODING_GZIP});
+
+  for (std::string_view list : {"", ",gzip", "deflate", "*", "x-gzip", "X-Gzip", "identity,identity,identity", "br,gzip,br"}) {
+    CAPTURE(list);
+    CHECK_FALSE(ParseCodings(list, codings));
+  }
+}
+
+TEST_CASE("ScanAcceptEncoding: typical browser values", "[accept_encoding][!benchmark]")
+{
+  NormalizePolicy policy;
+  char out[MAX_NORMALIZED];
+
+  BENCHMARK("gzip, deflate, br, zstd")
+  {
+    return policy.normalize(scan({"gzip, deflate, br, zstd"}), out).size();
+  };
+  BENCHMARK("q-values and '*'")
+  {
+    return policy.normalize(scan({"br;q=1.0, gzip;q=0.8, identity;q=0.1, *;q=0"}), out).size();
+  };
+}
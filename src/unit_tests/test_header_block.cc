@@ -0,0 +1,268 @@
+/**
+ * @file test_header_block.cc
+ * @brief Unit tests and benchmarks for HeaderBlock of header-block.h, run
+ * against the mock MIME API of ts_mime_mock.h.
+ *
+ * The benchmarks are hidden; run them with: test_header_block "[!benchmark]"
+ */
+
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#define CATCH_CONFIG_MAIN /* include main function */
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
+#include <catch.hpp> /* catch unit-test framework */
+#include "ts_mime_mock.h"
+#include "header-block.h"
+
+namespace
+{
+constexpr int N_THREADS          = 4;
+constexpr int APPENDS_PER_THREAD = 2000;
+
+// The block add_header builds from "X-Cache-Tag:edge X-Req:%{req-id} X-Flag".
+HeaderBlock
+addHeaderBlock()
+{
+  HeaderBlock block;
+  REQUIRE(block.add("X-Cache-Tag", "edge").empty());
+  REQUIRE(block.add("X-Req", "%{req-id}").empty());
+  REQUIRE(block.add("X-Flag", {}).empty());
+  return block;
+}
+
+// Appends block to a fresh header count times, the way add_header's request
+// hook does once per transaction, holding lock around each append if given.
+// Returns how many appends did not produce the expected fields.
+int
+appendMany(const HeaderBlock &block, int count, uint64_t first_id, std::mutex *lock = nullptr)
+{
+  MockHeader hdr;
+  MockTxn txn;
+  int failures = 0;
+
+  for (int i = 0; i < count; ++i) {
+    hdr.clear();
+    txn.id = first_id + i;
+    TSReturnCode rc;
+    if (lock) {
+      std::lock_guard<std::mutex> guard(*lock);
+      rc = block.appendTo({txn.txn(), nullptr, hdr.loc()});
+    } else {
+      rc = block.appendTo({txn.txn(), nullptr, hdr.loc()});
+    }
+    if (rc != TS_SUCCESS || hdr.fields.size() != 3 || hdr.value("X-Cache-Tag") != "edge" ||
+        hdr.value("X-Req") != std::to_string(txn.id) || hdr.open_handles != 0) {
+      ++failures;
+    }
+  }
+  return failures;
+}
+
+// Appends the fields of tmpl to hdr the way add_header did before
+// HeaderBlock: walk a template header, create a field in the target for each
+// one, copy it over and append it.
+TSReturnCode
+appendByCopy(MockHeader &tmpl, MockHeader &hdr)
+{
+  TSMLoc field_loc = TSMimeHdrFieldGet(nullptr, tmpl.loc(), 0);
+  while (field_loc) {
+    TSMLoc new_field_loc;
+    if (TSMimeHdrFieldCreate(nullptr, hdr.loc(), &new_field_loc) != TS_SUCCESS ||
+        TSMimeHdrFieldCopy(nullptr, hdr.loc(), new_field_loc, nullptr, tmpl.loc(), field_loc) != TS_SUCCESS ||
+        TSMimeHdrFieldAppend(nullptr, hdr.loc(), new_field_loc) != TS_SUCCESS) {
+      TSHandleMLocRelease(nullptr, tmpl.loc(), field_loc);
+      return TS_ERROR;
+    }
+    TSHandleMLocRelease(nullptr, hdr.loc(), new_field_loc);
+
+    TSMLoc next_field_loc = TSMimeHdrFieldNext(nullptr, tmpl.loc(), field_loc);
+    TSHandleMLocRelease(nullptr, tmpl.loc(), field_loc);
+    field_loc = next_field_loc;
+  }
+  return TS_SUCCESS;
+}
+
+// Runs appendMany on N_THREADS threads sharing block and returns the total
+// number of failures.
+int
+appendOnThreads(const HeaderBlock &block, std::mutex *lock = nullptr)
+{
+  std::vector<std::thread> threads;
+  std::vector<int> failures(N_THREADS);
+  for (int t = 0; t < N_THREADS; ++t) {
+    threads.emplace_back([&, t] { failures[t] = appendMany(block, APPENDS_PER_THREAD, uint64_t(t) << 32, lock); });
+  }
+  int total = 0;
+  for (int t = 0; t < N_THREADS; ++t) {
+    threads[t].join();
+    total += failures[t];
+  }
+  return total;
+}
+} // namespace
+
+TEST_CASE("HeaderBlock: add rejects values that do not compile", "[header_block]")
+{
+  HeaderBlock block;
+  CHECK(block.add("X-A", "%{no-such-var}") == "unknown variable %{no-such-var}");
+  CHECK(block.add("X-A", "%{req-id") == "unterminated variable");
+  CHECK(block.empty());
+}
+
+TEST_CASE("HeaderBlock: appendTo appends every field in order", "[header_block]")
+{
+  HeaderBlock block;
+  REQUIRE(block.add("X-First", "1").empty());
+  REQUIRE(block.add("X-Dup", "a").empty());
+  REQUIRE(block.add("X-Dup", "b").empty());
+  REQUIRE(block.size() == 3);
+  CHECK(block.name(1) == "X-Dup");
+
+  MockHeader hdr;
+  MockTxn txn;
+  REQUIRE(block.appendTo({txn.txn(), nullptr, hdr.loc()}) == TS_SUCCESS);
+  REQUIRE(hdr.fields.size() == 3);
+  CHECK(hdr.fields[0]->name == "X-First");
+  CHECK(hdr.fields[0]->value == "1");
+  CHECK(hdr.fields[1]->value == "a");
+  CHECK(hdr.fields[2]->value == "b");
+  CHECK(hdr.open_handles == 0);
+}
+
+TEST_CASE("HeaderBlock: an empty value appends a field without setting a value", "[header_block]")
+{
+  HeaderBlock block;
+  REQUIRE(block.add("X-Flag", {}).empty());
+
+  MockHeader hdr;
+  MockTxn txn;
+  REQUIRE(block.appendTo({txn.txn(), nullptr, hdr.loc()}) == TS_SUCCESS);
+  REQUIRE(hdr.fields.size() == 1);
+  CHECK(hdr.fields[0]->name == "X-Flag");
+  CHECK_FALSE(hdr.fields[0]->has_value);
+}
+
+TEST_CASE("HeaderBlock: renders the transaction variables", "[header_block]")
+{
+  HeaderBlock block;
+  REQUIRE(block.add("X-Req", "id-%{req-id}").empty());
+  REQUIRE(block.add("X-Client", "%{client-ip}").empty());
+  REQUIRE(block.add("X-Path", "%{path-hash}").empty());
+
+  MockHeader hdr;
+  MockTxn txn;
+  hdr.path = "a";
+  txn.id   = 18446744073709551615u;
+  txn.setClient(AF_INET6, "2001:db8::1");
+  REQUIRE(block.appendTo({txn.txn(), nullptr, hdr.loc()}) == TS_SUCCESS);
+  CHECK(hdr.value("X-Req") == "id-18446744073709551615");
+  CHECK(hdr.value("X-Client") == "2001:db8::1");
+  CHECK(hdr.value("X-Path") == "af63dc4c8601ec8c"); // FNV-1a of "a"
+  CHECK(hdr.url_lookups == 1);
+  CHECK(hdr.open_handles == 0);
+
+  hdr.clear();
+  txn.setClient(AF_INET, "192.0.2.7");
+  REQUIRE(block.appendTo({txn.txn(), nullptr, hdr.loc(), hdr.loc()}) == TS_SUCCESS);
+  CHECK(hdr.value("X-Client") == "192.0.2.7");
+  CHECK(hdr.url_lookups == 0); // the caller's URL is used as given
+}
+
+TEST_CASE("HeaderBlock: appendTo stops at the first field the API refuses", "[header_block]")
+{
+  HeaderBlock block;
+  REQUIRE(block.add("X-A", "1").empty());
+  REQUIRE(block.add("X-B", "2").empty());
+  REQUIRE(block.add("X-C", "3").empty());
+
+  MockHeader hdr;
+  MockTxn txn;
+  hdr.refuse_after = 1;
+  CHECK(block.appendTo({txn.txn(), nullptr, hdr.loc()}) == TS_ERROR);
+  CHECK(hdr.fields.size() == 1);
+  CHECK(hdr.open_handles == 0);
+}
+
+TEST_CASE("HeaderBlock: appendTo is safe from many threads without a lock", "[header_block][threads]")
+{
+  // add_header's hook runs on every net thread at once with no continuation
+  // mutex, so appendTo must only read the shared block.
+  const HeaderBlock block = addHeaderBlock();
+  CHECK(appendOnThreads(block) == 0);
+}
+
+TEST_CASE("HeaderBlock: appendTo once per transaction", "[header_block][!benchmark]")
+{
+  HeaderBlock literals;
+  HeaderBlock variables;
+  for (const char *name : {"X-A", "X-B", "X-C", "X-D"}) {
+    REQUIRE(literals.add(name, "some-fixed-value").empty());
+  }
+  REQUIRE(variables.add("X-Req", "%{req-id}").empty());
+  REQUIRE(variables.add("X-Client", "%{client-ip}").empty());
+  REQUIRE(variables.add("X-Path", "%{path-hash}").empty());
+  REQUIRE(variables.add("X-Tag", "edge").empty());
+
+  MockHeader hdr;
+  MockTxn txn;
+  hdr.path = "/images/2024/banner.png";
+  txn.setClient(AF_INET, "192.0.2.7");
+
+  BENCHMARK("4 literal fields")
+  {
+    hdr.clear();
+    return literals.appendTo({txn.txn(), nullptr, hdr.loc()});
+  };
+  BENCHMARK("3 variable fields and 1 literal")
+  {
+    hdr.clear();
+    ++txn.id;
+    return variables.appendTo({txn.txn(), nullptr, hdr.loc()});
+  };
+}
+
+TEST_CASE("HeaderBlock: appendTo against copying from a template header", "[header_block][!benchmark]")
+{
+  HeaderBlock block;
+  MockHeader tmpl;
+  for (const char *name : {"X-A", "X-B", "X-C", "X-D"}) {
+    REQUIRE(block.add(name, "some-fixed-value").empty());
+    tmpl.created.push_back({name, "some-fixed-value", true});
+    tmpl.fields.push_back(&tmpl.created.back());
+  }
+
+  MockHeader hdr;
+  MockTxn txn;
+  REQUIRE(appendByCopy(tmpl, hdr) == TS_SUCCESS);
+  REQUIRE(hdr.fields.size() == 4);
+  REQUIRE(hdr.open_handles == 0);
+  REQUIRE(tmpl.open_handles == 0);
+
+  BENCHMARK("template header: get, create, copy, append, next")
+  {
+    hdr.clear();
+    return appendByCopy(tmpl, hdr);
+  };
+  BENCHMARK("HeaderBlock: create named, set value, append")
+  {
+    hdr.clear();
+    return block.appendTo({txn.txn(), nullptr, hdr.loc()});
+  };
+}
+
+TEST_CASE("HeaderBlock: concurrent appends, with and without a global lock", "[header_block][!benchmark]")
+{
+  const HeaderBlock block = addHeaderBlock();
+  std::mutex lock;
+
+  BENCHMARK("shared block, no lock")
+  {
+    return appendOnThreads(block);
+  };
+  BENCHMARK("shared block, behind one mutex")
+  {
+    return appendOnThreads(block, &lock);
+  };
+}
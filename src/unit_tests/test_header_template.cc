@@ -0,0 +1,105 @@
+/**
+ * @file test_header_template.cc
+ * @brief Unit tests for HeaderTemplate of header-template.h, run against the
+ * mock transaction API of ts_mime_mock.h.
+ */
+
+#include <string>
+#include <string_view>
+#define CATCH_CONFIG_MAIN /* include main function */
+#include <catch.hpp>      /* catch unit-test framework */
+#include "ts_mime_mock.h"
+#include "header-template.h"
+
+namespace
+{
+struct Rendered {
+  char buf[HeaderTemplate::MAX_SIZE];
+  std::string_view value;
+
+  bool
+  inBuffer() const
+  {
+    return value.data() >= buf && value.data() < buf + sizeof(buf);
+  }
+};
+
+void
+render(const HeaderTemplate &tmpl, Rendered &out, uint64_t id = 0)
+{
+  MockHeader hdr;
+  MockTxn txn;
+  txn.id    = id;
+  out.value = tmpl.render({txn.txn(), nullptr, hdr.loc()}, out.buf);
+}
+} // namespace
+
+TEST_CASE("HeaderTemplate: a value without variables renders to itself", "[header_template]")
+{
+  HeaderTemplate tmpl;
+  REQUIRE(tmpl.compile("max-age=60, public").empty());
+  CHECK(tmpl.isLiteral());
+
+  Rendered out;
+  render(tmpl, out);
+  CHECK(out.value == "max-age=60, public");
+  CHECK_FALSE(out.inBuffer());
+}
+
+TEST_CASE("HeaderTemplate: literals longer than MAX_SIZE are accepted", "[header_template]")
+{
+  const std::string policy(3 * HeaderTemplate::MAX_SIZE, 'x');
+
+  HeaderTemplate tmpl;
+  REQUIRE(tmpl.compile(policy).empty());
+  Rendered out;
+  render(tmpl, out);
+  CHECK(out.value == policy);
+
+  HeaderTemplate tagged;
+  REQUIRE(tagged.compile("%{remap-tag}", policy).empty());
+  render(tagged, out);
+  CHECK(out.value == policy);
+}
+
+TEST_CASE("HeaderTemplate: values with variables are limited to MAX_SIZE", "[header_template]")
+{
+  HeaderTemplate tmpl;
+  CHECK_FALSE(tmpl.compile(std::string(HeaderTemplate::MAX_SIZE, 'x') + "%{req-id}").empty());
+  CHECK(tmpl.compile(std::string(HeaderTemplate::MAX_SIZE - 20, 'x') + "%{req-id}").empty());
+}
+
+TEST_CASE("HeaderTemplate: renders variables between literals", "[header_template]")
+{
+  HeaderTemplate tmpl;
+  REQUIRE(tmpl.compile("a=%{req-id};b").empty());
+  CHECK_FALSE(tmpl.isLiteral());
+
+  Rendered out;
+  render(tmpl, out, 42);
+  CHECK(out.value == "a=42;b");
+  CHECK(out.inBuffer());
+}
+
+TEST_CASE("HeaderTemplate: %{%} writes a literal '%'", "[header_template]")
+{
+  HeaderTemplate tmpl;
+  Rendered out;
+
+  REQUIRE(tmpl.compile("%{%}{req-id}").empty());
+  CHECK(tmpl.isLiteral());
+  render(tmpl, out, 7);
+  CHECK(out.value == "%{req-id}");
+
+  REQUIRE(tmpl.compile("100%, %{%}{%{req-id}}").empty());
+  render(tmpl, out, 7);
+  CHECK(out.value == "100%, %{7}");
+}
+
+TEST_CASE("HeaderTemplate: rejects malformed variables", "[header_template]")
+{
+  HeaderTemplate tmpl;
+  CHECK(tmpl.compile("%{req-id") == "unterminated variable");
+  CHECK(tmpl.compile("%{nope}") == "unknown variable %{nope}");
+  CHECK(tmpl.compile("%{remap-tag}") == "remap-tag is only available in remap rules");
+}
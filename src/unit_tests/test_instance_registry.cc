@@ -0,0 +1,91 @@
+/**
+ * @file test_instance_registry.cc
+ * @brief Unit tests for InstanceRegistry of instance-registry.h
+ */
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#define CATCH_CONFIG_MAIN /* include main function */
+#include <catch.hpp>      /* catch unit-test framework */
+#include "instance-registry.h"
+
+namespace
+{
+struct Instance {
+  explicit Instance(int v, int *destroyed = nullptr) : value(v), destroyed_(destroyed) {}
+  ~Instance()
+  {
+    if (destroyed_) {
+      ++*destroyed_;
+    }
+  }
+
+  int value;
+
+private:
+  int *destroyed_;
+};
+} // namespace
+
+TEST_CASE("InstanceRegistry: forEach visits the registered instances in order", "[instance_registry]")
+{
+  InstanceRegistry<Instance> registry;
+  registry.add(std::make_shared<Instance>(1));
+  Instance *second = registry.add(std::make_shared<Instance>(2));
+  registry.add(std::make_shared<Instance>(3));
+  REQUIRE(registry.size() == 3);
+
+  registry.remove(second);
+  std::vector<int> seen;
+  registry.forEach([&](const Instance &instance) { seen.push_back(instance.value); });
+  CHECK(seen == std::vector<int>{1, 3});
+}
+
+TEST_CASE("InstanceRegistry: a removed instance lives until the last snapshot is released", "[instance_registry]")
+{
+  InstanceRegistry<Instance> registry;
+  int destroyed      = 0;
+  Instance *instance = registry.add(std::make_shared<Instance>(7, &destroyed));
+
+  auto snapshot = registry.snapshot();
+  registry.remove(instance);
+  CHECK(registry.size() == 0);
+  CHECK(destroyed == 0);
+  REQUIRE(snapshot->size() == 1);
+  CHECK(snapshot->front()->value == 7);
+
+  snapshot.reset();
+  CHECK(destroyed == 1);
+}
+
+TEST_CASE("InstanceRegistry: readers see whole lists while writers add and remove", "[instance_registry][threads]")
+{
+  InstanceRegistry<Instance> registry;
+  registry.add(std::make_shared<Instance>(0));
+  std::atomic<bool> done{false};
+  std::atomic<int> bad{0};
+
+  std::thread reader([&] {
+    while (!done.load()) {
+      int count = 0;
+      int first = -1;
+      registry.forEach([&](const Instance &instance) {
+        if (count++ == 0) {
+          first = instance.value;
+        }
+      });
+      if (count < 1 || count > 2 || first != 0) {
+        ++bad;
+      }
+    }
+  });
+  for (int i = 1; i <= 2000; ++i) {
+    registry.remove(registry.add(std::make_shared<Instance>(i)));
+  }
+  done = true;
+  reader.join();
+  CHECK(bad == 0);
+  CHECK(registry.size() == 1);
+}
@@ -0,0 +1,141 @@
+/**
+ * @file test_lmdb_codecs.cc
+ * @brief Unit tests for the typed key/value codecs of lmdb-cpp.h
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string_view>
+#include <vector>
+#define CATCH_CONFIG_MAIN /* include main function */
+#include <catch.hpp>      /* catch unit-test framework */
+#include "lmdb-cpp.h"
+
+using namespace LMDB;
+
+namespace
+{
+// Compares encoded keys the way LMDB's default comparison does.
+template <typename E>
+int
+compareKeys(const E &a, const E &b)
+{
+  ByteSpan x = a, y = b;
+  int c      = std::memcmp(x.data(), y.data(), std::min(x.size(), y.size()));
+  return c != 0 ? c : static_cast<int>(x.size()) - static_cast<int>(y.size());
+}
+
+struct Record {
+  uint32_t id;
+  uint16_t flags;
+  uint16_t weight;
+};
+} // namespace
+
+TEST_CASE("BigEndian: round-trips unsigned extremes", "[lmdb][codec]")
+{
+  using C = BigEndian<uint32_t>;
+  for (uint32_t v : {0u, 1u, 0xffu, 0x100u, 0x12345678u, std::numeric_limits<uint32_t>::max()}) {
+    CHECK(C::decode(C::encode(v)) == v);
+  }
+}
+
+TEST_CASE("BigEndian: round-trips signed extremes", "[lmdb][codec]")
+{
+  using C      = BigEndian<int64_t>;
+  using limits = std::numeric_limits<int64_t>;
+  for (int64_t v : {limits::min(), int64_t{-1}, int64_t{0}, int64_t{1}, limits::max()}) {
+    CHECK(C::decode(C::encode(v)) == v);
+  }
+}
+
+TEST_CASE("BigEndian: stores the most significant byte first", "[lmdb][codec]")
+{
+  auto bytes = BigEndian<uint32_t>::encode(0x01020304u);
+  CHECK(bytes[0] == std::byte{0x01});
+  CHECK(bytes[3] == std::byte{0x04});
+}
+
+TEST_CASE("BigEndian: byte order matches numeric order, negatives first", "[lmdb][codec]")
+{
+  using C                      = BigEndian<int32_t>;
+  const std::vector<int32_t> v = {
+    std::numeric_limits<int32_t>::min(), -65536, -1, 0, 1, 255, 256, std::numeric_limits<int32_t>::max(),
+  };
+  for (size_t i = 1; i < v.size(); ++i) {
+    CHECK(compareKeys(C::encode(v[i - 1]), C::encode(v[i])) < 0);
+  }
+}
+
+TEST_CASE("BigEndian: rejects stored values of the wrong size", "[lmdb][codec]")
+{
+  const std::byte short_value[3] = {};
+  CHECK_THROWS_AS(BigEndian<uint32_t>::decode(ByteSpan{short_value}), CodecError);
+}
+
+TEST_CASE("String: round-trips bytes, including empty and embedded NUL", "[lmdb][codec]")
+{
+  for (std::string_view v : {std::string_view{}, std::string_view{"user1"}, std::string_view{"a\0b", 3}}) {
+    CHECK(String::decode(String::encode(v)) == v);
+  }
+}
+
+TEST_CASE("Trivial: round-trips a struct", "[lmdb][codec]")
+{
+  Record r{42, 7, 9};
+  Record d = Trivial<Record>::decode(Trivial<Record>::encode(r));
+  CHECK(d.id == 42);
+  CHECK(d.flags == 7);
+  CHECK(d.weight == 9);
+}
+
+TEST_CASE("Trivial: view() returns the value in place only when aligned", "[lmdb][codec]")
+{
+  alignas(Record) std::byte storage[sizeof(Record) + alignof(Record)];
+  Record r{1, 2, 3};
+  std::memcpy(storage, &r, sizeof(r));
+
+  const Record *aligned = Trivial<Record>::view(ByteSpan{storage, sizeof(Record)});
+  REQUIRE(aligned != nullptr);
+  CHECK(aligned->id == 1);
+  CHECK(static_cast<const void *>(aligned) == static_cast<const void *>(storage));
+
+  // LMDB only promises 2-byte alignment, so a 4-byte aligned struct may not be
+  // viewable in place; decode() still works.
+  std::memcpy(storage + 2, &r, sizeof(r));
+  CHECK(Trivial<Record>::view(ByteSpan{storage + 2, sizeof(Record)}) == nullptr);
+  CHECK(Trivial<Record>::decode(ByteSpan{storage + 2, sizeof(Record)}).weight == 3);
+}
+
+TEST_CASE("Trivial: rejects stored values of the wrong size", "[lmdb][codec]")
+{
+  const std::byte bytes[sizeof(Record) + 1] = {};
+  CHECK_THROWS_AS(Trivial<Record>::decode(ByteSpan{bytes}), CodecError);
+  CHECK_THROWS_AS(Trivial<Record>::view(ByteSpan{bytes}), CodecError);
+}
+
+TEST_CASE("Tuple: round-trips a composite key", "[lmdb][codec]")
+{
+  using C = Tuple<BigEndian<uint32_t>, BigEndian<int16_t>, BigEndian<uint64_t>>;
+  static_assert(C::fixed_size == 4 + 2 + 8);
+  C::value_type v{0xdeadbeefu, int16_t{-2}, uint64_t{1} << 40};
+  CHECK(C::decode(C::encode(v)) == v);
+}
+
+TEST_CASE("Tuple: sorts by the first element, then the next", "[lmdb][codec]")
+{
+  using C = Tuple<BigEndian<uint16_t>, BigEndian<int32_t>>;
+  CHECK(compareKeys(C::encode({1, 1000}), C::encode({2, -1000})) < 0);
+  CHECK(compareKeys(C::encode({2, -1000}), C::encode({2, -999})) < 0);
+  CHECK(compareKeys(C::encode({2, -1}), C::encode({2, 0})) < 0);
+  CHECK(compareKeys(C::encode({3, 5}), C::encode({3, 5})) == 0);
+}
+
+TEST_CASE("Tuple: rejects stored keys of the wrong size", "[lmdb][codec]")
+{
+  using C                  = Tuple<BigEndian<uint16_t>, BigEndian<uint16_t>>;
+  const std::byte bytes[3] = {};
+  CHECK_THROWS_AS(C::decode(ByteSpan{bytes}), CodecError);
+}
@@ -0,0 +1,112 @@
+/**
+ * @file test_log_linear_buckets.cc
+ * @brief Unit tests for the histogram bucket layout of log-linear-buckets.h,
+ * as used by txn-latency.h
+ */
+
+#include <cstdint>
+#include <vector>
+#define CATCH_CONFIG_MAIN /* include main function */
+#include <catch.hpp>      /* catch unit-test framework */
+#include "log-linear-buckets.h"
+
+namespace
+{
+using Fine   = LogLinearBuckets<7, 22>;
+using Coarse = LogLinearBuckets<2, 22>;
+
+// The smallest value that falls into bucket.
+template <typename L>
+uint64_t
+lowerOf(size_t bucket)
+{
+  return bucket == 0 ? 0 : L::upperOf(bucket - 1) + 1;
+}
+
+template <typename L>
+void
+checkLayout()
+{
+  // Every value up to 2^17 lands in a bucket whose bounds hold it, and
+  // buckets follow value order with no gaps.
+  size_t previous = 0;
+  for (uint64_t v = 0; v < (uint64_t{1} << 17); ++v) {
+    size_t b = L::bucketOf(v);
+    REQUIRE(b < L::N_BUCKETS);
+    REQUIRE(L::upperOf(b) >= v);
+    REQUIRE(lowerOf<L>(b) <= v);
+    REQUIRE((b == previous || b == previous + 1));
+    previous = b;
+  }
+
+  // Every bucket but the last holds its own bounds, and spans at most
+  // 2^-SUB_BITS of its lower bound.
+  for (size_t b = 0; b < L::LAST; ++b) {
+    uint64_t lower = lowerOf<L>(b);
+    uint64_t upper = L::upperOf(b);
+    REQUIRE(L::bucketOf(lower) == b);
+    REQUIRE(L::bucketOf(upper) == b);
+    REQUIRE(upper >= lower);
+    REQUIRE((upper - lower + 1) * L::SUB_BUCKETS <= (lower < L::SUB_BUCKETS ? L::SUB_BUCKETS : lower));
+  }
+}
+} // namespace
+
+TEST_CASE("LogLinearBuckets: 2 significant bits, the exported layout", "[log_linear_buckets]")
+{
+  checkLayout<Coarse>();
+  CHECK(Coarse::N_BUCKETS == 89);
+  CHECK(Coarse::bucketOf(3) == 3);
+  CHECK(Coarse::bucketOf(4) == 4);
+  CHECK(Coarse::upperOf(4) == 4);
+  CHECK(Coarse::upperOf(8) == 9); // 8-9, then 10-11, 12-13, 14-15
+  CHECK(Coarse::bucketOf(15) == 11);
+  CHECK(Coarse::bucketOf(16) == 12);
+}
+
+TEST_CASE("LogLinearBuckets: 7 significant bits, the recorded layout", "[log_linear_buckets]")
+{
+  checkLayout<Fine>();
+  CHECK(Fine::bucketOf(127) == 127);
+  CHECK(Fine::bucketOf(128) == 128);
+  CHECK(Fine::upperOf(256) == 257);
+  CHECK(Fine::upperOf(Fine::bucketOf(1000000)) - 1000000 < 1000000 / 100);
+}
+
+TEST_CASE("LogLinearBuckets: the last bucket takes everything from 2^(MAX_MAGNITUDE + 1)", "[log_linear_buckets]")
+{
+  const uint64_t top = uint64_t{1} << 23;
+  CHECK(Fine::bucketOf(top - 1) == Fine::LAST - 1);
+  CHECK(Fine::upperOf(Fine::LAST - 1) == top - 1);
+  CHECK(Fine::bucketOf(top) == Fine::LAST);
+  CHECK(Fine::bucketOf(UINT64_MAX) == Fine::LAST);
+  CHECK(Fine::upperOf(Fine::LAST) == UINT64_MAX);
+  CHECK(Coarse::bucketOf(top - 1) == Coarse::LAST - 1);
+  CHECK(Coarse::bucketOf(top) == Coarse::LAST);
+}
+
+TEST_CASE("LogLinearBuckets: fine buckets nest in coarse ones", "[log_linear_buckets]")
+{
+  for (size_t b = 0; b < Fine::N_BUCKETS; ++b) {
+    CAPTURE(b);
+    REQUIRE(Coarse::bucketOf(lowerOf<Fine>(b)) == Coarse::bucketOf(Fine::upperOf(b)));
+  }
+}
+
+TEST_CASE("LogLinearBuckets: percentile reads the bucket of the ranked sample", "[log_linear_buckets]")
+{
+  std::vector<uint64_t> counts(Fine::N_BUCKETS);
+  CHECK(Fine::percentile(counts.data(), 0, 500) == 0);
+
+  // 1..1000us, one sample each.
+  for (uint64_t us = 1; us <= 1000; ++us) {
+    counts[Fine::bucketOf(us)]++;
+  }
+  CHECK(Fine::percentile(counts.data(), 1000, 500) == 501); // 500 is in the bucket 500-501
+  CHECK(Fine::percentile(counts.data(), 1000, 990) == 991);
+  CHECK(Fine::percentile(counts.data(), 1000, 999) == 999);
+  CHECK(Fine::percentile(counts.data(), 1000, 1000) == 1003);
+
+  counts[Fine::LAST] += 1000;
+  CHECK(Fine::percentile(counts.data(), 2000, 999) == UINT64_MAX);
+}
@@ -0,0 +1,125 @@
+/**
+ * @file test_radix_trie.cc
+ * @brief Unit tests for RadixTrie of radix-trie.h
+ */
+
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#define CATCH_CONFIG_MAIN /* include main function */
+#include <catch.hpp>      /* catch unit-test framework */
+#include "radix-trie.h"
+
+namespace
+{
+using Prefixes = std::vector<std::pair<size_t, int>>;
+
+Prefixes
+prefixesOf(const RadixTrie<int> &trie, std::string_view key)
+{
+  Prefixes found;
+  trie.forEachPrefix(key, [&](size_t length, int value) {
+    found.emplace_back(length, value);
+    return true;
+  });
+  return found;
+}
+} // namespace
+
+TEST_CASE("RadixTrie: operator[] creates default values once", "[radix_trie]")
+{
+  RadixTrie<int> trie;
+  CHECK(trie.empty());
+  CHECK(trie["abc"] == 0);
+  trie["abc"] = 5;
+  CHECK(trie["abc"] == 5);
+  CHECK_FALSE(trie.empty());
+}
+
+TEST_CASE("RadixTrie: splitting an edge keeps both keys", "[radix_trie]")
+{
+  RadixTrie<int> trie;
+  trie["romane"]  = 1;
+  trie["romanus"] = 2; // splits "romane" at "roman"
+  trie["rom"]     = 3; // splits "roman" at "rom", with a value on the split
+  trie["rubens"]  = 4; // splits at "r"
+
+  CHECK(trie["romane"] == 1);
+  CHECK(trie["romanus"] == 2);
+  CHECK(trie["rom"] == 3);
+  CHECK(trie["rubens"] == 4);
+
+  size_t matched = 0;
+  CHECK(trie.longestPrefix("roman", matched) != nullptr); // "rom"
+  CHECK(matched == 3);
+  CHECK(trie.longestPrefix("r", matched) == nullptr);     // the split node holds no value
+}
+
+TEST_CASE("RadixTrie: forEachPrefix visits stored prefixes, shortest first", "[radix_trie]")
+{
+  RadixTrie<int> trie;
+  trie["com."]         = 1;
+  trie["com.example."] = 2;
+  trie["com.ex"]       = 3;
+  trie["org."]         = 4;
+
+  CHECK(prefixesOf(trie, "com.example.www.") == Prefixes{{4, 1}, {6, 3}, {12, 2}});
+  CHECK(prefixesOf(trie, "com.example.") == Prefixes{{4, 1}, {6, 3}, {12, 2}});
+  CHECK(prefixesOf(trie, "com.exa") == Prefixes{{4, 1}, {6, 3}});
+  CHECK(prefixesOf(trie, "co").empty());
+  CHECK(prefixesOf(trie, "net.").empty());
+}
+
+TEST_CASE("RadixTrie: the empty key is a prefix of every key", "[radix_trie]")
+{
+  RadixTrie<int> trie;
+  trie[""]  = 9;
+  trie["a"] = 1;
+
+  CHECK(prefixesOf(trie, "") == Prefixes{{0, 9}});
+  CHECK(prefixesOf(trie, "ab") == Prefixes{{0, 9}, {1, 1}});
+  size_t matched = 1;
+  REQUIRE(trie.longestPrefix("b", matched) != nullptr);
+  CHECK(matched == 0);
+}
+
+TEST_CASE("RadixTrie: forEachPrefix stops when visit returns false", "[radix_trie]")
+{
+  RadixTrie<int> trie;
+  trie["a"]   = 1;
+  trie["ab"]  = 2;
+  trie["abc"] = 3;
+
+  std::vector<int> seen;
+  trie.forEachPrefix("abcd", [&](size_t, int value) {
+    seen.push_back(value);
+    return value < 2;
+  });
+  CHECK(seen == std::vector<int>{1, 2});
+}
+
+TEST_CASE("RadixTrie: a key that diverges inside an edge does not match it", "[radix_trie]")
+{
+  RadixTrie<int> trie;
+  trie["images/"] = 1;
+
+  size_t matched = 0;
+  CHECK(trie.longestPrefix("imagex/", matched) == nullptr);
+  CHECK(trie.longestPrefix("images", matched) == nullptr);
+  REQUIRE(trie.longestPrefix("images/a.png", matched) != nullptr);
+  CHECK(matched == 7);
+}
+
+TEST_CASE("RadixTrie: keys sort by first byte among siblings", "[radix_trie]")
+{
+  RadixTrie<int> trie;
+  const std::vector<std::string> keys = {"m", "z", "a", "q", "b", "\xff", std::string{"\0", 1}};
+  for (size_t i = 0; i < keys.size(); ++i) {
+    trie[keys[i]] = static_cast<int>(i) + 1;
+  }
+  for (size_t i = 0; i < keys.size(); ++i) {
+    CAPTURE(i);
+    CHECK(prefixesOf(trie, keys[i]) == Prefixes{{1, static_cast<int>(i) + 1}});
+  }
+}
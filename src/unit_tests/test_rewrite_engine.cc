@@ -0,0 +1,172 @@
+/**
+ * @file test_rewrite_engine.cc
+ * @brief Unit tests for rewrite_engine of rewrite-engine.h, the rules of the
+ * remap plugin.
+ */
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#define CATCH_CONFIG_MAIN /* include main function */
+#include <catch.hpp>      /* catch unit-test framework */
+#include "rewrite-engine.h"
+
+namespace
+{
+// Returns "new-host new-path" for the rule that rewrites host and path, with
+// "-" for a kept host, or an empty string when no rule matches.
+std::string
+rewrite(const rewrite_engine &rules, std::string_view host, std::string_view path)
+{
+  size_t matched                      = 0;
+  const rewrite_engine::target *match = rules.match(host, path, matched);
+  if (!match) {
+    return {};
+  }
+  std::string new_path;
+  rewrite_engine::rewrite_path(*match, path, matched, new_path);
+  return (match->host.empty() ? std::string{"-"} : match->host) + " " + new_path;
+}
+
+// Writes text to a temporary file and returns its path.
+std::string
+writeRules(std::string_view text)
+{
+  char path[] = "/tmp/test_rewrite_engine.XXXXXX";
+  int fd      = mkstemp(path);
+  REQUIRE(fd != -1);
+  REQUIRE(write(fd, text.data(), text.size()) == static_cast<ssize_t>(text.size()));
+  close(fd);
+  return path;
+}
+} // namespace
+
+TEST_CASE("rewrite_engine: exact hosts match without regard to case", "[rewrite_engine]")
+{
+  rewrite_engine rules;
+  rules.add_rule("www.example.com", "/img", "cdn.example.net", "/pics");
+  CHECK(rewrite(rules, "www.example.com", "img/a.png") == "cdn.example.net pics/a.png");
+  CHECK(rewrite(rules, "WWW.Example.COM", "img/a.png") == "cdn.example.net pics/a.png");
+  CHECK(rewrite(rules, "example.com", "img/a.png").empty());
+  CHECK(rewrite(rules, "a.www.example.com", "img/a.png").empty());
+  CHECK(rewrite(rules, "www.example.org", "img/a.png").empty());
+}
+
+TEST_CASE("rewrite_engine: *. matches every subdomain but not the domain", "[rewrite_engine]")
+{
+  rewrite_engine rules;
+  rules.add_rule("*.example.com", "/", "-", "/v2");
+  CHECK(rewrite(rules, "a.example.com", "x") == "- v2/x");
+  CHECK(rewrite(rules, "a.b.example.com", "x") == "- v2/x");
+  CHECK(rewrite(rules, "example.com", "x").empty());
+  CHECK(rewrite(rules, "badexample.com", "x").empty());
+}
+
+TEST_CASE("rewrite_engine: a bare *. rule matches every host", "[rewrite_engine]")
+{
+  rewrite_engine rules;
+  rules.add_rule("*.", "/", "fallback", "/");
+  CHECK(rewrite(rules, "example.com", "a/b") == "fallback a/b");
+  CHECK(rewrite(rules, "localhost", "") == "fallback ");
+}
+
+TEST_CASE("rewrite_engine: an exact host wins over wildcards and a longer wildcard over a shorter", "[rewrite_engine]")
+{
+  rewrite_engine rules;
+  rules.add_rule("*.com", "/", "com", "/");
+  rules.add_rule("*.example.com", "/", "wildcard", "/");
+  rules.add_rule("www.example.com", "/", "exact", "/");
+  CHECK(rewrite(rules, "www.example.com", "a") == "exact a");
+  CHECK(rewrite(rules, "img.example.com", "a") == "wildcard a");
+  CHECK(rewrite(rules, "example.com", "a") == "com a");
+}
+
+TEST_CASE("rewrite_engine: a host falls back to wildcards when none of its paths match", "[rewrite_engine]")
+{
+  rewrite_engine rules;
+  rules.add_rule("*.example.com", "/", "wildcard", "/");
+  rules.add_rule("www.example.com", "/img", "exact", "/");
+  CHECK(rewrite(rules, "www.example.com", "img/a") == "exact a");
+  CHECK(rewrite(rules, "www.example.com", "css/a") == "wildcard css/a");
+}
+
+TEST_CASE("rewrite_engine: prefixes match whole path segments only", "[rewrite_engine]")
+{
+  rewrite_engine rules;
+  rules.add_rule("h", "/img", "-", "/pics");
+  CHECK(rewrite(rules, "h", "img") == "- pics");
+  CHECK(rewrite(rules, "h", "img/") == "- pics/");
+  CHECK(rewrite(rules, "h", "img/a.png") == "- pics/a.png");
+  CHECK(rewrite(rules, "h", "images/a.png").empty());
+  CHECK(rewrite(rules, "h", "im").empty());
+}
+
+TEST_CASE("rewrite_engine: the longest matching prefix wins", "[rewrite_engine]")
+{
+  rewrite_engine rules;
+  rules.add_rule("h", "/", "-", "/root");
+  rules.add_rule("h", "/a", "-", "/one");
+  rules.add_rule("h", "/a/b", "-", "/two");
+  CHECK(rewrite(rules, "h", "a/b/c") == "- two/c");
+  CHECK(rewrite(rules, "h", "a/bc") == "- one/bc");
+  CHECK(rewrite(rules, "h", "ab") == "- root/ab");
+}
+
+TEST_CASE("rewrite_engine: joins leave exactly one '/' between the new prefix and the rest", "[rewrite_engine]")
+{
+  struct {
+    const char *prefix;
+    const char *new_prefix;
+    const char *path;
+    const char *expected;
+  } cases[] = {
+    {"/",       "/v2",    "a.png",     "- v2/a.png"  },
+    {"/",       "/v2/",   "a.png",     "- v2/a.png"  },
+    {"/img/",   "/pics",  "img/a.png", "- pics/a.png"},
+    {"/img",    "/pics/", "img/a.png", "- pics/a.png"},
+    {"/img",    "/",      "img/a.png", "- a.png"     },
+    {"/img/",   "/",      "img/",      "- "          },
+    {"/",       "/",      "a/b",       "- a/b"       },
+    {"//img//", "/pics",  "img/a.png", "- pics/a.png"},
+  };
+  for (const auto &c : cases) {
+    rewrite_engine rules;
+    rules.add_rule("h", c.prefix, "-", c.new_prefix);
+    INFO(c.prefix << " -> " << c.new_prefix << " on " << c.path);
+    CHECK(rewrite(rules, "h", c.path) == c.expected);
+  }
+}
+
+TEST_CASE("rewrite_engine: hosts too long for a key match nothing and empty labels stay in bounds", "[rewrite_engine]")
+{
+  rewrite_engine rules;
+  rules.add_rule("*.", "/", "any", "/");
+  CHECK(rewrite(rules, std::string(300, 'a'), "x").empty());
+  CHECK(rewrite(rules, std::string(128, '.'), "x") == "any x");
+}
+
+TEST_CASE("rewrite_engine: load reads rules and reports malformed lines", "[rewrite_engine]")
+{
+  std::string path = writeRules("# comment\n"
+                                "\n"
+                                "www.example.com /img cdn.example.net /pics\n"
+                                "*.example.com / - /v2\n");
+  rewrite_engine rules;
+  std::string error;
+  REQUIRE(rules.load(path, error));
+  CHECK(rules.size() == 2);
+  CHECK(rewrite(rules, "www.example.com", "img/a") == "cdn.example.net pics/a");
+  CHECK(rewrite(rules, "a.example.com", "a") == "- v2/a");
+  std::remove(path.c_str());
+
+  path = writeRules("www.example.com /img cdn.example.net /pics\n"
+                    "www.example.com /img\n");
+  rewrite_engine broken;
+  CHECK_FALSE(broken.load(path, error));
+  CHECK(error == path + ":2: expected host path-prefix new-host new-path-prefix");
+  std::remove(path.c_str());
+
+  CHECK_FALSE(broken.load("/nonexistent/rules", error));
+  CHECK(error == "cannot open /nonexistent/rules");
+}
@@ -0,0 +1,209 @@
+/**
+ * @file ts_mime_mock.h
+ * @brief A mock of the TS MIME header and transaction API, enough to run the
+ * header helpers of include/ outside of traffic_server.
+ *
+ * A TSMLoc header location is a MockHeader and a TSHttpTxn is a MockTxn; the
+ * marshal buffer is not used. Every MockHeader and MockTxn is independent, so
+ * threads that each use their own may call the mock concurrently. Include it
+ * from exactly one source file of a test.
+ */
+
+#pragma once
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "ts/ts.h"
+
+struct MockField {
+  std::string name;
+  std::string value;
+  bool has_value = false;
+};
+
+struct MockHeader {
+  std::deque<MockField> created;   // every field created, appended or not
+  std::vector<MockField *> fields; // the appended fields, in order
+  std::string path;                // the path of the request URL
+  int open_handles = 0;            // field and URL handles not yet released
+  int refuse_after = -1;           // fail field creation after this many fields, if not negative
+  int url_lookups  = 0;
+
+  TSMLoc
+  loc()
+  {
+    return reinterpret_cast<TSMLoc>(this);
+  }
+
+  void
+  clear()
+  {
+    created.clear();
+    fields.clear();
+    open_handles = 0;
+    url_lookups  = 0;
+  }
+
+  std::string_view
+  value(std::string_view name) const
+  {
+    for (const MockField *field : fields) {
+      if (field->name == name) {
+        return field->value;
+      }
+    }
+    return {};
+  }
+};
+
+struct MockTxn {
+  uint64_t id = 0;
+  sockaddr_storage client{};
+
+  TSHttpTxn
+  txn()
+  {
+    return reinterpret_cast<TSHttpTxn>(this);
+  }
+
+  void
+  setClient(int family, const char *text)
+  {
+    client.ss_family = family;
+    if (family == AF_INET) {
+      inet_pton(AF_INET, text, &reinterpret_cast<sockaddr_in *>(&client)->sin_addr);
+    } else {
+      inet_pton(AF_INET6, text, &reinterpret_cast<sockaddr_in6 *>(&client)->sin6_addr);
+    }
+  }
+};
+
+namespace
+{
+MockHeader *
+mockHeader(TSMLoc loc)
+{
+  return reinterpret_cast<MockHeader *>(loc);
+}
+} // namespace
+
+TSReturnCode
+TSMimeHdrFieldCreateNamed(TSMBuffer, TSMLoc hdr_loc, const char *name, int name_len, TSMLoc *locp)
+{
+  MockHeader *hdr = mockHeader(hdr_loc);
+  if (hdr->refuse_after >= 0 && static_cast<int>(hdr->created.size()) >= hdr->refuse_after) {
+    return TS_ERROR;
+  }
+  hdr->created.push_back({std::string{name, static_cast<size_t>(name_len)}, {}, false});
+  ++hdr->open_handles;
+  *locp = reinterpret_cast<TSMLoc>(&hdr->created.back());
+  return TS_SUCCESS;
+}
+
+TSReturnCode
+TSMimeHdrFieldCreate(TSMBuffer, TSMLoc hdr_loc, TSMLoc *locp)
+{
+  MockHeader *hdr = mockHeader(hdr_loc);
+  hdr->created.push_back({});
+  ++hdr->open_handles;
+  *locp = reinterpret_cast<TSMLoc>(&hdr->created.back());
+  return TS_SUCCESS;
+}
+
+TSReturnCode
+TSMimeHdrFieldCopy(TSMBuffer, TSMLoc, TSMLoc dest_field, TSMBuffer, TSMLoc, TSMLoc src_field)
+{
+  *reinterpret_cast<MockField *>(dest_field) = *reinterpret_cast<MockField *>(src_field);
+  return TS_SUCCESS;
+}
+
+// Returns the appended field at idx, or TS_NULL_MLOC past the last one.
+TSMLoc
+TSMimeHdrFieldGet(TSMBuffer, TSMLoc hdr_loc, int idx)
+{
+  MockHeader *hdr = mockHeader(hdr_loc);
+  if (idx < 0 || idx >= static_cast<int>(hdr->fields.size())) {
+    return TS_NULL_MLOC;
+  }
+  ++hdr->open_handles;
+  return reinterpret_cast<TSMLoc>(hdr->fields[idx]);
+}
+
+TSMLoc
+TSMimeHdrFieldNext(TSMBuffer bufp, TSMLoc hdr_loc, TSMLoc field)
+{
+  MockHeader *hdr = mockHeader(hdr_loc);
+  for (size_t i = 0; i < hdr->fields.size(); ++i) {
+    if (reinterpret_cast<TSMLoc>(hdr->fields[i]) == field) {
+      return TSMimeHdrFieldGet(bufp, hdr_loc, static_cast<int>(i + 1));
+    }
+  }
+  return TS_NULL_MLOC;
+}
+
+TSReturnCode
+TSMimeHdrFieldValueStringSet(TSMBuffer, TSMLoc, TSMLoc field_loc, int, const char *value, int length)
+{
+  // traffic_server refuses a null value, even an empty one.
+  if (!value || length < 0) {
+    return TS_ERROR;
+  }
+  MockField *field = reinterpret_cast<MockField *>(field_loc);
+  field->value.assign(value, length);
+  field->has_value = true;
+  return TS_SUCCESS;
+}
+
+TSReturnCode
+TSMimeHdrFieldAppend(TSMBuffer, TSMLoc hdr_loc, TSMLoc field_loc)
+{
+  mockHeader(hdr_loc)->fields.push_back(reinterpret_cast<MockField *>(field_loc));
+  return TS_SUCCESS;
+}
+
+TSReturnCode
+TSHandleMLocRelease(TSMBuffer, TSMLoc parent, TSMLoc)
+{
+  --mockHeader(parent)->open_handles;
+  return TS_SUCCESS;
+}
+
+TSReturnCode
+TSHttpHdrUrlGet(TSMBuffer, TSMLoc hdr_loc, TSMLoc *locp)
+{
+  MockHeader *hdr = mockHeader(hdr_loc);
+  ++hdr->open_handles;
+  ++hdr->url_lookups;
+  *locp = hdr_loc;
+  return TS_SUCCESS;
+}
+
+const char *
+TSUrlPathGet(TSMBuffer, TSMLoc url_loc, int *length)
+{
+  const std::string &path = mockHeader(url_loc)->path;
+  *length                 = static_cast<int>(path.size());
+  return path.data();
+}
+
+uint64_t
+TSHttpTxnIdGet(TSHttpTxn txnp)
+{
+  return reinterpret_cast<MockTxn *>(txnp)->id;
+}
+
+const sockaddr *
+TSHttpTxnClientAddrGet(TSHttpTxn txnp)
+{
+  MockTxn *txn = reinterpret_cast<MockTxn *>(txnp);
+  return txn->client.ss_family == AF_UNSPEC ? nullptr : reinterpret_cast<const sockaddr *>(&txn->client);
+}
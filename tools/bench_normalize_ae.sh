@@ -0,0 +1,58 @@
+#!/bin/sh
+#
+# Compares the native normalize_ae plugin with the tslua script it replaced.
+#
+# Both run as remap plugins on the two mappings of etc/remap.config,
+#
+#   map /normalize-ae     ... @plugin=normalize_ae.so @pparam=--ats-mode=3
+#   map /normalize-ae-lua ... @plugin=tslua.so @pparam=normalize_accept_encoding.lua @pparam=3
+#
+# which forward to the same origin, so any difference in throughput and
+# latency between them is the cost of normalizing Accept-Encoding. For each
+# Accept-Encoding value below, wrk loads one mapping and then the other with
+# the same number of connections for the same time.
+#
+# Usage: tools/bench_normalize_ae.sh [proxy-url] [seconds] [connections]
+#
+#   proxy-url    traffic_server's HTTP port (default http://127.0.0.1:8080)
+#   seconds      duration of each run (default 10)
+#   connections  concurrent connections (default 64)
+#
+# Run it on the traffic_server host against a local origin, so that the
+# network does not drown out the plugins.
+
+set -eu
+
+PROXY=${1:-http://127.0.0.1:8080}
+DURATION=${2:-10}
+CONNECTIONS=${3:-64}
+THREADS=${THREADS:-4}
+
+if ! command -v wrk >/dev/null 2>&1; then
+  echo "$0: wrk is required, see https://github.com/wg/wrk" >&2
+  exit 1
+fi
+
+# A mix of what browsers, CDNs and scripts send, from trivial to long.
+VALUES='gzip
+gzip, deflate, br
+gzip, deflate, br, zstd
+br;q=1.0, gzip;q=0.8, *;q=0.1
+identity
+x-gzip;q=0.5, deflate;q=0.3, compress, identity;q=0.1'
+
+run() {
+  # $1 mapping, $2 Accept-Encoding value
+  wrk -t "$THREADS" -c "$CONNECTIONS" -d "${DURATION}s" --latency -H "Accept-Encoding: $2" "$PROXY$1/" |
+    awk -v path="$1" '
+      /Requests\/sec/ { rps = $2 }
+      /^ +50%/        { p50 = $2 }
+      /^ +99%/        { p99 = $2 }
+      END             { printf "  %-18s %12s req/s   p50 %8s   p99 %8s\n", path, rps, p50, p99 }'
+}
+
+echo "$VALUES" | while IFS= read -r value; do
+  echo "Accept-Encoding: $value"
+  run /normalize-ae "$value"
+  run /normalize-ae-lua "$value"
+done